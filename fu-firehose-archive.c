@@ -0,0 +1,717 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "fu-firehose-archive.h"
+
+typedef struct {
+	gchar			*fn;		/* without any path */
+	guint64			 size;
+	gboolean		 size_is_set;
+	GBytes			*header;	/* cached */
+	GBytes			*data;		/* only cached when shared */
+} FuFirehoseArchiveEntry;
+
+/* archives in use, by checksum */
+static GMutex fu_firehose_archive_shared_mutex;
+static GHashTable *fu_firehose_archive_shared = NULL;
+
+typedef struct archive _archive_read_ctx;
+
+static void
+_archive_read_ctx_free (_archive_read_ctx *arch)
+{
+	archive_read_close (arch);
+	archive_read_free (arch);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(_archive_read_ctx, _archive_read_ctx_free)
+
+static void
+fu_firehose_archive_entry_free (FuFirehoseArchiveEntry *entry)
+{
+	if (entry->header != NULL)
+		g_bytes_unref (entry->header);
+	if (entry->data != NULL)
+		g_bytes_unref (entry->data);
+	g_free (entry->fn);
+	g_free (entry);
+}
+
+static const gchar *
+fu_firehose_archive_basename (const gchar *fn)
+{
+	const gchar *tmp = strrchr (fn, '/');
+	return tmp != NULL ? tmp + 1 : fn;
+}
+
+static _archive_read_ctx *
+fu_firehose_archive_open (FuFirehoseArchive *self, GError **error)
+{
+	g_autoptr(_archive_read_ctx) arch = archive_read_new ();
+	gsize bufsz = 0;
+	const guint8 *buf = g_bytes_get_data (self->blob, &bufsz);
+
+	archive_read_support_format_all (arch);
+	archive_read_support_filter_all (arch);
+	if (archive_read_open_memory (arch, (void *) buf, bufsz) != ARCHIVE_OK) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "failed to open archive: %s",
+			     archive_error_string (arch));
+		return NULL;
+	}
+	return g_steal_pointer (&arch);
+}
+
+static FuFirehoseArchiveEntry *
+fu_firehose_archive_lookup (FuFirehoseArchive *self, const gchar *fn, GError **error)
+{
+	for (guint i = 0; i < self->entries->len; i++) {
+		FuFirehoseArchiveEntry *entry = g_ptr_array_index (self->entries, i);
+		if (g_strcmp0 (entry->fn, fn) == 0)
+			return entry;
+	}
+	g_set_error (error,
+		     G_IO_ERROR,
+		     G_IO_ERROR_NOT_FOUND,
+		     "no blob for %s", fn);
+	return NULL;
+}
+
+/* only the headers are read, the zip reader seeks over the entry data */
+FuFirehoseArchive *
+fu_firehose_archive_new (GBytes *blob, GError **error)
+{
+	g_autoptr(FuFirehoseArchive) self = g_new0 (FuFirehoseArchive, 1);
+	g_autoptr(_archive_read_ctx) arch = NULL;
+
+	self->refcount = 1;
+	g_mutex_init (&self->mutex);
+	self->blob = g_bytes_ref (blob);
+	self->entries = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_firehose_archive_entry_free);
+	arch = fu_firehose_archive_open (self, error);
+	if (arch == NULL)
+		return NULL;
+	while (TRUE) {
+		FuFirehoseArchiveEntry *entry;
+		struct archive_entry *aentry = NULL;
+		const gchar *fn;
+		gint r = archive_read_next_header (arch, &aentry);
+		if (r == ARCHIVE_EOF)
+			break;
+		if (r != ARCHIVE_OK) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "cannot read header: %s",
+				     archive_error_string (arch));
+			return NULL;
+		}
+		fn = archive_entry_pathname (aentry);
+		if (fn == NULL)
+			continue;
+		entry = g_new0 (FuFirehoseArchiveEntry, 1);
+		entry->fn = g_strdup (fu_firehose_archive_basename (fn));
+		entry->size_is_set = archive_entry_size_is_set (aentry);
+		if (entry->size_is_set)
+			entry->size = archive_entry_size (aentry);
+		g_ptr_array_add (self->entries, entry);
+		archive_read_data_skip (arch);
+	}
+	return g_steal_pointer (&self);
+}
+
+/* devices flashing the same cabinet at the same time get the same archive */
+FuFirehoseArchive *
+fu_firehose_archive_new_shared (GBytes *blob, GError **error)
+{
+	FuFirehoseArchive *self;
+	g_autofree gchar *checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, blob);
+
+	g_mutex_lock (&fu_firehose_archive_shared_mutex);
+	if (fu_firehose_archive_shared == NULL)
+		fu_firehose_archive_shared = g_hash_table_new (g_str_hash, g_str_equal);
+	self = g_hash_table_lookup (fu_firehose_archive_shared, checksum);
+	if (self != NULL) {
+		fu_firehose_archive_ref (self);
+		g_mutex_unlock (&fu_firehose_archive_shared_mutex);
+		return self;
+	}
+	g_mutex_unlock (&fu_firehose_archive_shared_mutex);
+
+	/* scanned outside the lock, the first one to finish wins */
+	self = fu_firehose_archive_new (blob, error);
+	if (self == NULL)
+		return NULL;
+	self->checksum = g_steal_pointer (&checksum);
+	g_mutex_lock (&fu_firehose_archive_shared_mutex);
+	if (g_hash_table_lookup (fu_firehose_archive_shared, self->checksum) == NULL)
+		g_hash_table_insert (fu_firehose_archive_shared, self->checksum, self);
+	g_mutex_unlock (&fu_firehose_archive_shared_mutex);
+	return self;
+}
+
+FuFirehoseArchive *
+fu_firehose_archive_ref (FuFirehoseArchive *self)
+{
+	g_atomic_int_inc (&self->refcount);
+	return self;
+}
+
+void
+fu_firehose_archive_unref (FuFirehoseArchive *self)
+{
+	/* the registry lock stops a lookup racing with the last unref */
+	g_mutex_lock (&fu_firehose_archive_shared_mutex);
+	if (!g_atomic_int_dec_and_test (&self->refcount)) {
+		g_mutex_unlock (&fu_firehose_archive_shared_mutex);
+
+		/* the last user does not need to keep what it already has */
+		if (g_atomic_int_get (&self->refcount) == 1) {
+			g_mutex_lock (&self->mutex);
+			for (guint i = 0; i < self->entries->len; i++) {
+				FuFirehoseArchiveEntry *entry = g_ptr_array_index (self->entries, i);
+				g_clear_pointer (&entry->data, g_bytes_unref);
+			}
+			g_mutex_unlock (&self->mutex);
+		}
+		return;
+	}
+	if (self->checksum != NULL &&
+	    g_hash_table_lookup (fu_firehose_archive_shared, self->checksum) == self)
+		g_hash_table_remove (fu_firehose_archive_shared, self->checksum);
+	g_mutex_unlock (&fu_firehose_archive_shared_mutex);
+
+	if (self->entries != NULL)
+		g_ptr_array_unref (self->entries);
+	g_bytes_unref (self->blob);
+	g_mutex_clear (&self->mutex);
+	g_free (self->cachedir);
+	g_free (self->checksum);
+	g_free (self);
+}
+
+const gchar *
+fu_firehose_archive_find_by_prefix (FuFirehoseArchive *self, const gchar *prefix)
+{
+	for (guint i = 0; i < self->entries->len; i++) {
+		FuFirehoseArchiveEntry *entry = g_ptr_array_index (self->entries, i);
+		if (g_str_has_prefix (entry->fn, prefix))
+			return entry->fn;
+	}
+	return NULL;
+}
+
+/* the number in @fn between @prefix and @suffix, or -1 if there is
+ * anything else there */
+static gint64
+fu_firehose_archive_get_number (const gchar *fn, const gchar *prefix, const gchar *suffix)
+{
+	gsize fnlen = strlen (fn);
+	gsize prefixlen = strlen (prefix);
+	gsize suffixlen = strlen (suffix);
+	gint64 number = 0;
+
+	if (!g_str_has_prefix (fn, prefix) || !g_str_has_suffix (fn, suffix))
+		return -1;
+	if (fnlen <= prefixlen + suffixlen || fnlen - prefixlen - suffixlen > 9)
+		return -1;
+	for (gsize i = prefixlen; i < fnlen - suffixlen; i++) {
+		if (!g_ascii_isdigit (fn[i]))
+			return -1;
+		number = number * 10 + (fn[i] - '0');
+	}
+	return number;
+}
+
+typedef struct {
+	const gchar		*fn;
+	gint64			 number;
+} FuFirehoseArchiveNumbered;
+
+static gint
+fu_firehose_archive_numbered_sort_cb (gconstpointer a, gconstpointer b)
+{
+	const FuFirehoseArchiveNumbered *item1 = a;
+	const FuFirehoseArchiveNumbered *item2 = b;
+	if (item1->number < item2->number)
+		return -1;
+	if (item1->number > item2->number)
+		return 1;
+	return 0;
+}
+
+/* returns the names of all the entries that are exactly @prefix, a
+ * decimal number and @suffix, e.g. rawprogram3.xml but not
+ * rawprogram0_BLANK_GPT.xml, sorted by that number */
+GPtrArray *
+fu_firehose_archive_find_numbered (FuFirehoseArchive *self,
+				   const gchar *prefix,
+				   const gchar *suffix)
+{
+	GPtrArray *fns = g_ptr_array_new ();
+	g_autoptr(GArray) items = g_array_new (FALSE, FALSE, sizeof(FuFirehoseArchiveNumbered));
+
+	for (guint i = 0; i < self->entries->len; i++) {
+		FuFirehoseArchiveEntry *entry = g_ptr_array_index (self->entries, i);
+		FuFirehoseArchiveNumbered item = { entry->fn, -1 };
+		item.number = fu_firehose_archive_get_number (entry->fn, prefix, suffix);
+		if (item.number >= 0)
+			g_array_append_val (items, item);
+	}
+	g_array_sort (items, fu_firehose_archive_numbered_sort_cb);
+	for (guint i = 0; i < items->len; i++)
+		g_ptr_array_add (fns, (gpointer) g_array_index (items, FuFirehoseArchiveNumbered, i).fn);
+	return fns;
+}
+
+gboolean
+fu_firehose_archive_get_size (FuFirehoseArchive *self,
+			      const gchar *fn,
+			      guint64 *size,
+			      GError **error)
+{
+	FuFirehoseArchiveEntry *entry = fu_firehose_archive_lookup (self, fn, error);
+	if (entry == NULL)
+		return FALSE;
+	if (!entry->size_is_set) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_NOT_SUPPORTED,
+			     "size of %s not known", fn);
+		return FALSE;
+	}
+	*size = entry->size;
+	return TRUE;
+}
+
+/* returns a reader positioned at the data of @entry */
+static _archive_read_ctx *
+fu_firehose_archive_open_entry (FuFirehoseArchive *self,
+				FuFirehoseArchiveEntry *entry,
+				GError **error)
+{
+	g_autoptr(_archive_read_ctx) arch = NULL;
+
+	arch = fu_firehose_archive_open (self, error);
+	if (arch == NULL)
+		return NULL;
+	while (TRUE) {
+		struct archive_entry *aentry = NULL;
+		gint r = archive_read_next_header (arch, &aentry);
+		if (r == ARCHIVE_EOF)
+			break;
+		if (r != ARCHIVE_OK) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "cannot read header: %s",
+				     archive_error_string (arch));
+			return NULL;
+		}
+		if (archive_entry_pathname (aentry) != NULL &&
+		    g_strcmp0 (fu_firehose_archive_basename (archive_entry_pathname (aentry)),
+			       entry->fn) == 0)
+			return g_steal_pointer (&arch);
+		archive_read_data_skip (arch);
+	}
+	g_set_error (error,
+		     G_IO_ERROR,
+		     G_IO_ERROR_NOT_FOUND,
+		     "no blob for %s", entry->fn);
+	return NULL;
+}
+
+/* decompresses at most @maxsz bytes from the start of @fn */
+static GBytes *
+fu_firehose_archive_read (FuFirehoseArchive *self,
+			  FuFirehoseArchiveEntry *entry,
+			  gsize maxsz,
+			  GError **error)
+{
+	g_autoptr(_archive_read_ctx) arch = NULL;
+	g_autofree guint8 *buf = NULL;
+	gsize bufsz;
+	gsize offset = 0;
+
+	arch = fu_firehose_archive_open_entry (self, entry, error);
+	if (arch == NULL)
+		return NULL;
+
+	/* grow as needed if the directory did not include the size */
+	bufsz = entry->size_is_set ? MIN (entry->size, maxsz) : MIN (maxsz, 0x10000);
+	buf = g_malloc (MAX (bufsz, 1));
+	while (offset < maxsz) {
+		gssize len;
+		if (offset == bufsz) {
+			if (entry->size_is_set)
+				break;
+			bufsz = MIN (bufsz * 2, maxsz);
+			buf = g_realloc (buf, bufsz);
+		}
+		len = archive_read_data (arch, buf + offset, bufsz - offset);
+		if (len < 0) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "cannot read data from %s: %s",
+				     entry->fn, archive_error_string (arch));
+			return NULL;
+		}
+		if (len == 0)
+			break;
+		offset += len;
+	}
+	if (entry->size_is_set && offset != bufsz) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "%s truncated", entry->fn);
+		return NULL;
+	}
+	return g_bytes_new_take (g_steal_pointer (&buf), offset);
+}
+
+/* keeps decompressed entries in @basedir so the next device flashing the
+ * same firmware can map them instead of decompressing them again */
+gboolean
+fu_firehose_archive_set_cache_dir (FuFirehoseArchive *self,
+				   const gchar *basedir,
+				   GError **error)
+{
+	g_autofree gchar *cachedir = NULL;
+
+	if (self->checksum == NULL)
+		self->checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, self->blob);
+	cachedir = g_build_filename (basedir, self->checksum, NULL);
+	if (g_mkdir_with_parents (cachedir, 0700) != 0) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_FAILED,
+			     "failed to create %s", cachedir);
+		return FALSE;
+	}
+
+	/* the age of the directory is when the firmware was last used */
+	g_utime (cachedir, NULL);
+	g_mutex_lock (&self->mutex);
+	if (self->cachedir == NULL)
+		self->cachedir = g_steal_pointer (&cachedir);
+	g_mutex_unlock (&self->mutex);
+	return TRUE;
+}
+
+static GBytes *
+fu_firehose_archive_cache_lookup (FuFirehoseArchive *self, const gchar *name)
+{
+	g_autofree gchar *fn = NULL;
+	g_autoptr(GMappedFile) mapped = NULL;
+
+	if (self->cachedir == NULL)
+		return NULL;
+	fn = g_build_filename (self->cachedir, name, NULL);
+	if (!g_file_test (fn, G_FILE_TEST_EXISTS))
+		return NULL;
+	mapped = g_mapped_file_new (fn, FALSE, NULL);
+	if (mapped == NULL)
+		return NULL;
+	return g_mapped_file_get_bytes (mapped);
+}
+
+/* the cache is only an optimisation, so failing to write it is not fatal;
+ * the entry is returned mapped from the file so it is backed by the page
+ * cache rather than the heap */
+static GBytes *
+fu_firehose_archive_cache_store (FuFirehoseArchive *self, const gchar *name, GBytes *data)
+{
+	GBytes *mapped;
+	g_autofree gchar *fn = NULL;
+	g_autoptr(GError) error_local = NULL;
+
+	if (self->cachedir == NULL)
+		return g_bytes_ref (data);
+	fn = g_build_filename (self->cachedir, name, NULL);
+	if (!g_file_set_contents (fn,
+				  g_bytes_get_data (data, NULL),
+				  g_bytes_get_size (data),
+				  &error_local)) {
+		g_debug ("failed to cache %s: %s", name, error_local->message);
+		return g_bytes_ref (data);
+	}
+	mapped = fu_firehose_archive_cache_lookup (self, name);
+	return mapped != NULL ? mapped : g_bytes_ref (data);
+}
+
+/* an image that was decompressed by a #FuFirehoseArchiveStream before */
+GBytes *
+fu_firehose_archive_get_unpacked (FuFirehoseArchive *self, const gchar *fn)
+{
+	g_autofree gchar *name = g_strdup_printf ("%s.unpacked", fn);
+	return fu_firehose_archive_cache_lookup (self, name);
+}
+
+/* enough of the start of @fn to identify the format */
+GBytes *
+fu_firehose_archive_get_header (FuFirehoseArchive *self, const gchar *fn, GError **error)
+{
+	FuFirehoseArchiveEntry *entry = fu_firehose_archive_lookup (self, fn, error);
+	g_autoptr(GBytes) header = NULL;
+
+	if (entry == NULL)
+		return NULL;
+	g_mutex_lock (&self->mutex);
+	if (entry->header != NULL)
+		header = g_bytes_ref (entry->header);
+	g_mutex_unlock (&self->mutex);
+	if (header != NULL)
+		return g_steal_pointer (&header);
+
+	header = fu_firehose_archive_read (self, entry, FU_FIREHOSE_ARCHIVE_HEADER_SIZE, error);
+	if (header == NULL)
+		return NULL;
+	g_mutex_lock (&self->mutex);
+	if (entry->header == NULL)
+		entry->header = g_bytes_ref (header);
+	g_mutex_unlock (&self->mutex);
+	return g_steal_pointer (&header);
+}
+
+/* decompresses @fn; unless other devices are using the archive too the
+ * caller owns the only reference, so the memory is released as soon as it
+ * is done with the entry */
+GBytes *
+fu_firehose_archive_get_bytes (FuFirehoseArchive *self, const gchar *fn, GError **error)
+{
+	FuFirehoseArchiveEntry *entry = fu_firehose_archive_lookup (self, fn, error);
+	g_autoptr(GBytes) data = NULL;
+
+	if (entry == NULL)
+		return NULL;
+	g_mutex_lock (&self->mutex);
+	if (entry->data != NULL)
+		data = g_bytes_ref (entry->data);
+	g_mutex_unlock (&self->mutex);
+	if (data != NULL)
+		return g_steal_pointer (&data);
+
+	data = fu_firehose_archive_cache_lookup (self, fn);
+	if (data == NULL) {
+		g_autoptr(GBytes) data_heap = NULL;
+		data_heap = fu_firehose_archive_read (self, entry, G_MAXSIZE, error);
+		if (data_heap == NULL)
+			return NULL;
+		data = fu_firehose_archive_cache_store (self, fn, data_heap);
+	}
+	g_mutex_lock (&self->mutex);
+	if (g_atomic_int_get (&self->refcount) > 1 && entry->data == NULL)
+		entry->data = g_bytes_ref (data);
+	g_mutex_unlock (&self->mutex);
+	return g_steal_pointer (&data);
+}
+
+/* partition images may themselves be compressed inside the zip */
+gboolean
+fu_firehose_archive_is_compressed (GBytes *header)
+{
+	const guint8 magic_gzip[] = { 0x1f, 0x8b };
+	const guint8 magic_xz[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+	const guint8 magic_zstd[] = { 0x28, 0xb5, 0x2f, 0xfd };
+	gsize bufsz = 0;
+	const guint8 *buf = g_bytes_get_data (header, &bufsz);
+
+	if (bufsz >= sizeof(magic_gzip) && memcmp (buf, magic_gzip, sizeof(magic_gzip)) == 0)
+		return TRUE;
+	if (bufsz >= sizeof(magic_xz) && memcmp (buf, magic_xz, sizeof(magic_xz)) == 0)
+		return TRUE;
+	if (bufsz >= sizeof(magic_zstd) && memcmp (buf, magic_zstd, sizeof(magic_zstd)) == 0)
+		return TRUE;
+	return FALSE;
+}
+
+/* only zstd may record the expanded size up front, gzip and xz keep it
+ * at the end of the stream; returns 0 if not known */
+guint64
+fu_firehose_archive_get_uncompressed_size (GBytes *header)
+{
+	const guint8 magic_zstd[] = { 0x28, 0xb5, 0x2f, 0xfd };
+	const guint8 did_sizes[] = { 0, 1, 2, 4 };
+	const guint8 fcs_sizes[] = { 0, 2, 4, 8 };
+	gsize bufsz = 0;
+	const guint8 *buf = g_bytes_get_data (header, &bufsz);
+	gsize offset = sizeof(magic_zstd) + 1;
+	guint8 fhd;
+	guint fcs_size;
+	guint64 value = 0;
+
+	if (bufsz < offset || memcmp (buf, magic_zstd, sizeof(magic_zstd)) != 0)
+		return 0;
+
+	/* the frame header descriptor */
+	fhd = buf[sizeof(magic_zstd)];
+	fcs_size = fcs_sizes[fhd >> 6];
+	if ((fhd & 0x20) == 0)
+		offset++;		/* window descriptor */
+	else if (fcs_size == 0)
+		fcs_size = 1;		/* single segment */
+	offset += did_sizes[fhd & 0x03];
+	if (fcs_size == 0 || offset + fcs_size > bufsz)
+		return 0;
+	for (guint i = 0; i < fcs_size; i++)
+		value |= (guint64) buf[offset + i] << (i * 8);
+	if (fcs_size == 2)
+		value += 256;
+	return value;
+}
+
+struct _FuFirehoseArchiveStream {
+	struct archive		*outer;		/* the zip, at the entry */
+	struct archive		*inner;		/* the compressed image */
+	gint			 cache_fd;	/* or -1 */
+	gchar			*cache_fn;
+	gchar			*cache_fn_tmp;
+};
+
+/* feeds the zip entry to the decompressor without copying it */
+static ssize_t
+fu_firehose_archive_stream_read_cb (struct archive *arch, void *user_data, const void **buf)
+{
+	FuFirehoseArchiveStream *stream = (FuFirehoseArchiveStream *) user_data;
+	size_t bufsz = 0;
+	int64_t offset = 0;
+	gint r = archive_read_data_block (stream->outer, buf, &bufsz, &offset);
+	if (r == ARCHIVE_EOF)
+		return 0;
+	if (r != ARCHIVE_OK) {
+		archive_set_error (arch, ARCHIVE_ERRNO_MISC, "%s",
+				   archive_error_string (stream->outer));
+		return -1;
+	}
+	return bufsz;
+}
+
+FuFirehoseArchiveStream *
+fu_firehose_archive_stream_new (FuFirehoseArchive *self, const gchar *fn, GError **error)
+{
+	FuFirehoseArchiveEntry *entry;
+	struct archive_entry *aentry = NULL;
+	g_autoptr(FuFirehoseArchiveStream) stream = g_new0 (FuFirehoseArchiveStream, 1);
+
+	stream->cache_fd = -1;
+	entry = fu_firehose_archive_lookup (self, fn, error);
+	if (entry == NULL)
+		return NULL;
+	stream->outer = fu_firehose_archive_open_entry (self, entry, error);
+	if (stream->outer == NULL)
+		return NULL;
+	stream->inner = archive_read_new ();
+	archive_read_support_filter_all (stream->inner);
+	archive_read_support_format_raw (stream->inner);
+	if (archive_read_open (stream->inner, stream, NULL,
+			       fu_firehose_archive_stream_read_cb, NULL) != ARCHIVE_OK ||
+	    archive_read_next_header (stream->inner, &aentry) != ARCHIVE_OK) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "cannot decompress %s: %s",
+			     fn, archive_error_string (stream->inner));
+		return NULL;
+	}
+
+	/* the decompressed image is also written to the cache */
+	if (self->cachedir != NULL) {
+		g_autofree gchar *name = g_strdup_printf ("%s.unpacked", fn);
+		stream->cache_fn = g_build_filename (self->cachedir, name, NULL);
+		stream->cache_fn_tmp = g_strdup_printf ("%s.XXXXXX", stream->cache_fn);
+		stream->cache_fd = g_mkstemp (stream->cache_fn_tmp);
+	}
+	return g_steal_pointer (&stream);
+}
+
+static void
+fu_firehose_archive_stream_cache_abort (FuFirehoseArchiveStream *stream)
+{
+	if (stream->cache_fd < 0)
+		return;
+	g_close (stream->cache_fd, NULL);
+	g_unlink (stream->cache_fn_tmp);
+	stream->cache_fd = -1;
+}
+
+static void
+fu_firehose_archive_stream_cache_write (FuFirehoseArchiveStream *stream,
+					const guint8 *buf,
+					gsize bufsz)
+{
+	while (stream->cache_fd >= 0 && bufsz > 0) {
+		gssize len = write (stream->cache_fd, buf, bufsz);
+		if (len <= 0) {
+			g_debug ("failed to cache %s", stream->cache_fn);
+			fu_firehose_archive_stream_cache_abort (stream);
+			return;
+		}
+		buf += len;
+		bufsz -= len;
+	}
+}
+
+/* fills @buf unless the end of the image is reached first */
+gssize
+fu_firehose_archive_stream_read (FuFirehoseArchiveStream *stream,
+				 guint8 *buf,
+				 gsize bufsz,
+				 GError **error)
+{
+	gsize offset = 0;
+	while (offset < bufsz) {
+		gssize len = archive_read_data (stream->inner, buf + offset, bufsz - offset);
+		if (len < 0) {
+			fu_firehose_archive_stream_cache_abort (stream);
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "cannot decompress: %s",
+				     archive_error_string (stream->inner));
+			return -1;
+		}
+		if (len == 0) {
+			fu_firehose_archive_stream_cache_write (stream, buf, offset);
+			if (stream->cache_fd >= 0) {
+				g_close (stream->cache_fd, NULL);
+				stream->cache_fd = -1;
+				if (g_rename (stream->cache_fn_tmp, stream->cache_fn) != 0)
+					g_unlink (stream->cache_fn_tmp);
+			}
+			return offset;
+		}
+		offset += len;
+	}
+	fu_firehose_archive_stream_cache_write (stream, buf, offset);
+	return offset;
+}
+
+void
+fu_firehose_archive_stream_free (FuFirehoseArchiveStream *stream)
+{
+	/* never leave a truncated image behind */
+	fu_firehose_archive_stream_cache_abort (stream);
+	g_free (stream->cache_fn);
+	g_free (stream->cache_fn_tmp);
+	if (stream->inner != NULL)
+		_archive_read_ctx_free (stream->inner);
+	if (stream->outer != NULL)
+		_archive_read_ctx_free (stream->outer);
+	g_free (stream);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#define FU_FIREHOSE_ARCHIVE_HEADER_SIZE		64
+
+/* streaming access to the firmware zip: only the directory is read up
+ * front, and each entry is decompressed when it is asked for; an archive
+ * from fu_firehose_archive_new_shared() may be used by several devices at
+ * the same time, which then also share the decompressed entries */
+typedef struct {
+	gint			 refcount;
+	GBytes			*blob;
+	gchar			*checksum;	/* SHA-256 of @blob */
+	gchar			*cachedir;	/* or %NULL */
+	GPtrArray		*entries;	/* of FuFirehoseArchiveEntry */
+	GMutex			 mutex;
+} FuFirehoseArchive;
+
+typedef struct _FuFirehoseArchiveStream FuFirehoseArchiveStream;
+
+FuFirehoseArchive *fu_firehose_archive_new	(GBytes			*blob,
+						 GError			**error);
+FuFirehoseArchive *fu_firehose_archive_new_shared (GBytes		*blob,
+						 GError			**error);
+FuFirehoseArchive *fu_firehose_archive_ref	(FuFirehoseArchive	*self);
+void		 fu_firehose_archive_unref	(FuFirehoseArchive	*self);
+gboolean	 fu_firehose_archive_set_cache_dir (FuFirehoseArchive	*self,
+							 const gchar		*basedir,
+							 GError			**error);
+const gchar	*fu_firehose_archive_find_by_prefix (FuFirehoseArchive	*self,
+						 const gchar		*prefix);
+GPtrArray	*fu_firehose_archive_find_numbered (FuFirehoseArchive	*self,
+						 const gchar		*prefix,
+						 const gchar		*suffix);
+gboolean	 fu_firehose_archive_get_size	(FuFirehoseArchive	*self,
+						 const gchar		*fn,
+						 guint64		*size,
+						 GError			**error);
+GBytes		*fu_firehose_archive_get_header	(FuFirehoseArchive	*self,
+						 const gchar		*fn,
+						 GError			**error);
+GBytes		*fu_firehose_archive_get_bytes	(FuFirehoseArchive	*self,
+						 const gchar		*fn,
+						 GError			**error);
+GBytes		*fu_firehose_archive_get_unpacked (FuFirehoseArchive	*self,
+							 const gchar		*fn);
+gboolean	 fu_firehose_archive_is_compressed (GBytes		*header);
+guint64		 fu_firehose_archive_get_uncompressed_size (GBytes	*header);
+
+FuFirehoseArchiveStream *fu_firehose_archive_stream_new (FuFirehoseArchive *self,
+							 const gchar		*fn,
+							 GError			**error);
+gssize		 fu_firehose_archive_stream_read (FuFirehoseArchiveStream *stream,
+							 guint8			*buf,
+							 gsize			 bufsz,
+							 GError			**error);
+void		 fu_firehose_archive_stream_free (FuFirehoseArchiveStream *stream);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(FuFirehoseArchive, fu_firehose_archive_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(FuFirehoseArchiveStream, fu_firehose_archive_stream_free)
@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include "config.h"
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fu-common.h"
+#include "fu-firehose-device.h"
+#include "fu-firehose-emulator.h"
+#include "fu-firehose-session.h"
+
+#define FU_FIREHOSE_BENCHMARK_SECTOR_SIZE	4096
+#define FU_FIREHOSE_BENCHMARK_PAGES_PER_BLOCK	64
+#define FU_FIREHOSE_BENCHMARK_LUNS		2	/* for UFS */
+#define FU_FIREHOSE_BENCHMARK_DELTA_BLOCK_SIZE	"262144"
+
+/* not compressible, so the zip stays honest about the payload size */
+static void
+fu_firehose_benchmark_fill (guint8 *buf, gsize bufsz, guint32 seed)
+{
+	guint32 x = seed | 1;
+	for (gsize i = 0; i < bufsz; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		buf[i] = x;
+	}
+}
+
+static gboolean
+fu_firehose_benchmark_add_entry (struct archive *a,
+				 const gchar *fn,
+				 const guint8 *buf,
+				 gsize bufsz,
+				 GError **error)
+{
+	struct archive_entry *entry = archive_entry_new ();
+	gboolean ret = FALSE;
+
+	archive_entry_set_pathname (entry, fn);
+	archive_entry_set_size (entry, bufsz);
+	archive_entry_set_filetype (entry, AE_IFREG);
+	archive_entry_set_perm (entry, 0644);
+	if (archive_write_header (a, entry) != ARCHIVE_OK) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_FAILED,
+			     "failed to add %s: %s",
+			     fn, archive_error_string (a));
+		goto out;
+	}
+	if (archive_write_data (a, buf, bufsz) != (gssize) bufsz) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_FAILED,
+			     "failed to write %s: %s",
+			     fn, archive_error_string (a));
+		goto out;
+	}
+	ret = TRUE;
+out:
+	archive_entry_free (entry);
+	return ret;
+}
+
+static gboolean
+fu_firehose_benchmark_add_xml (struct archive *a,
+			       const gchar *fn,
+			       GString *xml,
+			       const gchar *root,
+			       GError **error)
+{
+	g_string_append_printf (xml, "</%s>\n", root);
+	return fu_firehose_benchmark_add_entry (a, fn, (const guint8 *) xml->str, xml->len, error);
+}
+
+/* a stored zip with the programmer, the manifests and @count images of
+ * @image_size bytes; NAND firmware has a single rawprogram_nand.xml where
+ * each image is erased and then programmed, UFS firmware spreads the
+ * images over a rawprogram<N>.xml for each LUN, without PAGES_PER_BLOCK,
+ * and has a patch0.xml */
+static GBytes *
+fu_firehose_benchmark_build (guint64 sahara_size,
+			     guint64 image_size,
+			     guint count,
+			     gboolean ufs,
+			     GError **error)
+{
+	struct archive *a = archive_write_new ();
+	gsize bufsz = sahara_size + image_size * count + 64 * 1024 + count * 1024;
+	gsize used = 0;
+	guint luns = ufs ? FU_FIREHOSE_BENCHMARK_LUNS : 1;
+	g_autofree guint8 *buf = g_malloc (bufsz);
+	g_autofree guint8 *data = g_malloc (MAX (sahara_size, image_size));
+	GString *xml[FU_FIREHOSE_BENCHMARK_LUNS] = { NULL };
+	g_autoptr(GString) patch = g_string_new ("<?xml version=\"1.0\" ?>\n<patches>\n");
+	guint64 num_sectors = (image_size + FU_FIREHOSE_BENCHMARK_SECTOR_SIZE - 1) /
+			      FU_FIREHOSE_BENCHMARK_SECTOR_SIZE;
+	GBytes *blob = NULL;
+
+	archive_write_set_format_zip (a);
+	archive_write_zip_set_compression_store (a);
+	if (archive_write_open_memory (a, buf, bufsz, &used) != ARCHIVE_OK) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_FAILED,
+			     "failed to create zip: %s",
+			     archive_error_string (a));
+		goto out;
+	}
+
+	for (guint i = 0; i < luns; i++)
+		xml[i] = g_string_new ("<?xml version=\"1.0\" ?>\n<data>\n");
+	fu_firehose_benchmark_fill (data, sahara_size, 0x5a5a5a5a);
+	if (!fu_firehose_benchmark_add_entry (a,
+					      ufs ? "prog_firehose_ddr.elf" : "prog_nand_firehose.mbn",
+					      data, sahara_size, error))
+		goto out;
+	for (guint i = 0; i < count; i++) {
+		g_autofree gchar *fn = g_strdup_printf ("image%u.bin", i);
+		guint lun = i % luns;
+		guint64 start = (i / luns) * num_sectors;
+
+		fu_firehose_benchmark_fill (data, image_size, i + 1);
+		if (!fu_firehose_benchmark_add_entry (a, fn, data, image_size, error))
+			goto out;
+		if (ufs) {
+			g_string_append_printf (xml[lun],
+						"  <program SECTOR_SIZE_IN_BYTES=\"%u\" "
+						"filename=\"%s\" label=\"image%u\" "
+						"num_partition_sectors=\"%" G_GUINT64_FORMAT "\" "
+						"physical_partition_number=\"%u\" "
+						"start_sector=\"%" G_GUINT64_FORMAT "\" />\n",
+						(guint) FU_FIREHOSE_BENCHMARK_SECTOR_SIZE,
+						fn, i, num_sectors, lun, start);
+			continue;
+		}
+		g_string_append_printf (xml[lun],
+					"  <erase PAGES_PER_BLOCK=\"%u\" SECTOR_SIZE_IN_BYTES=\"%u\" "
+					"num_partition_sectors=\"%" G_GUINT64_FORMAT "\" "
+					"physical_partition_number=\"0\" "
+					"start_sector=\"%" G_GUINT64_FORMAT "\" />\n",
+					(guint) FU_FIREHOSE_BENCHMARK_PAGES_PER_BLOCK,
+					(guint) FU_FIREHOSE_BENCHMARK_SECTOR_SIZE,
+					num_sectors, start);
+		g_string_append_printf (xml[lun],
+					"  <program PAGES_PER_BLOCK=\"%u\" SECTOR_SIZE_IN_BYTES=\"%u\" "
+					"filename=\"%s\" label=\"image%u\" "
+					"num_partition_sectors=\"%" G_GUINT64_FORMAT "\" "
+					"physical_partition_number=\"0\" "
+					"start_sector=\"%" G_GUINT64_FORMAT "\" />\n",
+					(guint) FU_FIREHOSE_BENCHMARK_PAGES_PER_BLOCK,
+					(guint) FU_FIREHOSE_BENCHMARK_SECTOR_SIZE,
+					fn, i, num_sectors, start);
+	}
+	if (ufs) {
+		for (guint i = 0; i < luns; i++) {
+			g_autofree gchar *fn = g_strdup_printf ("rawprogram%u.xml", i);
+			if (!fu_firehose_benchmark_add_xml (a, fn, xml[i], "data", error))
+				goto out;
+		}
+		g_string_append_printf (patch,
+					"  <patch SECTOR_SIZE_IN_BYTES=\"%u\" byte_offset=\"0\" "
+					"filename=\"DISK\" physical_partition_number=\"0\" "
+					"size_in_bytes=\"8\" start_sector=\"0\" value=\"0\" "
+					"what=\"benchmark\" />\n",
+					(guint) FU_FIREHOSE_BENCHMARK_SECTOR_SIZE);
+		if (!fu_firehose_benchmark_add_xml (a, "patch0.xml", patch, "patches", error))
+			goto out;
+	} else if (!fu_firehose_benchmark_add_xml (a, "rawprogram_nand.xml", xml[0], "data", error)) {
+		goto out;
+	}
+	if (archive_write_close (a) != ARCHIVE_OK) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_FAILED,
+			     "failed to finish zip: %s",
+			     archive_error_string (a));
+		goto out;
+	}
+	blob = g_bytes_new (buf, used);
+out:
+	for (guint i = 0; i < luns; i++) {
+		if (xml[i] != NULL)
+			g_string_free (xml[i], TRUE);
+	}
+	archive_write_free (a);
+	return blob;
+}
+
+/* returns the time taken in seconds, or a negative value on error */
+static gdouble
+fu_firehose_benchmark_flash (FuFirehoseDevice *device,
+			     GBytes *blob,
+			     gboolean verbose,
+			     GError **error)
+{
+	gdouble elapsed;
+	g_autoptr(GTimer) timer = g_timer_new ();
+
+	if (!fu_device_write_firmware (FU_DEVICE (device), blob,
+				       FWUPD_INSTALL_FLAG_NONE, error))
+		return -1.f;
+	if (!fu_device_attach (FU_DEVICE (device), error))
+		return -1.f;
+	elapsed = g_timer_elapsed (timer, NULL);
+	if (verbose) {
+		g_autofree gchar *str = fu_device_to_string (FU_DEVICE (device));
+		g_print ("%s\n", str);
+	}
+	return elapsed;
+}
+
+/* flashes the same firmware again in delta mode, verifying each range,
+ * which must program less than the first time */
+static gboolean
+fu_firehose_benchmark_reflash (FuFirehoseDevice *device,
+			       GBytes *blob,
+			       const FuFirehoseEmulatorStats *stats,
+			       gboolean verbose,
+			       GError **error)
+{
+	guint64 bytes_first = stats->bytes_programmed;
+	guint64 bytes_second;
+	gdouble elapsed;
+
+	elapsed = fu_firehose_benchmark_flash (device, blob, verbose, error);
+	if (elapsed < 0) {
+		g_prefix_error (error, "second flash: ");
+		return FALSE;
+	}
+	bytes_second = stats->bytes_programmed - bytes_first;
+	g_print ("reflashed in %.2fs, %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+		 " bytes programmed again\n", elapsed, bytes_second, bytes_first);
+	if (bytes_second >= bytes_first) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_FAILED,
+			     "second flash programmed %" G_GUINT64_FORMAT " bytes, "
+			     "not fewer than %" G_GUINT64_FORMAT,
+			     bytes_second, bytes_first);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean
+fu_firehose_benchmark_run (const FuFirehoseEmulatorConfig *config,
+			   guint64 image_size,
+			   guint count,
+			   const gchar *record_fn,
+			   gboolean reflash,
+			   gboolean verbose,
+			   GError **error)
+{
+	FuFirehoseTransport *emulator;
+	const FuFirehoseEmulatorStats *stats;
+	gdouble elapsed;
+	guint64 total = image_size * count;
+	g_autoptr(FuFirehoseDevice) device = g_object_new (FU_TYPE_FIREHOSE_DEVICE, NULL);
+	g_autoptr(GBytes) blob = NULL;
+
+	blob = fu_firehose_benchmark_build (config->sahara_size, image_size, count,
+					    config->ufs, error);
+	if (blob == NULL)
+		return FALSE;
+	if (reflash) {
+		if (!fu_device_set_quirk_kv (FU_DEVICE (device), "FirehoseDeltaBlockSize",
+					     FU_FIREHOSE_BENCHMARK_DELTA_BLOCK_SIZE, error))
+			return FALSE;
+		if (!fu_device_set_quirk_kv (FU_DEVICE (device), "FirehoseVerify", "true", error))
+			return FALSE;
+	}
+	emulator = fu_firehose_emulator_new (config);
+	stats = fu_firehose_emulator_get_stats (emulator);
+	if (record_fn != NULL)
+		fu_firehose_device_set_transport (device, fu_firehose_session_record_new (emulator, record_fn));
+	else
+		fu_firehose_device_set_transport (device, emulator);
+
+	elapsed = fu_firehose_benchmark_flash (device, blob, verbose, error);
+	if (elapsed < 0)
+		return FALSE;
+	g_print ("%4u x %8" G_GUINT64_FORMAT " kB: %6.1f MB/s, %6.2fs, "
+		 "%" G_GUINT64_FORMAT " commands, %.0fus mean round trip, "
+		 "%" G_GUINT64_FORMAT " NAKs\n",
+		 count, image_size / 1024,
+		 (gdouble) total / elapsed / (1024 * 1024), elapsed,
+		 stats->commands,
+		 stats->round_trips > 0 ?
+			(gdouble) stats->round_trip_total / stats->round_trips : 0.f,
+		 stats->naks);
+	if (stats->bytes_programmed < total) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_FAILED,
+			     "only %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " bytes programmed",
+			     stats->bytes_programmed, total);
+		return FALSE;
+	}
+	if (reflash)
+		return fu_firehose_benchmark_reflash (device, blob, stats, verbose, error);
+	return TRUE;
+}
+
+/* the protocol code against the timing of a recorded session */
+static gboolean
+fu_firehose_benchmark_replay (const gchar *replay_fn,
+			      const gchar *firmware_fn,
+			      gboolean verbose,
+			      GError **error)
+{
+	FuFirehoseTransport *replay;
+	const FuFirehoseReplayStats *stats;
+	gchar *buf = NULL;
+	gdouble elapsed;
+	gsize bufsz = 0;
+	g_autoptr(FuFirehoseDevice) device = g_object_new (FU_TYPE_FIREHOSE_DEVICE, NULL);
+	g_autoptr(GBytes) blob = NULL;
+
+	if (!g_file_get_contents (firmware_fn, &buf, &bufsz, error))
+		return FALSE;
+	blob = g_bytes_new_take (buf, bufsz);
+	replay = fu_firehose_session_replay_new (replay_fn, error);
+	if (replay == NULL)
+		return FALSE;
+	stats = fu_firehose_session_replay_get_stats (replay);
+	fu_firehose_device_set_transport (device, replay);
+
+	elapsed = fu_firehose_benchmark_flash (device, blob, verbose, error);
+	if (elapsed < 0) {
+		g_prefix_error (error, "after %u of %u transfers: ",
+				stats->transfers, stats->transfers_total);
+		return FALSE;
+	}
+	g_print ("replayed %u of %u transfers in %.2fs, recorded %.2fs, "
+		 "%u OUT transfers differ\n",
+		 stats->transfers, stats->transfers_total, elapsed,
+		 (gdouble) stats->duration / G_USEC_PER_SEC,
+		 stats->diverged);
+	return TRUE;
+}
+
+int
+main (int argc, char *argv[])
+{
+	FuFirehoseEmulatorConfig config;
+	gboolean reflash = FALSE;
+	gboolean verbose = FALSE;
+	gint count = 4;
+	g_autofree gchar *emulator = NULL;
+	g_autofree gchar *firmware_fn = NULL;
+	g_autofree gchar *record_fn = NULL;
+	g_autofree gchar *replay_fn = NULL;
+	g_autofree gchar *sizes = NULL;
+	g_auto(GStrv) split = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GOptionContext) context = g_option_context_new (NULL);
+	const GOptionEntry options[] = {
+		{ "sizes", 's', 0, G_OPTION_ARG_STRING, &sizes,
+		  "Comma separated image sizes in kB", NULL },
+		{ "count", 'c', 0, G_OPTION_ARG_INT, &count,
+		  "Number of images in each firmware", NULL },
+		{ "emulator", 'e', 0, G_OPTION_ARG_STRING, &emulator,
+		  "Emulator options, e.g. latency=100,max-payload=16384,nak-every=0", NULL },
+		{ "record", 'r', 0, G_OPTION_ARG_FILENAME, &record_fn,
+		  "Record the session with the emulator", "FILE" },
+		{ "replay", '\0', 0, G_OPTION_ARG_FILENAME, &replay_fn,
+		  "Replay a recorded session instead of using the emulator", "FILE" },
+		{ "firmware", 'f', 0, G_OPTION_ARG_FILENAME, &firmware_fn,
+		  "The firmware zip flashed in the recorded session", "FILE" },
+		{ "reflash", '\0', 0, G_OPTION_ARG_NONE, &reflash,
+		  "Flash each firmware twice in delta mode and verify it", NULL },
+		{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
+		  "Show the device details after each run", NULL },
+		{ NULL }
+	};
+
+	g_option_context_add_main_entries (context, options, NULL);
+	g_option_context_set_summary (context,
+				      "Flash synthetic firmware to an emulated "
+				      "Sahara/Firehose target and report the throughput");
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("%s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	/* a session from a real device */
+	if (replay_fn != NULL) {
+		if (firmware_fn == NULL) {
+			g_printerr ("--replay needs the --firmware that was flashed\n");
+			return EXIT_FAILURE;
+		}
+		if (!fu_firehose_benchmark_replay (replay_fn, firmware_fn, verbose, &error)) {
+			g_printerr ("failed to replay %s: %s\n", replay_fn, error->message);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	fu_firehose_emulator_config_init (&config);
+	if (emulator != NULL &&
+	    !fu_firehose_emulator_config_parse (&config, emulator, &error)) {
+		g_printerr ("%s\n", error->message);
+		return EXIT_FAILURE;
+	}
+	if (count <= 0) {
+		g_printerr ("count cannot be zero\n");
+		return EXIT_FAILURE;
+	}
+
+	split = g_strsplit (sizes != NULL ? sizes : "64,1024,16384", ",", -1);
+	if (record_fn != NULL && g_strv_length (split) != 1) {
+		g_printerr ("--record needs exactly one size\n");
+		return EXIT_FAILURE;
+	}
+	for (guint i = 0; split[i] != NULL; i++) {
+		guint64 image_size = fu_common_strtoull (split[i]);
+		if (image_size == 0 || image_size > G_MAXUINT32) {
+			g_printerr ("invalid size %s\n", split[i]);
+			return EXIT_FAILURE;
+		}
+		if (!fu_firehose_benchmark_run (&config, image_size * 1024, count,
+						record_fn, reflash, verbose, &error)) {
+			g_printerr ("failed to flash %u x %s kB: %s\n",
+				    count, split[i], error->message);
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
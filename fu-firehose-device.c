@@ -6,40 +6,120 @@
 
 #include "config.h"
 
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
 #include <xmlb.h>
 
-#include "fu-archive.h"
 #include "fu-chunk.h"
+#include "fu-firehose-archive.h"
 #include "fu-firehose-device.h"
+#include "fu-firehose-image.h"
+#include "fu-firehose-parser.h"
+#include "fu-firehose-plan.h"
+#include "fu-firehose-session.h"
+#include "fu-firehose-trace.h"
+#include "fu-firehose-transport.h"
 #include "fu-firehose-protocol.h"
 #include "fu-sahara-protocol.h"
 
 #define FIREHOSE_REMOVE_DELAY_RE_ENUMERATE	60000 /* ms */
 #define FIREHOSE_TRANSACTION_TIMEOUT		1000 /* ms */
 #define FIREHOSE_TRANSACTION_RETRY_MAX		600
+#define FIREHOSE_COMMAND_TIMEOUT		10000 /* ms */
+#define FIREHOSE_TIMEOUT_MAX			600000 /* ms */
+#define FIREHOSE_TIMEOUT_MARGIN			4
+#define FIREHOSE_RATE_DEFAULT			1024 /* bytes per ms, until measured */
+#define FIREHOSE_RATE_SAMPLE_MIN		(1024 * 1024) /* bytes */
+#define FIREHOSE_PROGRESS_INTERVAL		100 /* ms */
+#define FIREHOSE_PROGRESS_ERASE_DIVISOR		16
+#define FIREHOSE_PROGRESS_ERASE_UNKNOWN		(1024 * 1024) /* bytes */
+#define FIREHOSE_PROBE_TIMEOUT			100 /* ms */
+#define FIREHOSE_NOP_INTERVAL			1000 /* ms */
+#define FIREHOSE_READY_TIMEOUT			30000 /* ms */
 #define FIREHOSE_EP_IN				0x81
 #define FIREHOSE_EP_OUT				0x01
+#define FIREHOSE_QUEUE_DEPTH_DEFAULT		8
+#define FIREHOSE_QUEUE_DEPTH_MAX		64
+#define FIREHOSE_BUS_QUEUE_DEPTH		64	/* shared by all devices on a bus */
 
 #define FIREHOSE_EDL_VID            0x05c6
 #define FIREHOSE_EDL_PID            0x9008
 
 #define MAX_RX_SIZE                (4 * 1024)
 #define MAX_TX_SIZE                (8 * 1024)
+#define FIREHOSE_PAYLOAD_SIZE_REQUEST	(1024 * 1024)
+#define FIREHOSE_PAYLOAD_ALIGN		512
+#define FIREHOSE_DELTA_BLOCK_SIZE_MAX	(64 * 1024 * 1024)
+#define FIREHOSE_DECOMPRESS_WINDOW	(4 * 1024 * 1024)
+#define FIREHOSE_DECOMPRESS_WINDOWS	3
+#define FIREHOSE_CACHE_MAX_AGE		(7 * 24 * 60 * 60) /* s */
+#define FIREHOSE_OUTPUT_MAX_AGE		(30 * 24 * 60 * 60) /* s */
 
 #define SAHARA_VERSION 0x02
 #define SAHARA_VERSION_COMPATIBLE 0
+#define SAHARA_CHUNK_SIZE	(1024 * 1024)
+#define SAHARA_MEM_READ_SIZE	(16 * 1024 * 1024)	/* per SAHARA_MEM_RD */
+#define SAHARA_MEM_TABLE_MAX	(64 * 1024)
 
 #define FIREHOSE_TOOL_PREFIX     "prog_"
 #define FIREHOSE_XML_PREFIX      "rawprogram_"
+#define FIREHOSE_LUN_XML_PREFIX  "rawprogram"
+#define FIREHOSE_PATCH_PREFIX    "patch"
+#define FIREHOSE_PATCH_BATCH	16	/* <patch> commands sent before reading the ACKs */
+
+/* operations where the target works for a time that depends on the size */
+typedef enum {
+	FU_FIREHOSE_OP_ERASE,
+	FU_FIREHOSE_OP_PROGRAM,
+	FU_FIREHOSE_OP_DIGEST,
+	FU_FIREHOSE_OP_LAST
+} FuFirehoseOp;
 
 struct _FuFirehoseDevice {
 	FuUsbDevice			 parent_instance;
 	guint				 max_tx_size;
 	guint				 max_rx_size;
 	guint                intf_nr;
+	guint				 queue_depth;
+	guint				 bus;
+	guint				 ep_out_packet_size;
+	guint				 ep_in_packet_size;
+	guint64				 bytes_sent;
+	guint64				 bytes_received;
+	guint64				 bytes_copied;
+	guint64				 bytes_skipped;
+	FuFirehoseSkipMode		 skip_mode;
+	guint64				 delta_block_size;
+	guint64				 bytes_unchanged;
+	gboolean			 verify;
+	guint64				 bytes_verified;
+	guint64				 peak_rss;
+	guint64				 boot_latency;	/* ms */
+	guint64				 op_rate[FU_FIREHOSE_OP_LAST];	/* bytes per ms, slowest seen */
+	guint64				 progress_done;
+	guint64				 progress_step_end;
+	guint64				 progress_total;
+	gint64				 progress_updated;	/* monotonic, us */
+	guint				 payload_size_request;
+	guint				 target_tx_size;
+	guint				 target_tx_size_supported;
+	guint				 target_rx_size;
+	FuFirehoseParser		 parser;
+	FuFirehoseTrace			 trace;
+	FuFirehoseTransport		*transport;
+	gboolean			 transport_external;
+	gchar				*memory_name;	/* from a quirk, or NULL */
 };
 
+/* the environment is only looked at once */
+static gboolean fu_firehose_verbose = FALSE;
+static const gchar *fu_firehose_trace_fn = NULL;
+static const gchar *fu_firehose_record_fn = NULL;
+
 G_DEFINE_TYPE (FuFirehoseDevice, fu_firehose_device, FU_TYPE_USB_DEVICE)
 
 static void
@@ -48,6 +128,26 @@ fu_firehose_device_to_string (FuDevice *device, guint idt, GString *str)
 	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
 	fu_common_string_append_kx (str, idt, "MaxPayloadSizeToTargetInBytes", self->max_tx_size);
 	fu_common_string_append_kx (str, idt, "MaxPayloadSizeFromTargetInBytes", self->max_rx_size);
+	fu_common_string_append_ku (str, idt, "QueueDepth", self->queue_depth);
+	if (self->memory_name != NULL)
+		fu_common_string_append_kv (str, idt, "MemoryName", self->memory_name);
+	fu_common_string_append_ku (str, idt, "Bus", self->bus);
+	fu_common_string_append_ku (str, idt, "BytesSent", self->bytes_sent);
+	fu_common_string_append_ku (str, idt, "BytesReceived", self->bytes_received);
+	fu_common_string_append_ku (str, idt, "BytesCopied", self->bytes_copied);
+	fu_common_string_append_kv (str, idt, "SkipErased",
+				    fu_firehose_skip_mode_to_string (self->skip_mode));
+	fu_common_string_append_ku (str, idt, "BytesSkipped", self->bytes_skipped);
+	fu_common_string_append_kx (str, idt, "DeltaBlockSize", self->delta_block_size);
+	fu_common_string_append_ku (str, idt, "BytesUnchanged", self->bytes_unchanged);
+	fu_common_string_append_kb (str, idt, "Verify", self->verify);
+	fu_common_string_append_ku (str, idt, "BytesVerified", self->bytes_verified);
+	fu_common_string_append_ku (str, idt, "PeakRssKb", self->peak_rss);
+	fu_common_string_append_ku (str, idt, "BootLatencyMs", self->boot_latency);
+	fu_common_string_append_ku (str, idt, "EraseRateKBs", self->op_rate[FU_FIREHOSE_OP_ERASE]);
+	fu_common_string_append_ku (str, idt, "ProgramRateKBs", self->op_rate[FU_FIREHOSE_OP_PROGRAM]);
+	fu_common_string_append_ku (str, idt, "DigestRateKBs", self->op_rate[FU_FIREHOSE_OP_DIGEST]);
+	fu_firehose_trace_to_string (&self->trace, idt, str);
 }
 
 static gboolean
@@ -57,6 +157,8 @@ fu_firehose_device_probe (FuDevice *device, GError **error)
 	GUsbDevice *usb_device = fu_usb_device_get_dev (FU_USB_DEVICE (self));
 	g_autoptr(GUsbInterface) intf = NULL;
 
+	self->bus = g_usb_device_get_bus (usb_device);
+
 	/* find the correct firehose interface */
 	if (FIREHOSE_EDL_VID == g_usb_device_get_vid(usb_device) &&
 		FIREHOSE_EDL_PID == g_usb_device_get_pid(usb_device)) {
@@ -66,6 +168,31 @@ fu_firehose_device_probe (FuDevice *device, GError **error)
 	return FALSE;
 }
 
+static void
+fu_firehose_device_ensure_packet_size (FuFirehoseDevice *self, GUsbDevice *usb_device)
+{
+	g_autoptr(GPtrArray) intfs = g_usb_device_get_interfaces (usb_device, NULL);
+
+	if (intfs == NULL)
+		return;
+	for (guint i = 0; i < intfs->len; i++) {
+		GUsbInterface *intf = g_ptr_array_index (intfs, i);
+		g_autoptr(GPtrArray) endpoints = g_usb_interface_get_endpoints (intf);
+		if (endpoints == NULL)
+			continue;
+		for (guint j = 0; j < endpoints->len; j++) {
+			GUsbEndpoint *ep = g_ptr_array_index (endpoints, j);
+			guint16 packet_size = g_usb_endpoint_get_maximum_packet_size (ep);
+			if (packet_size == 0)
+				continue;
+			if (g_usb_endpoint_get_address (ep) == FIREHOSE_EP_OUT)
+				self->ep_out_packet_size = packet_size;
+			else if (g_usb_endpoint_get_address (ep) == FIREHOSE_EP_IN)
+				self->ep_in_packet_size = packet_size;
+		}
+	}
+}
+
 static gboolean
 fu_firehose_device_open (FuUsbDevice *device, GError **error)
 {
@@ -79,6 +206,19 @@ fu_firehose_device_open (FuUsbDevice *device, GError **error)
 		return FALSE;
 	}
 
+	/* split transfers on packet boundaries */
+	fu_firehose_device_ensure_packet_size (self, usb_device);
+	if (!self->transport_external) {
+		g_clear_pointer (&self->transport, fu_firehose_transport_free);
+		self->transport = fu_firehose_transport_usb_new (usb_device);
+		if (fu_firehose_record_fn != NULL)
+			self->transport = fu_firehose_session_record_new (self->transport,
+									  fu_firehose_record_fn);
+	}
+
+	/* drop anything left over from a previous session */
+	fu_firehose_parser_reset (&self->parser);
+
 	/* success */
 	return TRUE;
 }
@@ -86,7 +226,7 @@ fu_firehose_device_open (FuUsbDevice *device, GError **error)
 static void
 fu_firehose_buffer_dump (const gchar *title, const guint8 *buf, gsize sz)
 {
-	if (g_getenv ("FWUPD_FIREHOSE_VERBOSE") == NULL)
+	if (!fu_firehose_verbose)
 		return;
 	g_print ("%s (%" G_GSIZE_FORMAT "):\n", title, sz);
 	for (gsize i = 0; i < sz; i++) {
@@ -97,22 +237,24 @@ fu_firehose_buffer_dump (const gchar *title, const guint8 *buf, gsize sz)
 	g_print ("\n");
 }
 
+/* libusb never writes to an OUT buffer, so send straight from the caller */
 static gboolean
 fu_firehose_device_write (FuDevice *device, const guint8 *buf, gsize buflen, GError **error)
 {
-	GUsbDevice *usb_device = fu_usb_device_get_dev (FU_USB_DEVICE (device));
-	g_autofree guint8 *buf2 = g_memdup (buf, (guint) buflen);
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
 	gsize actual_len = 0;
+	gint64 start = g_get_monotonic_time ();
 	gboolean ret;
 
 	fu_firehose_buffer_dump ("writing", buf, buflen);
-	ret = g_usb_device_bulk_transfer (usb_device,
-					  FIREHOSE_EP_OUT,
-					  buf2,
-					  buflen,
-					  &actual_len,
-					  FIREHOSE_TRANSACTION_TIMEOUT,
-					  NULL, error);
+	ret = fu_firehose_transport_bulk_transfer (self->transport,
+						   FIREHOSE_EP_OUT,
+						   (guint8 *) buf,
+						   buflen,
+						   &actual_len,
+						   FIREHOSE_TRANSACTION_TIMEOUT,
+						   error);
+	fu_firehose_trace_add (&self->trace, FIREHOSE_EP_OUT, actual_len, start, ret);
 	if (!ret) {
 		g_prefix_error (error, "failed to do bulk out transfer: ");
 		return FALSE;
@@ -124,266 +266,352 @@ fu_firehose_device_write (FuDevice *device, const guint8 *buf, gsize buflen, GEr
 			     "only wrote %" G_GSIZE_FORMAT "bytes", actual_len);
 		return FALSE;
 	}
+	self->bytes_sent += actual_len;
 	return TRUE;
 }
 
+/* sends a range of @bytes without copying it out of the backing store */
+static gboolean
+fu_firehose_device_write_bytes (FuDevice *device,
+				GBytes *bytes,
+				gsize offset,
+				gsize length,
+				GError **error)
+{
+	gsize bufsz = 0;
+	const guint8 *buf = g_bytes_get_data (bytes, &bufsz);
+
+	if (offset > bufsz || length > bufsz - offset) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "range 0x%" G_GSIZE_FORMAT "x+0x%" G_GSIZE_FORMAT "x "
+			     "outside image of 0x%" G_GSIZE_FORMAT "x bytes",
+			     offset, length, bufsz);
+		return FALSE;
+	}
+	return fu_firehose_device_write (device, buf + offset, length, error);
+}
+
 typedef enum {
-	FU_FIREHOSE_DEVICE_READ_FLAG_NONE,
-	FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL,
+	FU_FIREHOSE_DEVICE_READ_FLAG_NONE		= 0,
+	FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL	= 1 << 0,	/* may take a while */
+	FU_FIREHOSE_DEVICE_READ_FLAG_PROBE		= 1 << 1,	/* one short read */
 } FuFirehoseDeviceReadFlags;
 
-static gboolean
-fu_firehose_device_read (FuDevice *device,
-			 gchar **value_out,
-			 FuFirehoseDeviceReadFlags flags,
-			 GError **error)
+static guint
+fu_firehose_device_flags_to_timeout (FuFirehoseDeviceReadFlags flags)
 {
-	// FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
-	GUsbDevice *usb_device = fu_usb_device_get_dev (FU_USB_DEVICE (device));
-	g_autoptr(GPtrArray) parts = NULL;
-	g_autoptr(XbBuilder) builder = xb_builder_new ();
-	g_autoptr(XbBuilderSource) source = xb_builder_source_new ();
-	g_autoptr(XbSilo) silo = NULL;
-	guint retries = 1;
-
-	/* these commands may return INFO or take some time to complete */
+	if (flags & FU_FIREHOSE_DEVICE_READ_FLAG_PROBE)
+		return FIREHOSE_PROBE_TIMEOUT;
 	if (flags & FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL)
-		retries = FIREHOSE_TRANSACTION_RETRY_MAX;
+		return FIREHOSE_COMMAND_TIMEOUT;
+	return FIREHOSE_TRANSACTION_TIMEOUT;
+}
 
-	for (guint i = 0; i < retries; i++) {
+/* the time the target may take for @op on @size bytes: the round trip,
+ * plus the time the slowest @op so far would have taken, with a margin;
+ * a @size of zero means it is not known */
+static guint
+fu_firehose_device_get_timeout (FuFirehoseDevice *self, FuFirehoseOp op, guint64 size)
+{
+	guint64 rate = self->op_rate[op] > 0 ? self->op_rate[op] : FIREHOSE_RATE_DEFAULT;
+	guint64 timeout;
+
+	if (size == 0)
+		return FIREHOSE_TIMEOUT_MAX;
+	timeout = FIREHOSE_COMMAND_TIMEOUT + size / rate * FIREHOSE_TIMEOUT_MARGIN;
+	return MIN (timeout, FIREHOSE_TIMEOUT_MAX);
+}
+
+/* small operations are mostly latency, so they are not counted */
+static void
+fu_firehose_device_add_sample (FuFirehoseDevice *self, FuFirehoseOp op,
+			       guint64 size, gint64 elapsed)
+{
+	guint64 rate;
+
+	if (size < FIREHOSE_RATE_SAMPLE_MIN || elapsed <= 0)
+		return;
+	rate = MAX (size * 1000 / elapsed, 1);
+	if (self->op_rate[op] == 0 || rate < self->op_rate[op])
+		self->op_rate[op] = rate;
+}
+
+/* the <configure> response echoes the accepted payload sizes, and a NAK
+ * advertises the largest one the target supports */
+static void
+fu_firehose_device_parse_response (FuFirehoseDevice *self, const FuFirehoseEvent *event)
+{
+	const gchar *tmp;
+
+	tmp = fu_firehose_event_get_attr (event, "MaxPayloadSizeToTargetInBytes");
+	if (tmp != NULL)
+		self->target_tx_size = fu_common_strtoull (tmp);
+	tmp = fu_firehose_event_get_attr (event, "MaxPayloadSizeToTargetInBytesSupported");
+	if (tmp != NULL)
+		self->target_tx_size_supported = fu_common_strtoull (tmp);
+	tmp = fu_firehose_event_get_attr (event, "MaxPayloadSizeFromTargetInBytes");
+	if (tmp != NULL)
+		self->target_rx_size = fu_common_strtoull (tmp);
+}
+
+/* returns the next <response> or <log> event from the target, waiting in
+ * a single bulk-in transfer until the monotonic @deadline at the latest;
+ * the event strings are only valid until the next call */
+static gboolean
+fu_firehose_device_read_until (FuDevice *device,
+			       FuFirehoseEvent *event,
+			       gint64 deadline,
+			       GError **error)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+
+	while (TRUE) {
 		gboolean ret;
 		gsize actual_len = 0;
-		guint8 buf[MAX_RX_SIZE] = { 0x00 };
+		gsize space = 0;
+		gint64 timeout;
+		gint64 start;
+		guint8 *buf;
 		g_autoptr(GError) error_local = NULL;
 
-		ret = g_usb_device_bulk_transfer (usb_device,
-						  FIREHOSE_EP_IN,
-						  buf,
-						  sizeof(buf),
-						  &actual_len,
-						  FIREHOSE_TRANSACTION_TIMEOUT,
-						  NULL, &error_local);
+		/* several documents can arrive in one transfer */
+		if (!fu_firehose_parser_next (&self->parser, event, error))
+			return FALSE;
+		if (event->kind == FU_FIREHOSE_EVENT_KIND_ACK) {
+			fu_firehose_device_parse_response (self, event);
+			return TRUE;
+		}
+		if (event->kind == FU_FIREHOSE_EVENT_KIND_NAK) {
+			fu_firehose_device_parse_response (self, event);
+			g_set_error_literal (error,
+					     G_IO_ERROR,
+					     G_IO_ERROR_FAILED,
+					     "target responded NAK");
+			return FALSE;
+		}
+		if (event->kind == FU_FIREHOSE_EVENT_KIND_LOG) {
+			g_debug ("target: %s", event->value);
+			return TRUE;
+		}
+		if (event->kind == FU_FIREHOSE_EVENT_KIND_UNKNOWN) {
+			g_debug ("ignoring <%s>", event->element);
+			continue;
+		}
+
+		/* read straight into the parser */
+		timeout = (deadline - g_get_monotonic_time ()) / 1000;
+		if (timeout <= 0) {
+			g_set_error_literal (error,
+					     G_IO_ERROR,
+					     G_IO_ERROR_TIMED_OUT,
+					     "no response to read");
+			return FALSE;
+		}
+		buf = fu_firehose_parser_get_space (&self->parser, &space, error);
+		if (buf == NULL)
+			return FALSE;
+		start = g_get_monotonic_time ();
+		ret = fu_firehose_transport_bulk_transfer (self->transport,
+							   FIREHOSE_EP_IN,
+							   buf,
+							   space,
+							   &actual_len,
+							   timeout,
+							   &error_local);
+		fu_firehose_trace_add (&self->trace, FIREHOSE_EP_IN, actual_len, start, ret);
 		if (!ret) {
+			/* the deadline is checked again above */
 			if (g_error_matches (error_local,
 					     G_USB_DEVICE_ERROR,
-					     G_USB_DEVICE_ERROR_TIMED_OUT)) {
-				LOGI ("ignoring %s", error_local->message);
+					     G_USB_DEVICE_ERROR_TIMED_OUT))
 				continue;
-			}
 			g_propagate_prefixed_error (error,
 						g_steal_pointer (&error_local),
 					    "failed to do bulk in transfer: ");
 			return FALSE;
 		}
 		fu_firehose_buffer_dump ("read", buf, actual_len);
-		if (actual_len < 4) {
-			g_set_error (error,
-						G_IO_ERROR,
-						G_IO_ERROR_INVALID_DATA,
-						"only read %" G_GSIZE_FORMAT "bytes",
-						actual_len);
-			return FALSE;
-		}
-
-		/* info */
-		if (!xb_builder_source_load_bytes (source,
-					g_bytes_new(buf, actual_len),
-					XB_BUILDER_SOURCE_FLAG_NONE, error))
-			return FALSE;
-
-		xb_builder_import_source (builder, source);
-		silo = xb_builder_compile (builder,
-					XB_BUILDER_COMPILE_FLAG_NONE,
-					NULL,
-					error);
-		if (silo == NULL)
-			return FALSE;
-
-		LOGI ("%s", buf);
-		/* <?xml version="1.0" ?>
-		 *	<data>
-		 *	<response value="ACK" />
-		 *	</data>
-		 */
-		parts = xb_silo_query (silo, "data/response", 0, error);
-		if (parts) {
-			const gchar *value = xb_node_get_attr(
-						g_ptr_array_index (parts, 0),
-						"value");
-			if (value_out)
-				*value_out = g_strdup(value);
-			if (value && g_strcmp0(value, "ACK") == 0)
-				return TRUE;
-			if (value && g_strcmp0(value, "NAK") == 0)
-				return FALSE;
-		}
-		g_clear_error(error);
-
-		/* <?xml version="1.0" encoding="UTF-8" ?>
-			<data>
-			<log value="Hash start sector 0 num sectors 131072" />
-			</data> */
-		parts = xb_silo_query (silo, "data/log", 0, error);
-		if (parts) {
-			const gchar *value = xb_node_get_attr(
-						g_ptr_array_index (parts, 0),
-						"value");
-			/* <log ... /> */
-			if (value_out)
-				*value_out = g_strdup(value);
-			return TRUE;
-		}
-		g_clear_error(error);
-
-		/* unknown failure */
-		g_set_error_literal (error,
-				     G_IO_ERROR,
-				     G_IO_ERROR_FAILED,
-				     "failed to read response");
-		return FALSE;
+		fu_firehose_parser_commit (&self->parser, actual_len);
 	}
+}
 
-	/* we timed out a *lot* */
-	g_set_error_literal (error,
-			     G_IO_ERROR,
-			     G_IO_ERROR_FAILED,
-			     "no response to read");
-	return FALSE;
+static gboolean
+fu_firehose_device_read (FuDevice *device,
+			 FuFirehoseEvent *event,
+			 FuFirehoseDeviceReadFlags flags,
+			 GError **error)
+{
+	gint64 deadline = g_get_monotonic_time () +
+			  (gint64) fu_firehose_device_flags_to_timeout (flags) * 1000;
+	return fu_firehose_device_read_until (device, event, deadline, error);
 }
 
+/* sends @cmd and waits up to @timeout ms in total for the ACK, however
+ * many <log> messages arrive in the meantime */
 static gboolean
-fu_firehose_device_cmd (FuDevice *device, const gchar *cmd,
-			FuFirehoseDeviceReadFlags flags, GError **error)
+fu_firehose_device_cmd_full (FuDevice *device, const gchar *cmd,
+			     guint timeout, GError **error)
 {
 	gsize buflen = (cmd != NULL) ? strlen (cmd) : 0;
+	gint64 deadline;
 
-	LOGI ("%s", cmd);
+	g_debug ("%s", cmd);
 	if (cmd && !fu_firehose_device_write (device, (const guint8 *) cmd, buflen, error))
 		return FALSE;
 
+	deadline = g_get_monotonic_time () + (gint64) timeout * 1000;
 	do {
-		g_autofree gchar *value = NULL;
-		if (!fu_firehose_device_read (device, &value, flags, error))
-			return FALSE;
-
-		if (value == NULL)
+		FuFirehoseEvent event;
+		g_autoptr(GError) error_local = NULL;
+		if (!fu_firehose_device_read_until (device, &event, deadline, &error_local)) {
+			if (g_error_matches (error_local, G_IO_ERROR, G_IO_ERROR_TIMED_OUT)) {
+				g_propagate_prefixed_error (error, g_steal_pointer (&error_local),
+							    "no ACK within %ums: ", timeout);
+				return FALSE;
+			}
+			g_propagate_error (error, g_steal_pointer (&error_local));
 			return FALSE;
+		}
 
-		if (g_strcmp0(value, "NAK") == 0 ||
-			g_strcmp0(value, "ACK") == 0)
+		if (event.kind == FU_FIREHOSE_EVENT_KIND_ACK)
 			break;
 
-		if (g_str_has_prefix(value, "INFO: End of supported functions"))
+		if (g_str_has_prefix(event.value, "INFO: End of supported functions"))
 			break;
 	} while (1);
 	return TRUE;
 }
 
 static gboolean
-fu_firehose_command_power (FuDevice *device, const gchar **cmd, GError **error)
+fu_firehose_device_cmd (FuDevice *device, const gchar *cmd,
+			FuFirehoseDeviceReadFlags flags, GError **error)
 {
-	*cmd = g_strdup(
-		"<?xml version=\"1.0\" ?><data>"
-		"<power value=\"reset\" /></data>");
-	return TRUE;
+	return fu_firehose_device_cmd_full (device, cmd,
+					    fu_firehose_device_flags_to_timeout (flags),
+					    error);
 }
 
+/* for @op on @size bytes, which also updates the expected rate */
 static gboolean
-fu_firehose_command_erase (XbNode *part, gchar **cmd, GError **error)
+fu_firehose_device_cmd_op (FuDevice *device, const gchar *cmd,
+			   FuFirehoseOp op, guint64 size, GError **error)
 {
-	const gchar *pages_per_block = xb_node_get_attr(part, "PAGES_PER_BLOCK");
-	const gchar *sector_size_in_bytes = xb_node_get_attr(part, "SECTOR_SIZE_IN_BYTES");
-	const gchar *num_partition_sectors = xb_node_get_attr(part, "num_partition_sectors");
-	const gchar *physical_partition_number = xb_node_get_attr(part, "physical_partition_number");
-	const gchar *start_sector = xb_node_get_attr(part, "start_sector");
-	const gchar *last_sector = xb_node_get_attr(part, "last_sector");
-	guint64 last_sector_num;
-
-	g_return_val_if_fail (pages_per_block != NULL, FALSE);
-	g_return_val_if_fail (sector_size_in_bytes != NULL, FALSE);
-	g_return_val_if_fail (num_partition_sectors != NULL, FALSE);
-	g_return_val_if_fail (physical_partition_number != NULL, FALSE);
-	g_return_val_if_fail (start_sector != NULL, FALSE);
-
-	if (!last_sector)
-		last_sector_num = g_ascii_strtoull(start_sector, NULL, 0) + 
-						  g_ascii_strtoull(num_partition_sectors, NULL, 0) - 1;
-	else
-		last_sector_num = g_ascii_strtoull(last_sector, NULL, 0);
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	gint64 start = g_get_monotonic_time ();
+	guint timeout = fu_firehose_device_get_timeout (self, op, size);
 
-	*cmd = g_strdup_printf (
-		"<?xml version=\"1.0\" ?><data>"
-		"<erase PAGES_PER_BLOCK=\"%s\" SECTOR_SIZE_IN_BYTES=\"%s\" last_sector=\"%lu\" "
-		"num_partition_sectors=\"%s\" physical_partition_number=\"%s\" start_sector=\"%s\"/>"
-		"</data>",
-		pages_per_block,
-		sector_size_in_bytes,
-		last_sector_num,
-		num_partition_sectors,
-		physical_partition_number,
-		start_sector);
+	if (!fu_firehose_device_cmd_full (device, cmd, timeout, error))
+		return FALSE;
+	fu_firehose_device_add_sample (self, op, size, g_get_monotonic_time () - start);
 	return TRUE;
 }
 
-/* fixup: the should should be the multiply of sector_size, append pad */
-static guint
-_fu_firehose_fixup_num_sectors(guint filesize, guint sector_size)
+/* the programmer announces itself with a burst of <log> messages once it
+ * has booted; poll for them instead of waiting a fixed time, and send a
+ * <nop> in case they were sent before we started listening -- its reply
+ * also comes after any logs still queued, so they are all drained; every
+ * <nop> that was sent has its reply read here, so that none is later
+ * taken as the reply to <configure> */
+static gboolean
+fu_firehose_device_wait_ready (FuDevice *device, GError **error)
 {
-	guint num_sectors = filesize / sector_size;
-	if (filesize % sector_size)
-		num_sectors++;
-	return num_sectors;
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	const gchar *nop = "<?xml version=\"1.0\" ?><data><nop /></data>";
+	gint64 start = g_get_monotonic_time ();
+	gint64 nop_next = start + FIREHOSE_NOP_INTERVAL * 1000;
+	gint64 last_event = start;
+	guint nops_pending = 0;
+	gboolean ready = FALSE;
+	gboolean done = FALSE;
+
+	while (!done || nops_pending > 0) {
+		FuFirehoseEvent event;
+		g_autoptr(GError) error_local = NULL;
+		gint64 now;
+
+		if (!fu_firehose_device_read (device, &event,
+					      FU_FIREHOSE_DEVICE_READ_FLAG_PROBE,
+					      &error_local)) {
+			now = g_get_monotonic_time ();
+
+			/* an unsupported <nop> still shows it is running */
+			if (event.kind == FU_FIREHOSE_EVENT_KIND_NAK && nops_pending > 0) {
+				nops_pending--;
+				ready = done = TRUE;
+				last_event = now;
+				continue;
+			}
+			if (!g_error_matches (error_local, G_IO_ERROR, G_IO_ERROR_TIMED_OUT)) {
+				g_propagate_error (error, g_steal_pointer (&error_local));
+				return FALSE;
+			}
+			if (!ready && now - start > (gint64) FIREHOSE_READY_TIMEOUT * 1000) {
+				g_set_error (error,
+					     G_IO_ERROR,
+					     G_IO_ERROR_TIMED_OUT,
+					     "programmer did not start within %ums",
+					     (guint) FIREHOSE_READY_TIMEOUT);
+				return FALSE;
+			}
+
+			/* a <nop> sent before the programmer ran was lost */
+			if (done) {
+				if (now - last_event > (gint64) FIREHOSE_NOP_INTERVAL * 1000) {
+					g_debug ("no reply to %u <nop>", nops_pending);
+					break;
+				}
+				continue;
+			}
+			if ((ready && nops_pending == 0) || now >= nop_next) {
+				nop_next = now + FIREHOSE_NOP_INTERVAL * 1000;
+				g_clear_error (&error_local);
+				if (!fu_firehose_device_write (device, (const guint8 *) nop,
+							       strlen (nop), &error_local)) {
+					/* not booted yet */
+					if (!ready && g_error_matches (error_local,
+								       G_USB_DEVICE_ERROR,
+								       G_USB_DEVICE_ERROR_TIMED_OUT))
+						continue;
+					g_propagate_error (error, g_steal_pointer (&error_local));
+					return FALSE;
+				}
+				nops_pending++;
+			}
+			continue;
+		}
+		last_event = g_get_monotonic_time ();
+		if (!ready) {
+			self->boot_latency = (last_event - start) / 1000;
+			g_debug ("programmer ready after %" G_GUINT64_FORMAT "ms",
+				 self->boot_latency);
+			ready = TRUE;
+		}
+		if (event.kind == FU_FIREHOSE_EVENT_KIND_ACK) {
+			if (nops_pending > 0)
+				nops_pending--;
+			done = TRUE;
+			continue;
+		}
+		if (g_str_has_prefix (event.value, "INFO: End of supported functions"))
+			done = TRUE;
+	}
+	return TRUE;
 }
 
 static gboolean
-fu_firehose_command_program (XbNode *part, gchar **cmd, gsize filesize, GError **error)
+fu_firehose_command_power (FuDevice *device, gchar **cmd, GError **error)
 {
-	const gchar *pages_per_block = xb_node_get_attr(part, "PAGES_PER_BLOCK");
-	const gchar *sector_size_in_bytes = xb_node_get_attr(part, "SECTOR_SIZE_IN_BYTES");
-	const gchar *num_partition_sectors = xb_node_get_attr(part, "num_partition_sectors");
-	const gchar *physical_partition_number = xb_node_get_attr(part, "physical_partition_number");
-	const gchar *start_sector = xb_node_get_attr(part, "start_sector");
-	const gchar *last_sector = xb_node_get_attr(part, "last_sector");
-	guint sector_num;
-	gsize sector_size;
-	guint64 last_sector_num;
-
-	g_return_val_if_fail (pages_per_block != NULL, FALSE);
-	g_return_val_if_fail (sector_size_in_bytes != NULL, FALSE);
-	g_return_val_if_fail (num_partition_sectors != NULL, FALSE);
-	g_return_val_if_fail (physical_partition_number != NULL, FALSE);
-	g_return_val_if_fail (start_sector != NULL, FALSE);
-
-	sector_num = g_ascii_strtoull(num_partition_sectors, NULL, 0);
-	sector_size = g_ascii_strtoull(sector_size_in_bytes, NULL, 0);
-
-	/* fix up command */
-	if (filesize)
-		sector_num = _fu_firehose_fixup_num_sectors(filesize,
-						sector_size);
-
-	if (!last_sector)
-		last_sector_num = g_ascii_strtoull(start_sector, NULL, 0) + 
-						sector_num;
-	else
-		last_sector_num = g_ascii_strtoull(last_sector, NULL, 0);
-
-	*cmd = g_strdup_printf (
+	*cmd = g_strdup(
 		"<?xml version=\"1.0\" ?><data>"
-		"<program PAGES_PER_BLOCK=\"%s\" SECTOR_SIZE_IN_BYTES=\"%s\" last_sector=\"%lu\" "
-		"num_partition_sectors=\"%u\" physical_partition_number=\"%s\" start_sector=\"%s\"/>"
-		"</data>",
-		pages_per_block,
-		sector_size_in_bytes,
-		last_sector_num,
-		sector_num,
-		physical_partition_number,
-		start_sector);
+		"<power value=\"reset\" /></data>");
 	return TRUE;
 }
 
 static void
-fu_firehose_command_configure (FuDevice *device, gchar **cmd, GError **error)
+fu_firehose_command_configure (FuDevice *device, const gchar *memory_name,
+			       gchar **cmd, GError **error)
 {
 	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
 	
@@ -398,151 +626,1445 @@ fu_firehose_command_configure (FuDevice *device, gchar **cmd, GError **error)
         "AlwaysValidate=\"0\" MaxDigestTableSizeInBytes=\"2048\" MaxPayloadSizeToTargetInBytes=\"%u\" "
         "ZlpAwareHost=\"%d\" SkipStorageInit=\"%d\" />"
         "</data>",
-        "nand", self->max_rx_size, self->max_tx_size, 0, 0); // only sdx20 support ZLP
+        memory_name, self->max_rx_size, self->max_tx_size, 0, 0); // only sdx20 support ZLP
 }
 
 static gboolean
-_fu_firehose_get_absolute_path(XbNode *part, gchar **filename)
+fu_firehose_device_configure (FuDevice *device, const gchar *memory_name, GError **error)
 {
-	gchar *fn = xb_node_get_attr(part, "filename");
-	
-	/* NULL or "" */
-	if (!fn || strlen(fn) == 0)
-		return FALSE;
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	guint fallback = MAX_TX_SIZE;
+
+	/* ask for a large payload, then retry once with what the target supports */
+	self->max_tx_size = self->payload_size_request;
+	for (guint i = 0; i < 2; i++) {
+		g_autofree gchar *cmd = NULL;
+		g_autoptr(GError) error_local = NULL;
+		guint supported;
+
+		self->target_tx_size = 0;
+		self->target_tx_size_supported = 0;
+		self->target_rx_size = 0;
+		fu_firehose_command_configure (device, memory_name, &cmd, error);
+		if (fu_firehose_device_cmd (device, cmd,
+					    FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL,
+					    &error_local)) {
+			/* an ACK that does not say what was accepted only
+			 * vouches for what the target is known to support */
+			if (self->target_tx_size == 0) {
+				g_debug ("payload size not confirmed, using %u", fallback);
+				self->max_tx_size = MIN (self->max_tx_size, fallback);
+			} else if (self->target_tx_size < self->max_tx_size) {
+				self->max_tx_size = self->target_tx_size;
+			}
+			if (self->target_rx_size != 0)
+				self->max_rx_size = self->target_rx_size;
+			self->max_tx_size -= self->max_tx_size % FIREHOSE_PAYLOAD_ALIGN;
+			if (self->max_tx_size == 0)
+				self->max_tx_size = MAX_TX_SIZE;
+			g_debug ("using %u byte payloads to target, %u from target",
+				 self->max_tx_size, self->max_rx_size);
+			return TRUE;
+		}
+
+		/* not a payload size problem */
+		supported = self->target_tx_size_supported;
+		if (supported == 0)
+			supported = self->target_tx_size;
+		supported -= supported % FIREHOSE_PAYLOAD_ALIGN;
+		if (supported == 0 || supported >= self->max_tx_size) {
+			g_propagate_prefixed_error (error,
+						    g_steal_pointer (&error_local),
+						    "failed to configure: ");
+			return FALSE;
+		}
+		g_debug ("target only supports %u byte payloads", supported);
+		self->max_tx_size = supported;
+		fallback = supported;
+	}
+
+	/* failed */
+	g_set_error (error,
+		     G_IO_ERROR,
+		     G_IO_ERROR_NOT_SUPPORTED,
+		     "target rejected %u byte payloads",
+		     self->max_tx_size);
+	return FALSE;
+}
+
+/* the whole update is one progress bar, where every byte that is read or
+ * programmed counts once; each step of the plan has a weight, and what is
+ * actually transferred in a step can never move past its end */
+static void
+fu_firehose_device_progress_update (FuFirehoseDevice *self, gboolean force)
+{
+	gint64 now = g_get_monotonic_time ();
+
+	if (self->progress_total == 0)
+		return;
+	if (!force && now - self->progress_updated < FIREHOSE_PROGRESS_INTERVAL * 1000)
+		return;
+	self->progress_updated = now;
+	fu_device_set_progress_full (FU_DEVICE (self),
+				     (gsize) self->progress_done,
+				     (gsize) self->progress_total);
+}
+
+static void
+fu_firehose_device_progress_reset (FuFirehoseDevice *self, guint64 total)
+{
+	self->progress_done = 0;
+	self->progress_step_end = 0;
+	self->progress_total = total;
+	self->progress_updated = 0;
+	fu_firehose_device_progress_update (self, TRUE);
+}
+
+/* completes the current step, whatever was transferred */
+static void
+fu_firehose_device_progress_step (FuFirehoseDevice *self, guint64 weight)
+{
+	self->progress_done = self->progress_step_end;
+	self->progress_step_end = MIN (self->progress_step_end + weight, self->progress_total);
+	fu_firehose_device_progress_update (self, self->progress_done == self->progress_total);
+}
+
+static void
+fu_firehose_device_progress_add (FuFirehoseDevice *self, guint64 bytes)
+{
+	self->progress_done = MIN (self->progress_done + bytes, self->progress_step_end);
+	fu_firehose_device_progress_update (self, FALSE);
+}
+
+/* erasing is much quicker than programming the same number of bytes */
+static guint64
+fu_firehose_erase_get_weight (guint64 size)
+{
+	if (size == 0)
+		return FIREHOSE_PROGRESS_ERASE_UNKNOWN / FIREHOSE_PROGRESS_ERASE_DIVISOR;
+	return size / FIREHOSE_PROGRESS_ERASE_DIVISOR;
+}
+
+/* one bulk-out transfer in the pipeline */
+typedef struct {
+	gpointer		 helper;
+	guint			 idx;
+	gint64			 submitted;	/* monotonic, us */
+	gboolean		 done;
+} FuFirehoseTxItem;
+
+typedef struct {
+	FuDevice		*device;
+	FuFirehoseTransport	*transport;
+	guint8			 endpoint;
+	GPtrArray		*chunks;	/* of FuChunk */
+	FuFirehoseTxItem	*items;
+	GCancellable		*cancellable;
+	guint			 queue_depth;
+	guint			 idx_submit;
+	guint			 idx_complete;
+	guint			 in_flight;
+	GError			*error;
+} FuFirehoseTxHelper;
+
+static void fu_firehose_device_tx_submit (FuFirehoseTxHelper *helper);
+
+static void
+fu_firehose_device_tx_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	FuFirehoseTxItem *item = (FuFirehoseTxItem *) user_data;
+	FuFirehoseTxHelper *helper = (FuFirehoseTxHelper *) item->helper;
+	FuChunk *chk = g_ptr_array_index (helper->chunks, item->idx);
+	g_autoptr(GError) error_local = NULL;
+	gssize actual_len;
+
+	helper->in_flight--;
+	actual_len = fu_firehose_transport_bulk_transfer_finish (helper->transport, res, &error_local);
+	fu_firehose_trace_add (&FU_FIREHOSE_DEVICE (helper->device)->trace, helper->endpoint,
+			       MAX (actual_len, 0), item->submitted, actual_len >= 0);
+	if (actual_len >= 0 && (gsize) actual_len != chk->data_sz) {
+		g_set_error (&error_local,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "only transferred %" G_GSSIZE_FORMAT " of %" G_GUINT32_FORMAT " bytes",
+			     actual_len, chk->data_sz);
+	}
+
+	/* keep the first failure and cancel everything still queued */
+	if (error_local != NULL) {
+		if (helper->error == NULL) {
+			helper->error = g_steal_pointer (&error_local);
+			g_cancellable_cancel (helper->cancellable);
+		}
+		return;
+	}
 
-	fn = g_strstrip(fn);
-	if (rindex (fn, '\\'))
-		*filename = g_strdup(rindex(fn, '\\') + 1);
+	/* completions are only reported in submission order */
+	if (helper->endpoint == FIREHOSE_EP_OUT)
+		FU_FIREHOSE_DEVICE (helper->device)->bytes_sent += chk->data_sz;
 	else
-		*filename = g_strdup(fn);
+		FU_FIREHOSE_DEVICE (helper->device)->bytes_received += chk->data_sz;
+	item->done = TRUE;
+	while (helper->idx_complete < helper->chunks->len &&
+	       helper->items[helper->idx_complete].done) {
+		FuChunk *chk_done = g_ptr_array_index (helper->chunks, helper->idx_complete);
+		fu_firehose_device_progress_add (FU_FIREHOSE_DEVICE (helper->device),
+						 chk_done->data_sz);
+		helper->idx_complete++;
+	}
+
+	/* refill the queue */
+	fu_firehose_device_tx_submit (helper);
+}
+
+static void
+fu_firehose_device_tx_submit (FuFirehoseTxHelper *helper)
+{
+	while (helper->error == NULL &&
+	       helper->in_flight < helper->queue_depth &&
+	       helper->idx_submit < helper->chunks->len) {
+		FuFirehoseTxItem *item = &helper->items[helper->idx_submit];
+		FuChunk *chk = g_ptr_array_index (helper->chunks, helper->idx_submit);
+
+		if (helper->endpoint == FIREHOSE_EP_OUT)
+			fu_firehose_buffer_dump ("writing", chk->data, chk->data_sz);
+
+		/* each transfer may have to wait for the ones queued before it */
+		item->submitted = g_get_monotonic_time ();
+		fu_firehose_transport_bulk_transfer_async (helper->transport,
+							   helper->endpoint,
+							   (guint8 *) chk->data,
+							   chk->data_sz,
+							   FIREHOSE_TRANSACTION_TIMEOUT * helper->queue_depth,
+							   helper->cancellable,
+							   fu_firehose_device_tx_cb,
+							   item);
+		helper->idx_submit++;
+		helper->in_flight++;
+	}
+}
+
+/* number of devices being flashed on each USB bus */
+static GMutex fu_firehose_bus_mutex;
+static guint fu_firehose_bus_sessions[256];
+
+static void
+fu_firehose_device_bus_enter (FuFirehoseDevice *self)
+{
+	g_mutex_lock (&fu_firehose_bus_mutex);
+	fu_firehose_bus_sessions[self->bus]++;
+	g_mutex_unlock (&fu_firehose_bus_mutex);
+}
+
+static void
+fu_firehose_device_bus_leave (FuFirehoseDevice *self)
+{
+	g_mutex_lock (&fu_firehose_bus_mutex);
+	fu_firehose_bus_sessions[self->bus]--;
+	g_mutex_unlock (&fu_firehose_bus_mutex);
+}
+
+/* devices flashed at the same time on one bus share its transfers fairly,
+ * so adding another bus adds bandwidth instead of more queued requests */
+static guint
+fu_firehose_device_get_queue_depth (FuFirehoseDevice *self)
+{
+	guint sessions;
+
+	g_mutex_lock (&fu_firehose_bus_mutex);
+	sessions = MAX (fu_firehose_bus_sessions[self->bus], 1);
+	g_mutex_unlock (&fu_firehose_bus_mutex);
+	return CLAMP (FIREHOSE_BUS_QUEUE_DEPTH / sessions, 1, self->queue_depth);
+}
+
+/* keeps up to queue_depth bulk transfers in flight over the chunk array;
+ * for @endpoint FIREHOSE_EP_IN the chunks are filled in */
+static gboolean
+fu_firehose_device_transfer_chunks (FuDevice *device,
+				    guint8 endpoint,
+				    GPtrArray *chunks,
+				    GError **error)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	FuFirehoseTxHelper helper = { NULL };
+	g_autoptr(GMainContext) context = g_main_context_new ();
+	g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+	g_autofree FuFirehoseTxItem *items = g_new0 (FuFirehoseTxItem, chunks->len);
+
+	helper.device = device;
+	helper.transport = self->transport;
+	helper.endpoint = endpoint;
+	helper.chunks = chunks;
+	helper.items = items;
+	helper.cancellable = cancellable;
+	helper.queue_depth = fu_firehose_device_get_queue_depth (self);
+	for (guint i = 0; i < chunks->len; i++) {
+		items[i].helper = &helper;
+		items[i].idx = i;
+	}
+
+	/* the GUsb callbacks are dispatched on the thread-default context,
+	 * and every buffer has to stay alive until the last one returns */
+	g_main_context_push_thread_default (context);
+	fu_firehose_device_tx_submit (&helper);
+	while (helper.in_flight > 0)
+		g_main_context_iteration (context, TRUE);
+	g_main_context_pop_thread_default (context);
+
+	if (helper.error != NULL) {
+		g_propagate_prefixed_error (error, helper.error,
+					    "failed to do bulk %s transfer: ",
+					    endpoint == FIREHOSE_EP_OUT ? "out" : "in");
+		return FALSE;
+	}
 	return TRUE;
 }
 
 static gboolean
-fu_firehose_device_download (FuDevice *device,
-					GBytes *fw,
-					gsize totalsz,
-					GError **error)
+fu_firehose_device_write_chunks (FuDevice *device, GPtrArray *chunks, GError **error)
+{
+	return fu_firehose_device_transfer_chunks (device, FIREHOSE_EP_OUT, chunks, error);
+}
+
+/* removes the entries of @basedir starting with @prefix, apart from @keep,
+ * that have not been modified for @max_age seconds */
+static void
+fu_firehose_prune_dir (const gchar *basedir,
+		       const gchar *prefix,
+		       const gchar *keep,
+		       gint64 max_age)
+{
+	gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+	const gchar *name;
+	g_autoptr(GDir) dir = g_dir_open (basedir, 0, NULL);
+
+	if (dir == NULL)
+		return;
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		GStatBuf buf;
+		g_autofree gchar *fn = NULL;
+		g_autoptr(GError) error_local = NULL;
+
+		if (g_strcmp0 (name, keep) == 0)
+			continue;
+		if (prefix != NULL && !g_str_has_prefix (name, prefix))
+			continue;
+		fn = g_build_filename (basedir, name, NULL);
+		if (g_stat (fn, &buf) != 0 || now - buf.st_mtime < max_age)
+			continue;
+		if (!fu_common_rmtree (fn, &error_local))
+			g_debug ("failed to prune %s: %s", fn, error_local->message);
+	}
+}
+
+/* creates a new timestamped directory for files saved from the target,
+ * unique even when several devices save at the same time, and drops the
+ * ones of the same @kind that are older than FIREHOSE_OUTPUT_MAX_AGE */
+static gchar *
+fu_firehose_device_create_output_dir (const gchar *kind, GError **error)
+{
+	g_autofree gchar *localstatedir = fu_common_get_path (FU_PATH_KIND_LOCALSTATEDIR_PKG);
+	g_autofree gchar *basedir = g_build_filename (localstatedir, "firehose", NULL);
+	g_autofree gchar *dirname = NULL;
+	g_autofree gchar *prefix = g_strdup_printf ("%s-", kind);
+	g_autofree gchar *timestamp = NULL;
+	g_autoptr(GDateTime) dt = g_date_time_new_now_local ();
+
+	if (g_mkdir_with_parents (basedir, 0700) != 0) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_FAILED,
+			     "failed to create %s", basedir);
+		return NULL;
+	}
+	fu_firehose_prune_dir (basedir, prefix, NULL, FIREHOSE_OUTPUT_MAX_AGE);
+	timestamp = g_date_time_format (dt, "%Y%m%d-%H%M%S");
+	dirname = g_strdup_printf ("%s/%s%s-XXXXXX", basedir, prefix, timestamp);
+	if (g_mkdtemp_full (dirname, 0700) == NULL) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_FAILED,
+			     "failed to create %s", dirname);
+		return NULL;
+	}
+	return g_steal_pointer (&dirname);
+}
+
+/* @basename is untrusted, so it cannot leave @dirname */
+static gchar *
+fu_firehose_build_output_filename (const gchar *dirname,
+				   const gchar *basename,
+				   const gchar *fallback,
+				   guint idx)
+{
+	g_autofree gchar *tmp = g_strdup (basename != NULL ? basename : "");
+	g_strdelimit (tmp, "/\\", '_');
+	if (tmp[0] == '\0' || tmp[0] == '.') {
+		g_free (tmp);
+		tmp = g_strdup_printf ("%s%u.bin", fallback, idx);
+	}
+	return g_build_filename (dirname, tmp, NULL);
+}
+
+/* creates @fn with @len bytes and maps it so it can be read into directly */
+static guint8 *
+fu_firehose_map_output (const gchar *fn, guint64 len, GError **error)
+{
+	guint8 *buf;
+	gint fd;
+
+	fd = g_open (fn, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_FAILED,
+			     "failed to create %s", fn);
+		return NULL;
+	}
+	if (ftruncate (fd, len) != 0) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_NO_SPACE,
+			     "failed to allocate %" G_GUINT64_FORMAT " bytes for %s",
+			     len, fn);
+		g_close (fd, NULL);
+		return NULL;
+	}
+	buf = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	g_close (fd, NULL);
+	if (buf == MAP_FAILED) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_FAILED,
+			     "failed to map %s", fn);
+		return NULL;
+	}
+	return buf;
+}
+
+/* never written, so reading it only ever maps the kernel zero page */
+static guint8 fu_firehose_zero_page[FIREHOSE_PAYLOAD_SIZE_REQUEST];
+
+/* sends the raw data for the extents [@idx, @idx + @n) of @image, which are
+ * contiguous on the target and so covered by a single <program> */
+static gboolean
+fu_firehose_device_download (FuDevice *device,
+			     FuFirehoseImage *image,
+			     guint idx,
+			     guint n,
+			     GError **error)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	g_autoptr(GPtrArray) chunks = g_ptr_array_new_with_free_func (g_free);
+	g_autoptr(GPtrArray) bufs = g_ptr_array_new_with_free_func (g_free);
+	guint64 totalsz = 0;
+	gint64 start;
+
+	for (guint i = idx; i < idx + n; i++) {
+		FuFirehoseExtent *ext = g_ptr_array_index (image->extents, i);
+		gsize datasz = 0;
+		const guint8 *data = NULL;
+		guint64 off = 0;
+
+		/* the same pattern buffer is sent as many times as needed */
+		if (ext->data == NULL) {
+			if (ext->fill != 0x0) {
+				gsize bufsz = MIN (ext->size, self->max_tx_size);
+				guint8 *buf = g_malloc (bufsz);
+				for (gsize j = 0; j < bufsz; j += sizeof(ext->fill))
+					memcpy (buf + j, &ext->fill, sizeof(ext->fill));
+				g_ptr_array_add (bufs, buf);
+				for (; off < ext->size; off += bufsz) {
+					g_ptr_array_add (chunks, fu_chunk_new (chunks->len, 0, 0, buf,
+									       MIN (bufsz, ext->size - off)));
+				}
+			}
+		} else {
+			data = g_bytes_get_data (ext->data, &datasz);
+			datasz = MIN (datasz, ext->size);
+		}
+
+		/* whole sectors straight from the image; the payload size was
+		 * checked against every sector size after <configure> */
+		for (; off + image->sector_size <= datasz; ) {
+			gsize sz = MIN (self->max_tx_size, datasz - off);
+			sz -= sz % image->sector_size;
+			g_assert (sz > 0);
+			g_ptr_array_add (chunks, fu_chunk_new (chunks->len, 0, 0, data + off, sz));
+			off += sz;
+		}
+
+		/* only the partial last sector is copied */
+		if (off < datasz) {
+			gsize sz = MIN (image->sector_size, ext->size - off);
+			guint8 *tmp = g_malloc0 (sz);
+			memcpy (tmp, data + off, datasz - off);
+			self->bytes_copied += datasz - off;
+			g_ptr_array_add (bufs, tmp);
+			g_ptr_array_add (chunks, fu_chunk_new (chunks->len, 0, 0, tmp, sz));
+			off += sz;
+		}
+
+		/* padding and zero fill come from the shared zero page */
+		while (off < ext->size) {
+			gsize sz = MIN (MIN (self->max_tx_size, sizeof(fu_firehose_zero_page)),
+					ext->size - off);
+			g_ptr_array_add (chunks, fu_chunk_new (chunks->len, 0, 0,
+							       fu_firehose_zero_page, sz));
+			off += sz;
+		}
+		totalsz += ext->size;
+	}
+
+	g_debug ("sending raw data %" G_GUINT64_FORMAT " in %u chunks", totalsz, chunks->len);
+	start = g_get_monotonic_time ();
+	if (!fu_firehose_device_write_chunks (device, chunks, error))
+		return FALSE;
+
+	/* the target may still be writing the last of the data */
+	if (!fu_firehose_device_cmd_full (device, NULL,
+					  fu_firehose_device_get_timeout (self, FU_FIREHOSE_OP_PROGRAM, totalsz),
+					  error))
+		return FALSE;
+	fu_firehose_device_add_sample (self, FU_FIREHOSE_OP_PROGRAM, totalsz,
+				       g_get_monotonic_time () - start);
+
+	return TRUE;
+}
+
+/* <log value="Digest 0x1234..." /> */
+static gboolean
+fu_firehose_device_parse_digest (const gchar *str, guint8 *digest)
+{
+	if (!g_str_has_prefix (str, "Digest "))
+		return FALSE;
+	str += strlen ("Digest ");
+	if (g_str_has_prefix (str, "0x") || g_str_has_prefix (str, "0X"))
+		str += 2;
+	for (guint i = 0; i < FU_FIREHOSE_IMAGE_DIGEST_SIZE; i++) {
+		gint hi = g_ascii_xdigit_value (str[i * 2]);
+		gint lo = hi < 0 ? -1 : g_ascii_xdigit_value (str[i * 2 + 1]);
+		if (lo < 0)
+			return FALSE;
+		digest[i] = (hi << 4) | lo;
+	}
+	return TRUE;
+}
+
+static gboolean
+fu_firehose_device_get_digest (FuDevice *device,
+			       FuFirehosePlanOp *op,
+			       guint64 start_sector,
+			       guint64 sector_num,
+			       guint8 *digest,
+			       GError **error)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	gchar cmd[FU_FIREHOSE_PLAN_CMD_MAX];
+	gsize cmd_len;
+	gboolean found = FALSE;
+	guint64 size = sector_num * op->sector_size;
+	gint64 start = g_get_monotonic_time ();
+	gint64 deadline;
+
+	cmd_len = fu_firehose_plan_op_render_digest (op, start_sector, sector_num, cmd);
+	if (!fu_firehose_device_write (device, (const guint8 *) cmd, cmd_len, error))
+		return FALSE;
+	deadline = start + (gint64) fu_firehose_device_get_timeout (self, FU_FIREHOSE_OP_DIGEST, size) * 1000;
+	do {
+		FuFirehoseEvent event;
+		if (!fu_firehose_device_read_until (device, &event, deadline, error))
+			return FALSE;
+		if (event.kind == FU_FIREHOSE_EVENT_KIND_ACK)
+			break;
+		if (fu_firehose_device_parse_digest (event.value, digest))
+			found = TRUE;
+	} while (1);
+	fu_firehose_device_add_sample (self, FU_FIREHOSE_OP_DIGEST, size,
+				       g_get_monotonic_time () - start);
+	if (!found) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_NOT_SUPPORTED,
+			     "no digest returned for sector %" G_GUINT64_FORMAT,
+			     start_sector);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* a byte range of an image; for a run of contiguous extents @idx is the
+ * first extent and @n the number of extents */
+typedef struct {
+	guint64			 offset;
+	guint64			 size;
+	guint			 idx;
+	guint			 n;
+} FuFirehoseRange;
+
+/* hashes each range of the image on a thread while the device is busy
+ * with something else */
+typedef struct {
+	FuFirehoseImage		*image;
+	GArray			*ranges;	/* of FuFirehoseRange */
+	guint8			*digests;
+} FuFirehoseDigestHelper;
+
+static gpointer
+fu_firehose_device_digest_thread_cb (gpointer user_data)
+{
+	FuFirehoseDigestHelper *helper = (FuFirehoseDigestHelper *) user_data;
+	for (guint i = 0; i < helper->ranges->len; i++) {
+		FuFirehoseRange *range = &g_array_index (helper->ranges, FuFirehoseRange, i);
+		fu_firehose_image_checksum (helper->image, range->offset, range->size,
+					    helper->digests + i * FU_FIREHOSE_IMAGE_DIGEST_SIZE);
+	}
+	return NULL;
+}
+
+/* removes every block that the target already has from @image, and erases
+ * the rest of @erase instead of the whole range up front */
+static gboolean
+fu_firehose_device_write_delta (FuDevice *device,
+				FuFirehosePlanOp *op,
+				FuFirehosePlanOp *erase,
+				FuFirehoseImage *image,
+				guint64 block_size,
+				GError **error)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	FuFirehoseDigestHelper helper = { NULL };
+	g_autofree guint8 *digests = NULL;
+	g_autofree guint8 *digests_target = NULL;
+	g_autoptr(GArray) blocks = g_array_new (FALSE, TRUE, sizeof(FuFirehoseRange));
+	g_autoptr(GError) error_local = NULL;
+	GThread *thread;
+	guint64 start_sector = op->start_sector;
+	guint64 erase_end = erase->start_sector + erase->num_sectors;
+	guint64 tail;
+	guint sector_size = image->sector_size;
+
+	/* hash the image while the target hashes what it has */
+	for (guint64 offset = 0; offset < image->size; offset += block_size) {
+		FuFirehoseRange block = { offset, MIN (block_size, image->size - offset), 0, 0 };
+		g_array_append_val (blocks, block);
+	}
+	helper.image = image;
+	helper.ranges = blocks;
+	helper.digests = digests = g_malloc0 (blocks->len * FU_FIREHOSE_IMAGE_DIGEST_SIZE);
+	digests_target = g_malloc0 (blocks->len * FU_FIREHOSE_IMAGE_DIGEST_SIZE);
+	thread = g_thread_new ("firehose-digest", fu_firehose_device_digest_thread_cb, &helper);
+	for (guint i = 0; i < blocks->len; i++) {
+		FuFirehoseRange *block = &g_array_index (blocks, FuFirehoseRange, i);
+		if (!fu_firehose_device_get_digest (device, op,
+						    start_sector + block->offset / sector_size,
+						    block->size / sector_size,
+						    digests_target + i * FU_FIREHOSE_IMAGE_DIGEST_SIZE,
+						    &error_local))
+			break;
+	}
+	g_thread_join (thread);
+	if (error_local != NULL) {
+		g_propagate_prefixed_error (error, g_steal_pointer (&error_local),
+					    "failed to get digest: ");
+		return FALSE;
+	}
+
+	/* only keep the blocks that differ */
+	for (guint i = 0; i < blocks->len; i++) {
+		FuFirehoseRange *block = &g_array_index (blocks, FuFirehoseRange, i);
+		if (memcmp (digests + i * FU_FIREHOSE_IMAGE_DIGEST_SIZE,
+			    digests_target + i * FU_FIREHOSE_IMAGE_DIGEST_SIZE,
+			    FU_FIREHOSE_IMAGE_DIGEST_SIZE) != 0)
+			continue;
+		fu_firehose_image_remove_range (image, block->offset, block->size);
+		self->bytes_unchanged += block->size;
+	}
+	g_debug ("%u extents changed", image->extents->len);
+
+	/* erase the changed blocks, and everything after the image */
+	for (guint i = 0; i < image->extents->len; i++) {
+		FuFirehoseExtent *ext = g_ptr_array_index (image->extents, i);
+		gchar cmd[FU_FIREHOSE_PLAN_CMD_MAX];
+		fu_firehose_plan_op_render_erase (op, start_sector + ext->offset / sector_size,
+						  ext->size / sector_size, cmd);
+		if (!fu_firehose_device_cmd_op (device, cmd, FU_FIREHOSE_OP_ERASE,
+						ext->size, error))
+			return FALSE;
+	}
+
+	/* the tail starts at the next whole block, as erasing the block
+	 * holding the end of the image would also wipe it if unchanged */
+	tail = start_sector + ((image->size + block_size - 1) / block_size) * block_size / sector_size;
+	if (erase_end > tail) {
+		gchar cmd[FU_FIREHOSE_PLAN_CMD_MAX];
+		fu_firehose_plan_op_render_erase (erase, tail, erase_end - tail, cmd);
+		if (!fu_firehose_device_cmd_op (device, cmd, FU_FIREHOSE_OP_ERASE,
+						(erase_end - tail) * sector_size, error))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* in delta mode the <erase> starting at the same sector as a plain image
+ * is deferred until the changed blocks of that image are known */
+static void
+fu_firehose_device_plan_delta (FuDevice *device, FuFirehosePlan *plan)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+
+	if (self->delta_block_size == 0)
+		return;
+	for (guint i = 0; i < plan->ops->len; i++) {
+		FuFirehosePlanOp *op = fu_firehose_plan_index (plan, i);
+		if (op->kind != FU_FIREHOSE_PLAN_KIND_PROGRAM ||
+		    op->image_size == 0 ||
+		    op->image_sparse ||
+		    op->image_compressed ||
+		    op->start_sector == FU_FIREHOSE_PLAN_SECTOR_UNKNOWN)
+			continue;
+		for (guint j = 0; j < plan->ops->len; j++) {
+			FuFirehosePlanOp *erase = fu_firehose_plan_index (plan, j);
+			if (erase->kind != FU_FIREHOSE_PLAN_KIND_ERASE || erase->deferred)
+				continue;
+			if (erase->physical_partition_number != op->physical_partition_number ||
+			    erase->start_sector != op->start_sector)
+				continue;
+			if (op->image_size > erase->num_sectors * op->sector_size)
+				continue;
+			op->delta_erase = erase;
+			erase->deferred = TRUE;
+			break;
+		}
+	}
+}
+
+/* skipping erased blocks is only safe if an <erase> covers the whole range */
+static gboolean
+fu_firehose_device_range_is_erased (FuFirehosePlan *plan,
+				    FuFirehosePlanOp *op,
+				    guint64 offset,
+				    guint64 num)
+{
+	guint64 start = op->start_sector;
+
+	if (start == FU_FIREHOSE_PLAN_SECTOR_UNKNOWN)
+		return FALSE;
+	start += offset;
+	for (guint i = 0; i < plan->ops->len; i++) {
+		FuFirehosePlanOp *erase = fu_firehose_plan_index (plan, i);
+		if (erase->kind != FU_FIREHOSE_PLAN_KIND_ERASE ||
+		    erase->physical_partition_number != op->physical_partition_number ||
+		    erase->start_sector == FU_FIREHOSE_PLAN_SECTOR_UNKNOWN)
+			continue;
+		if (erase->start_sector <= start &&
+		    start + num <= erase->start_sector + erase->num_sectors)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* compares the digest of a programmed run with what the target has; a
+ * start_sector that is relative to the end of the disk cannot be checked */
+static gboolean
+fu_firehose_device_verify_range (FuDevice *device,
+				 FuFirehosePlanOp *op,
+				 guint sector_size,
+				 guint64 offset,
+				 guint64 size,
+				 const guint8 *digest,
+				 GError **error)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	guint64 start_sector_num = op->start_sector;
+	guint8 digest_target[FU_FIREHOSE_IMAGE_DIGEST_SIZE] = { 0x0 };
+
+	if (start_sector_num == FU_FIREHOSE_PLAN_SECTOR_UNKNOWN) {
+		g_debug ("cannot verify start_sector %s", op->start_sector_str);
+		return TRUE;
+	}
+	start_sector_num += offset / sector_size;
+	if (!fu_firehose_device_get_digest (device, op, start_sector_num,
+					    size / sector_size, digest_target, error))
+		return FALSE;
+	if (memcmp (digest, digest_target, sizeof(digest_target)) != 0) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "verification failed for %" G_GUINT64_FORMAT " sectors at %" G_GUINT64_FORMAT,
+			     size / sector_size, start_sector_num);
+		return FALSE;
+	}
+	self->bytes_verified += size;
+	return TRUE;
+}
+
+/* one <program> for each run of contiguous extents, @offset is where
+ * the image starts in the partition; when verifying, each run is hashed
+ * on a thread while it is being sent and then checked with the target */
+static gboolean
+fu_firehose_device_program_image (FuDevice *device,
+				  FuFirehosePlanOp *op,
+				  FuFirehoseImage *image,
+				  guint64 offset,
+				  GError **error)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	FuFirehoseDigestHelper helper = { NULL };
+	g_autofree guint8 *digests = NULL;
+	g_autoptr(GArray) runs = g_array_new (FALSE, TRUE, sizeof(FuFirehoseRange));
+	g_autoptr(GError) error_local = NULL;
+	GThread *thread = NULL;
+
+	for (guint i = 0; i < image->extents->len; ) {
+		FuFirehoseExtent *ext = g_ptr_array_index (image->extents, i);
+		FuFirehoseRange run = { ext->offset, ext->size, i, 1 };
+
+		while (run.idx + run.n < image->extents->len) {
+			FuFirehoseExtent *ext_next = g_ptr_array_index (image->extents, run.idx + run.n);
+			if (ext_next->offset != run.offset + run.size)
+				break;
+			run.size += ext_next->size;
+			run.n++;
+		}
+		g_array_append_val (runs, run);
+		i += run.n;
+	}
+
+	if (self->verify && runs->len > 0) {
+		helper.image = image;
+		helper.ranges = runs;
+		helper.digests = digests = g_malloc0 (runs->len * FU_FIREHOSE_IMAGE_DIGEST_SIZE);
+		thread = g_thread_new ("firehose-verify", fu_firehose_device_digest_thread_cb, &helper);
+	}
+
+	for (guint i = 0; i < runs->len; i++) {
+		FuFirehoseRange *run = &g_array_index (runs, FuFirehoseRange, i);
+		gchar cmd[FU_FIREHOSE_PLAN_CMD_MAX];
+
+		if (fu_firehose_plan_op_render_program (op,
+							(offset + run->offset) / image->sector_size,
+							run->size / image->sector_size,
+							cmd) == 0) {
+			g_set_error (&error_local,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "invalid start_sector %s", op->start_sector_str);
+			break;
+		}
+		if (!fu_firehose_device_cmd (device, cmd,
+					     FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL,
+					     &error_local))
+			break;
+		if (!fu_firehose_device_download (device, image, run->idx, run->n, &error_local))
+			break;
+	}
+	if (thread != NULL)
+		g_thread_join (thread);
+	if (error_local != NULL) {
+		g_propagate_error (error, g_steal_pointer (&error_local));
+		return FALSE;
+	}
+
+	/* the target only has to hash what was just written */
+	for (guint i = 0; digests != NULL && i < runs->len; i++) {
+		FuFirehoseRange *run = &g_array_index (runs, FuFirehoseRange, i);
+		if (!fu_firehose_device_verify_range (device, op, image->sector_size,
+						      offset + run->offset, run->size,
+						      digests + i * FU_FIREHOSE_IMAGE_DIGEST_SIZE,
+						      error))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* a compressed image is decompressed by a worker thread one window at a
+ * time, so that inflating the next window overlaps sending this one */
+typedef struct {
+	FuFirehoseArchiveStream	*stream;
+	gsize			 window_size;
+	GPtrArray		*windows;	/* of FuFirehoseWindow */
+	GAsyncQueue		*windows_free;
+	GAsyncQueue		*windows_full;
+	gint			 cancelled;
+	GError			*error;
+} FuFirehoseDecompressHelper;
+
+typedef struct {
+	guint8			*data;
+	gsize			 len;		/* 0 at the end of the image */
+} FuFirehoseWindow;
+
+static void
+fu_firehose_window_free (FuFirehoseWindow *window)
+{
+	g_free (window->data);
+	g_free (window);
+}
+
+static gpointer
+fu_firehose_device_decompress_thread_cb (gpointer user_data)
+{
+	FuFirehoseDecompressHelper *helper = (FuFirehoseDecompressHelper *) user_data;
+	while (TRUE) {
+		FuFirehoseWindow *window = g_async_queue_pop (helper->windows_free);
+		gssize len;
+
+		if (g_atomic_int_get (&helper->cancelled))
+			break;
+		len = fu_firehose_archive_stream_read (helper->stream,
+						       window->data,
+						       helper->window_size,
+						       &helper->error);
+		window->len = len > 0 ? len : 0;
+		g_async_queue_push (helper->windows_full, window);
+		if (len <= 0)
+			break;
+	}
+	return NULL;
+}
+
+static gboolean
+fu_firehose_device_write_compressed (FuDevice *device,
+				     FuFirehoseArchive *archive,
+				     FuFirehosePlan *plan,
+				     FuFirehosePlanOp *op,
+				     GError **error)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	FuFirehoseDecompressHelper helper = { NULL };
+	GThread *thread;
+	gboolean ret = TRUE;
+	guint64 offset = 0;
+	guint sector_size = op->sector_size;
+	guint64 block_size = fu_firehose_plan_op_get_block_size (op);
+	const gchar *fn = op->filename;
+	g_autoptr(FuFirehoseArchiveStream) stream = NULL;
+
+	if (block_size > FIREHOSE_DECOMPRESS_WINDOW) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_NOT_SUPPORTED,
+			     "block size of %s too large to decompress", fn);
+		return FALSE;
+	}
+
+	stream = fu_firehose_archive_stream_new (archive, fn, error);
+	if (stream == NULL)
+		return FALSE;
+	helper.stream = stream;
+	helper.window_size = FIREHOSE_DECOMPRESS_WINDOW - FIREHOSE_DECOMPRESS_WINDOW % block_size;
+	helper.windows = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_firehose_window_free);
+	helper.windows_free = g_async_queue_new ();
+	helper.windows_full = g_async_queue_new ();
+	for (guint i = 0; i < FIREHOSE_DECOMPRESS_WINDOWS; i++) {
+		FuFirehoseWindow *window = g_new0 (FuFirehoseWindow, 1);
+		window->data = g_malloc (helper.window_size);
+		g_ptr_array_add (helper.windows, window);
+		g_async_queue_push (helper.windows_free, window);
+	}
+	thread = g_thread_new ("firehose-decompress",
+			       fu_firehose_device_decompress_thread_cb,
+			       &helper);
+
+	while (TRUE) {
+		FuFirehoseWindow *window = g_async_queue_pop (helper.windows_full);
+		g_autoptr(FuFirehoseImage) image = NULL;
+		g_autoptr(GBytes) blob = NULL;
+
+		if (window->len == 0) {
+			if (helper.error != NULL) {
+				g_propagate_prefixed_error (error, g_steal_pointer (&helper.error),
+							    "failed to decompress %s: ", fn);
+				ret = FALSE;
+			}
+			break;
+		}
+		blob = g_bytes_new_static (window->data, window->len);
+		if (offset == 0 && fu_firehose_image_is_sparse (blob)) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_NOT_SUPPORTED,
+				     "compressed sparse image %s not supported", fn);
+			ret = FALSE;
+		}
+		if (ret && op->num_sectors > 0 &&
+		    offset + window->len > fu_firehose_plan_op_get_size (op)) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "%s expands to more than the %" G_GUINT64_FORMAT " byte partition",
+				     fn, fu_firehose_plan_op_get_size (op));
+			ret = FALSE;
+		}
+		if (ret) {
+			image = fu_firehose_image_new (blob, sector_size, 0);
+			if (self->skip_mode != FU_FIREHOSE_SKIP_MODE_NONE &&
+			    fu_firehose_device_range_is_erased (plan, op,
+								offset / sector_size,
+								image->size / sector_size)) {
+				fu_firehose_image_skip_erased (image, self->skip_mode, block_size);
+			}
+			ret = fu_firehose_device_program_image (device, op, image, offset, error);
+			self->bytes_skipped += image->bytes_skipped;
+			offset += window->len;
+		}
+
+		/* the image refers to the window, so drop it before reuse */
+		g_clear_pointer (&image, fu_firehose_image_free);
+		g_clear_pointer (&blob, g_bytes_unref);
+		if (!ret)
+			g_atomic_int_set (&helper.cancelled, TRUE);
+		g_async_queue_push (helper.windows_free, window);
+		if (!ret)
+			break;
+	}
+
+	g_thread_join (thread);
+	g_async_queue_unref (helper.windows_free);
+	g_async_queue_unref (helper.windows_full);
+	g_ptr_array_unref (helper.windows);
+	g_clear_error (&helper.error);
+	return ret;
+}
+
+static gboolean
+fu_firehose_device_program_op (FuDevice *device,
+			       FuFirehoseArchive *archive,
+			       FuFirehosePlan *plan,
+			       FuFirehosePlanOp *op,
+			       GError **error)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	g_autoptr(FuFirehoseImage) image = NULL;
+	g_autoptr(GBytes) fw = NULL;
+	const gchar *fn = op->filename;
+	guint sector_size = op->sector_size;
+
+	/* nothing to program */
+	if (fn == NULL)
+		return TRUE;
+
+	/* never held in memory as a whole, unless a previous device
+	 * already left it decompressed in the cache */
+	if (op->image_compressed) {
+		fw = fu_firehose_archive_get_unpacked (archive, fn);
+		if (fw == NULL)
+			return fu_firehose_device_write_compressed (device, archive, plan, op, error);
+	}
+
+	/* only this partition is held in memory */
+	if (fw == NULL)
+		fw = fu_firehose_archive_get_bytes (archive, fn, error);
+	if (fw == NULL)
+		return FALSE;
+
+	/* this partition is only part of the file */
+	if (op->image_slice) {
+		GBytes *slice;
+		if (op->image_offset + op->image_size > g_bytes_get_size (fw)) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "%s is smaller than file_sector_offset", fn);
+			return FALSE;
+		}
+		slice = g_bytes_new_from_bytes (fw, op->image_offset, op->image_size);
+		g_bytes_unref (fw);
+		fw = slice;
+	}
+
+	/* only program the image, not the whole partition */
+	if (fu_firehose_image_is_sparse (fw)) {
+		image = fu_firehose_image_new_from_sparse (fw, sector_size, error);
+		if (image == NULL) {
+			g_prefix_error (error, "failed to parse %s: ", fn);
+			return FALSE;
+		}
+	} else {
+		guint64 size = g_bytes_get_size (fw) > 0 ? 0 : fu_firehose_plan_op_get_size (op);
+		image = fu_firehose_image_new (fw, sector_size, size);
+	}
+
+	/* a sparse image can describe far more than it stores */
+	if (op->num_sectors > 0 && image->size > fu_firehose_plan_op_get_size (op)) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "%s expands to %" G_GUINT64_FORMAT " bytes, larger than the partition",
+			     fn, image->size);
+		return FALSE;
+	}
+
+	/* only send the blocks that differ from what the target has */
+	if (op->delta_erase != NULL) {
+		guint64 block_size = fu_firehose_plan_op_get_block_size (op);
+		if (self->delta_block_size > block_size)
+			block_size *= (self->delta_block_size + block_size - 1) / block_size;
+		if (!fu_firehose_device_write_delta (device, op, op->delta_erase, image,
+						     block_size, error))
+			return FALSE;
+	}
+
+	/* leave blocks that are already erased alone */
+	if (self->skip_mode != FU_FIREHOSE_SKIP_MODE_NONE) {
+		if (fu_firehose_device_range_is_erased (plan, op, 0, image->size / sector_size)) {
+			fu_firehose_image_skip_erased (image, self->skip_mode,
+						       fu_firehose_plan_op_get_block_size (op));
+		} else {
+			g_debug ("%s is not erased first, programming all of it", fn);
+		}
+	}
+
+	if (!fu_firehose_device_program_image (device, op, image, 0, error))
+		return FALSE;
+	self->bytes_skipped += image->bytes_skipped;
+	return TRUE;
+}
+
+/* one contiguous range of sectors to erase */
+typedef struct {
+	FuFirehosePlanOp	*op;		/* for the geometry */
+	guint64			 start;
+	guint64			 num;
+} FuFirehoseEraseRange;
+
+/* ranges that can be merged have to be on the same partition with the
+ * same geometry */
+static gint
+fu_firehose_erase_range_cmp (FuFirehoseEraseRange *range1, FuFirehoseEraseRange *range2)
+{
+	const guint32 keys1[] = { range1->op->physical_partition_number,
+				  range1->op->sector_size,
+				  range1->op->pages_per_block };
+	const guint32 keys2[] = { range2->op->physical_partition_number,
+				  range2->op->sector_size,
+				  range2->op->pages_per_block };
+	for (guint i = 0; i < G_N_ELEMENTS (keys1); i++) {
+		if (keys1[i] < keys2[i])
+			return -1;
+		if (keys1[i] > keys2[i])
+			return 1;
+	}
+	return 0;
+}
+
+static gint
+fu_firehose_erase_range_sort_cb (gconstpointer a, gconstpointer b)
+{
+	FuFirehoseEraseRange *range1 = (FuFirehoseEraseRange *) a;
+	FuFirehoseEraseRange *range2 = (FuFirehoseEraseRange *) b;
+	gint rc = fu_firehose_erase_range_cmp (range1, range2);
+	if (rc != 0)
+		return rc;
+	if (range1->start < range2->start)
+		return -1;
+	if (range1->start > range2->start)
+		return 1;
+	return 0;
+}
+
+/* NAND is erased a whole block at a time, so ranges that only leave a gap
+ * inside a block that gets erased anyway can be merged too; storage without
+ * PAGES_PER_BLOCK only merges ranges that touch */
+static gboolean
+fu_firehose_erase_range_can_merge (FuFirehoseEraseRange *range1, FuFirehoseEraseRange *range2)
+{
+	guint64 pages_per_block = range1->op->pages_per_block;
+	guint64 end = range1->start + range1->num;
+
+	if (fu_firehose_erase_range_cmp (range1, range2) != 0)
+		return FALSE;
+	if (pages_per_block > 1)
+		return range2->start / pages_per_block <= (end + pages_per_block - 1) / pages_per_block;
+	return range2->start <= end;
+}
+
+/* sorts and merges the erase ranges that are not deferred so that each
+ * contiguous area is erased with a single command; ranges with a
+ * start_sector expression the target has to evaluate are sent as they are */
+static gboolean
+fu_firehose_device_erase_plan (FuDevice *device, FuFirehosePlan *plan, GError **error)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	g_autoptr(GArray) ranges = g_array_new (FALSE, FALSE, sizeof(FuFirehoseEraseRange));
+	FuFirehoseEraseRange *range_last = NULL;
+	guint cnt = 0;
+	guint n_erase = 0;
+
+	for (guint i = 0; i < plan->ops->len; i++) {
+		FuFirehosePlanOp *op = fu_firehose_plan_index (plan, i);
+		FuFirehoseEraseRange range = { op, op->start_sector, op->num_sectors };
+
+		if (op->kind != FU_FIREHOSE_PLAN_KIND_ERASE || op->deferred)
+			continue;
+		n_erase++;
+		if (op->num_sectors == 0 ||
+		    op->start_sector == FU_FIREHOSE_PLAN_SECTOR_UNKNOWN) {
+			fu_firehose_trace_phase_begin (&self->trace, op->phase);
+			if (!fu_firehose_device_cmd_op (device, op->cmd, FU_FIREHOSE_OP_ERASE,
+							fu_firehose_plan_op_get_size (op), error))
+				return FALSE;
+			fu_firehose_device_progress_add (self,
+							 fu_firehose_erase_get_weight (fu_firehose_plan_op_get_size (op)));
+			cnt++;
+			continue;
+		}
+		g_array_append_val (ranges, range);
+	}
+	g_array_sort (ranges, fu_firehose_erase_range_sort_cb);
+
+	for (guint i = 0; i <= ranges->len; i++) {
+		FuFirehoseEraseRange *range = NULL;
+
+		if (i < ranges->len)
+			range = &g_array_index (ranges, FuFirehoseEraseRange, i);
+		if (range != NULL && range_last != NULL &&
+		    fu_firehose_erase_range_can_merge (range_last, range)) {
+			guint64 end = MAX (range_last->start + range_last->num,
+					   range->start + range->num);
+			range_last->num = end - range_last->start;
+			continue;
+		}
+		if (range_last != NULL) {
+			guint64 size = range_last->num * range_last->op->sector_size;
+			gchar cmd[FU_FIREHOSE_PLAN_CMD_MAX];
+			gchar phase[64];
+			g_snprintf (phase, sizeof(phase),
+				    "erase %u:%" G_GUINT64_FORMAT "+%" G_GUINT64_FORMAT,
+				    range_last->op->physical_partition_number,
+				    range_last->start, range_last->num);
+			fu_firehose_trace_phase_begin (&self->trace, phase);
+			fu_firehose_plan_op_render_erase (range_last->op,
+							  range_last->start,
+							  range_last->num,
+							  cmd);
+			if (!fu_firehose_device_cmd_op (device, cmd, FU_FIREHOSE_OP_ERASE,
+							size, error))
+				return FALSE;
+			fu_firehose_device_progress_add (self, fu_firehose_erase_get_weight (size));
+			cnt++;
+		}
+		range_last = range;
+	}
+	g_debug ("erased %u ranges with %u commands", n_erase, cnt);
+	return TRUE;
+}
+
+/* the target answers <read> with a rawmode ACK, the raw data and then a
+ * second ACK; the data is received with several bulk-in transfers of
+ * MaxPayloadSizeFromTargetInBytes in flight */
+static gboolean
+fu_firehose_device_read_raw (FuDevice *device,
+			     FuFirehosePlanOp *op,
+			     guint8 *buf,
+			     guint64 size,
+			     GError **error)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	g_autoptr(GPtrArray) chunks = g_ptr_array_new_with_free_func (g_free);
+	gsize chunksz = MAX (self->max_rx_size - self->max_rx_size % self->ep_in_packet_size,
+			     self->ep_in_packet_size);
+	guint64 offset;
+
+	g_debug ("%s", op->cmd);
+	if (!fu_firehose_device_write (device, (const guint8 *) op->cmd, op->cmd_len, error))
+		return FALSE;
+	do {
+		FuFirehoseEvent event;
+		if (!fu_firehose_device_read (device, &event,
+					      FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL,
+					      error))
+			return FALSE;
+		if (event.kind != FU_FIREHOSE_EVENT_KIND_ACK)
+			continue;
+		if (!event.rawmode) {
+			g_set_error_literal (error,
+					     G_IO_ERROR,
+					     G_IO_ERROR_INVALID_DATA,
+					     "target did not send any data");
+			return FALSE;
+		}
+		break;
+	} while (1);
+
+	offset = fu_firehose_parser_take_raw (&self->parser, buf, size);
+	for (guint64 off = offset; off < size; off += chunksz) {
+		g_ptr_array_add (chunks, fu_chunk_new (chunks->len, 0, 0, buf + off,
+						       MIN (chunksz, size - off)));
+	}
+	if (!fu_firehose_device_transfer_chunks (device, FIREHOSE_EP_IN, chunks, error))
+		return FALSE;
+	return fu_firehose_device_cmd (device, NULL,
+				       FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL,
+				       error);
+}
+
+/* backs up the sectors described by a <read> entry into @dirname */
+static gboolean
+fu_firehose_device_read_op (FuDevice *device,
+			    FuFirehosePlanOp *op,
+			    const gchar *dirname,
+			    guint idx,
+			    GError **error)
 {
-	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
-	gsize sz = g_bytes_get_size (fw);
-	g_autoptr(GPtrArray) chunks = NULL;
-	gsize padlen = totalsz - sz;
-	g_autofree guint8 *tmp = NULL;
-	g_autofree gchar *value = NULL;
-
-	/* send the data in chunks */
-	chunks = fu_chunk_array_new_from_bytes (fw,
-						0x00,	/* start addr */
-						0x00,	/* page_sz */
-						self->max_tx_size);
-	for (guint i = 0; i < chunks->len; i++) {
-		FuChunk *chk = g_ptr_array_index (chunks, i);
-		guint8 *data = chk->data;
-		gsize datalen = chk->data_sz;
-
-		if (i == chunks->len - 1 && padlen) {
-			tmp = g_malloc0(chk->data_sz + padlen);
-			memcpy (tmp, chk->data, chk->data_sz);
-			data = tmp;
-		    datalen = chk->data_sz + padlen;
-		}
-
-	LOGI("sending raw data %d/%d", chk->data_sz, totalsz);
-		if (!fu_firehose_device_write (device, data, datalen, error))
-			return FALSE;
-		fu_device_set_progress_full (device, (gsize) i, (gsize) chunks->len * 2);
-	}
+	guint64 size = fu_firehose_plan_op_get_size (op);
+	gdouble elapsed;
+	gboolean ret;
+	guint8 *buf;
+	g_autofree gchar *fn = NULL;
+	g_autoptr(GTimer) timer = g_timer_new ();
 
-	if (!fu_firehose_device_cmd(device, NULL,
-			FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL,
-			error))
+	fn = fu_firehose_build_output_filename (dirname, op->filename, "read", idx);
+	buf = fu_firehose_map_output (fn, size, error);
+	if (buf == NULL)
 		return FALSE;
-
+	ret = fu_firehose_device_read_raw (device, op, buf, size, error);
+	munmap (buf, size);
+	if (!ret) {
+		g_prefix_error (error, "failed to read %s: ", fn);
+		return FALSE;
+	}
+	elapsed = g_timer_elapsed (timer, NULL);
+	LOGI ("read %" G_GUINT64_FORMAT " bytes to %s in %.2fs, %.1fMB/s",
+	      size, fn, elapsed, elapsed > 0 ? size / elapsed / 1000000 : 0.f);
 	return TRUE;
 }
 
+/* the GPT fix-ups are tiny, so several are sent before the ACKs are read
+ * rather than waiting a whole round trip for each one */
 static gboolean
-fu_firehose_device_write_quectel_part (FuDevice *device,
-					FuArchive *archive,
-					XbNode *part,
-					GError **error)
+fu_firehose_device_patch_plan (FuDevice *device, FuFirehosePlan *plan, GError **error)
 {
-	const gchar *op = xb_node_get_element (part); //erase, program
-	g_autofree gchar *tmp = NULL;
+	guint i = 0;
 
-	/* erase */
-	if (g_strcmp0 (op, "erase") == 0) {
-		if (!fu_firehose_command_erase(part, &tmp, error))
-			return FALSE;
-		return fu_firehose_device_cmd (device, tmp,
-						FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL,
-						error);
+	while (i < plan->ops->len) {
+		guint sent = 0;
+		for (; i < plan->ops->len && sent < FIREHOSE_PATCH_BATCH; i++) {
+			FuFirehosePlanOp *op = fu_firehose_plan_index (plan, i);
+			if (op->kind != FU_FIREHOSE_PLAN_KIND_PATCH)
+				continue;
+			g_debug ("%s", op->cmd);
+			if (!fu_firehose_device_write (device, (const guint8 *) op->cmd,
+						       op->cmd_len, error))
+				return FALSE;
+			sent++;
+		}
+		for (guint j = 0; j < sent; j++) {
+			if (!fu_firehose_device_cmd (device, NULL,
+						     FU_FIREHOSE_DEVICE_READ_FLAG_NONE,
+						     error)) {
+				g_prefix_error (error, "failed to patch: ");
+				return FALSE;
+			}
+		}
 	}
+	return TRUE;
+}
 
-	/* flash */
-	if (g_strcmp0 (op, "program") == 0) {
-		g_autoptr(GPtrArray) chunks = NULL;
-		g_autofree gchar *fn = NULL;
-		GBytes *fw = NULL;
-		gsize filesize = 0;
-		guint sector_size = xb_node_get_attr_as_uint(part, "SECTOR_SIZE_IN_BYTES");
-		guint num_sectors = xb_node_get_attr_as_uint(part, "num_partition_sectors");
-
-		/* find filename */
-		if (!_fu_firehose_get_absolute_path(part, &fn))
-			return TRUE;
-
-		fw = fu_archive_lookup_by_fn (archive, fn, error);
-		if (fw == NULL)
-			return FALSE;
-		filesize = g_bytes_get_size (fw);
-
-		if (!fu_firehose_command_program(part, &tmp, filesize, error))
-			return FALSE;
-
-		if (!fu_firehose_device_cmd (device, tmp,
-						FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL,
-						error))
-			return FALSE;
-
-		if (filesize)
-			num_sectors = _fu_firehose_fixup_num_sectors(filesize, sector_size);
-		return fu_firehose_device_download(device, fw, 
-				num_sectors * sector_size, error);
+/* rawprogram<N>.xml for each LUN of UFS storage followed by the
+ * patch<N>.xml GPT fix-ups, or else the single rawprogram_*.xml of NAND
+ * firmware; alternatives shipped alongside such as
+ * rawprogram0_BLANK_GPT.xml or rawprogram_unsparse0.xml are never used;
+ * @memory_name, if not %NULL, is set to the storage the manifests are for */
+static GPtrArray *
+fu_firehose_device_find_manifests (FuFirehoseArchive *archive, const gchar **memory_name)
+{
+	GPtrArray *fns = fu_firehose_archive_find_numbered (archive, FIREHOSE_LUN_XML_PREFIX, ".xml");
+
+	if (memory_name != NULL)
+		*memory_name = fns->len > 0 ? "ufs" : "nand";
+	if (fns->len > 0) {
+		g_autoptr(GPtrArray) patches = NULL;
+		patches = fu_firehose_archive_find_numbered (archive, FIREHOSE_PATCH_PREFIX, ".xml");
+		for (guint i = 0; i < patches->len; i++)
+			g_ptr_array_add (fns, g_ptr_array_index (patches, i));
+	} else {
+		const gchar *fn = fu_firehose_archive_find_by_prefix (archive, FIREHOSE_XML_PREFIX);
+		if (fn != NULL)
+			g_ptr_array_add (fns, (gpointer) fn);
 	}
+	return fns;
+}
 
-	/* unknown */
-	g_set_error (error,
-		     G_IO_ERROR,
-		     G_IO_ERROR_INVALID_DATA,
-		     "unknown operation %s", op);
-	return FALSE;
+/* the image once expanded, as the progress counts the bytes sent; a
+ * compressed image that does not record its size is assumed to fill the
+ * partition, or failing that weighted as stored */
+static guint64
+fu_firehose_device_get_program_weight (FuFirehosePlanOp *op)
+{
+	if (op->filename == NULL)
+		return 0;
+	if (op->image_expanded_size > 0)
+		return op->image_expanded_size;
+	if (op->num_sectors > 0)
+		return fu_firehose_plan_op_get_size (op);
+	return op->image_size;
 }
 
 static gboolean
-fu_firehose_device_write_quectel (FuDevice *device, FuArchive* archive, GError **error)
+fu_firehose_device_write_quectel (FuDevice *device, FuFirehoseArchive *archive, GError **error)
 {
-	GBytes *data;
-	g_autoptr(GPtrArray) erase_parts = NULL;
-	g_autoptr(GPtrArray) program_parts = NULL;
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	guint64 progress_total = 0;
+	guint64 erase_weight = 0;
+	guint read_idx = 0;
+	const gchar *memory_name = NULL;
+	g_autofree gchar *dirname = NULL;
+	g_autoptr(FuFirehosePlan) plan = NULL;
+	g_autoptr(GPtrArray) manifests = NULL;
 	g_autoptr(XbBuilder) builder = xb_builder_new ();
-	g_autoptr(XbBuilderSource) source = xb_builder_source_new ();
 	g_autoptr(XbSilo) silo = NULL;
-	g_autofree gchar *tmp = NULL;
 
-	/* load the manifest of operations */
-	data = fu_archive_lookup_by_fn_prefix (archive, FIREHOSE_XML_PREFIX, error);
-	if (data == NULL)
+	/* load the manifests of operations, e.g. one for each LUN of UFS
+	 * storage, and the GPT fix-ups that go with them */
+	manifests = fu_firehose_device_find_manifests (archive, &memory_name);
+	if (self->memory_name != NULL)
+		memory_name = self->memory_name;
+	if (manifests->len == 0) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_NOT_FOUND,
+			     "no blob for %s<N>.xml or %s*",
+			     FIREHOSE_LUN_XML_PREFIX, FIREHOSE_XML_PREFIX);
 		return FALSE;
-	if (!xb_builder_source_load_bytes (source, data,
-					   XB_BUILDER_SOURCE_FLAG_NONE, error))
+	}
+	for (guint i = 0; i < manifests->len; i++) {
+		const gchar *fn = g_ptr_array_index (manifests, i);
+		g_autoptr(GBytes) data = NULL;
+		g_autoptr(XbBuilderSource) source = xb_builder_source_new ();
+
+		g_debug ("loading %s", fn);
+		data = fu_firehose_archive_get_bytes (archive, fn, error);
+		if (data == NULL)
+			return FALSE;
+		if (!xb_builder_source_load_bytes (source, data,
+						   XB_BUILDER_SOURCE_FLAG_NONE, error)) {
+			g_prefix_error (error, "failed to load %s: ", fn);
+			return FALSE;
+		}
+		xb_builder_import_source (builder, source);
+	}
+	if (archive->cachedir != NULL) {
+		g_autofree gchar *xmlb_fn = g_build_filename (archive->cachedir, "rawprogram.xmlb", NULL);
+		g_autoptr(GFile) file = g_file_new_for_path (xmlb_fn);
+		silo = xb_builder_ensure (builder, file, XB_BUILDER_COMPILE_FLAG_NONE, NULL, error);
+	} else {
+		silo = xb_builder_compile (builder, XB_BUILDER_COMPILE_FLAG_NONE, NULL, error);
+	}
+	if (silo == NULL)
 		return FALSE;
 
-	xb_builder_import_source (builder, source);
-	silo = xb_builder_compile (builder, XB_BUILDER_COMPILE_FLAG_NONE, NULL, error);
-	if (silo == NULL)
+	/* check the whole manifest before the target is touched; the plan
+	 * itself is not cached as it is only a walk over the mapped silo, the
+	 * image headers it checks are kept by the shared archive, and delta
+	 * mode changes it for each device */
+	plan = fu_firehose_plan_new (silo, archive, error);
+	if (plan == NULL) {
+		g_prefix_error (error, "invalid manifest: ");
 		return FALSE;
+	}
+	fu_firehose_device_plan_delta (device, plan);
 
 	/* when the prog_nand*.mbn runs, it will report some info
 	 * in format of <log ..>
@@ -550,63 +2072,96 @@ fu_firehose_device_write_quectel (FuDevice *device, FuArchive* archive, GError *
 	 * 
 	 * read them out or bulk transfer will be blocked
 	 */
-	if (!fu_firehose_device_cmd (device, NULL,
-				FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL,
-				error))
+	fu_firehose_trace_phase_begin (&self->trace, "ready");
+	if (!fu_firehose_device_wait_ready (device, error))
 		return FALSE;
 
-LOGI ("======try send configure");
-
-	/* get all the data erase parts */
-	fu_firehose_command_configure(device, &tmp, error);
-	if (!fu_firehose_device_cmd (device, tmp,
-					FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL,
-					error))
+	/* negotiate the payload size */
+	fu_firehose_trace_phase_begin (&self->trace, "configure");
+	if (!fu_firehose_device_configure (device, memory_name, error))
 		return FALSE;
-		
-LOGI ("======try erase/program");
 
-	/* get all the data erase parts */
-	erase_parts = xb_silo_query (silo, "data/erase", 0, error);
-	if (erase_parts == NULL)
-		return FALSE;
+	/* raw data is only ever sent in whole sectors */
+	for (guint i = 0; i < plan->ops->len; i++) {
+		FuFirehosePlanOp *op = fu_firehose_plan_index (plan, i);
+		if (op->sector_size > self->max_tx_size) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_NOT_SUPPORTED,
+				     "payload size %u smaller than sector size %u of %s",
+				     self->max_tx_size, op->sector_size, op->name);
+			return FALSE;
+		}
+	}
+
+	/* plan the progress of the whole update */
+	for (guint i = 0; i < plan->ops->len; i++) {
+		FuFirehosePlanOp *op = fu_firehose_plan_index (plan, i);
+		if (op->kind == FU_FIREHOSE_PLAN_KIND_READ)
+			progress_total += fu_firehose_plan_op_get_size (op);
+		else if (op->kind == FU_FIREHOSE_PLAN_KIND_ERASE && !op->deferred)
+			erase_weight += fu_firehose_erase_get_weight (fu_firehose_plan_op_get_size (op));
+		else if (op->kind == FU_FIREHOSE_PLAN_KIND_PROGRAM)
+			progress_total += fu_firehose_device_get_program_weight (op);
+	}
+	progress_total += erase_weight;
+	fu_firehose_device_progress_reset (self, progress_total);
 
-	for (guint i = 0; i < erase_parts->len; i++) {
-		XbNode *part = g_ptr_array_index (erase_parts, i);
-		if (!fu_firehose_device_write_quectel_part (device,
-							     archive,
-							     part,
-							     error))
+	/* back up anything the manifest asks for before it is overwritten */
+	if (plan->n_ops[FU_FIREHOSE_PLAN_KIND_READ] > 0) {
+		dirname = fu_firehose_device_create_output_dir ("backup", error);
+		if (dirname == NULL)
+			return FALSE;
+		fu_device_set_status (device, FWUPD_STATUS_DEVICE_READ);
+	}
+	for (guint i = 0; i < plan->ops->len; i++) {
+		FuFirehosePlanOp *op = fu_firehose_plan_index (plan, i);
+		if (op->kind != FU_FIREHOSE_PLAN_KIND_READ)
+			continue;
+		fu_firehose_trace_phase_begin (&self->trace, op->phase);
+		fu_firehose_device_progress_step (self, fu_firehose_plan_op_get_size (op));
+		if (!fu_firehose_device_read_op (device, op, dirname, read_idx++, error))
 			return FALSE;
 	}
 
-	/* get all the data program parts */
-	fu_device_set_status (device, FWUPD_STATUS_DEVICE_WRITE);
-	program_parts = xb_silo_query (silo, "data/program", 0, error);
-	if (program_parts == NULL)
+	fu_device_set_status (device, FWUPD_STATUS_DEVICE_ERASE);
+	fu_firehose_device_progress_step (self, erase_weight);
+	if (!fu_firehose_device_erase_plan (device, plan, error))
 		return FALSE;
 
-	for (guint i = 0; i < program_parts->len; i++) {
-		XbNode *part = g_ptr_array_index (program_parts, i);
-		if (!fu_firehose_device_write_quectel_part (device,
-							     archive,
-							     part,
-							     error))
+	/* program */
+	fu_device_set_status (device, FWUPD_STATUS_DEVICE_WRITE);
+	for (guint i = 0; i < plan->ops->len; i++) {
+		FuFirehosePlanOp *op = fu_firehose_plan_index (plan, i);
+		if (op->kind != FU_FIREHOSE_PLAN_KIND_PROGRAM)
+			continue;
+		fu_firehose_trace_phase_begin (&self->trace, op->phase);
+		fu_firehose_device_progress_step (self, fu_firehose_device_get_program_weight (op));
+		if (!fu_firehose_device_program_op (device, archive, plan, op, error))
+			return FALSE;
+	}
+
+	/* fix up the GPT with the real size of each LUN */
+	if (plan->n_ops[FU_FIREHOSE_PLAN_KIND_PATCH] > 0) {
+		fu_firehose_trace_phase_begin (&self->trace, "patch");
+		if (!fu_firehose_device_patch_plan (device, plan, error))
 			return FALSE;
 	}
 
 	/* success */
+	fu_firehose_trace_phase_end (&self->trace);
+	fu_firehose_device_progress_step (self, 0);
 	return TRUE;
 }
 
 static gboolean
 fu_sahara_read (FuDevice *device,
 			 guint8 *resp,
+			 gsize *resp_len,
 			 FuFirehoseDeviceReadFlags flags,
 			 GError **error)
 {
-	// FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
-	GUsbDevice *usb_device = fu_usb_device_get_dev (FU_USB_DEVICE (device));
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
 	guint retries = 1;
 
 	/* these commands may return INFO or take some time to complete */
@@ -617,20 +2172,24 @@ fu_sahara_read (FuDevice *device,
 		gboolean ret;
 		gsize actual_len = 0;
 		guint8 buf[MAX_RX_SIZE] = { 0x00 };
+		gint64 start = g_get_monotonic_time ();
 		g_autoptr(GError) error_local = NULL;
 
-		ret = g_usb_device_bulk_transfer (usb_device,
-						  FIREHOSE_EP_IN,
-						  buf,
-						  sizeof(buf),
-						  &actual_len,
-						  FIREHOSE_TRANSACTION_TIMEOUT,
-						  NULL, &error_local);
+		ret = fu_firehose_transport_bulk_transfer (self->transport,
+							   FIREHOSE_EP_IN,
+							   buf,
+							   sizeof(buf),
+							   &actual_len,
+							   FIREHOSE_TRANSACTION_TIMEOUT,
+							   &error_local);
+		fu_firehose_trace_add (&self->trace, FIREHOSE_EP_IN, actual_len, start, ret);
 		if (!ret) {
 			if (g_error_matches (error_local,
 					     G_USB_DEVICE_ERROR,
 					     G_USB_DEVICE_ERROR_TIMED_OUT)) {
-				LOGI ("ignoring %s", error_local->message);
+				/* already in the trace, and expected while polling */
+				if (fu_firehose_verbose)
+					g_debug ("ignoring %s", error_local->message);
 				continue;
 			}
 			g_propagate_prefixed_error (error,
@@ -642,6 +2201,8 @@ fu_sahara_read (FuDevice *device,
 		if (actual_len >= sizeof(sahara_common_header)) {
 			if (resp != NULL)
 				memcpy(resp, buf, actual_len);
+			if (resp_len != NULL)
+				*resp_len = actual_len;
 			return TRUE;
 		}
 
@@ -664,41 +2225,75 @@ fu_sahara_read (FuDevice *device,
 static gboolean
 fu_sahara_hello_resp (FuDevice *device, sahara_mode mode, GError **error)
 {
-	gsize datalen = sizeof(sahara_hello_resp);
-	g_autofree guint8 *data = g_malloc0(datalen);
-	sahara_hello_resp *pkt = (sahara_hello_resp *)data;
+	sahara_hello_resp pkt = { 0 };
 
-	pkt->command = GINT32_TO_LE(SAHARA_HELLO_RESP);
-	pkt->length = GINT32_TO_LE(sizeof(sahara_hello_resp));
-	pkt->version = GINT32_TO_LE(SAHARA_VERSION);
-	pkt->version_compatible = GINT32_TO_LE(SAHARA_VERSION_COMPATIBLE);
-	pkt->status = GINT32_TO_LE(0);
-	pkt->mode = GINT32_TO_LE(mode);
+	pkt.command = GINT32_TO_LE(SAHARA_HELLO_RESP);
+	pkt.length = GINT32_TO_LE(sizeof(sahara_hello_resp));
+	pkt.version = GINT32_TO_LE(SAHARA_VERSION);
+	pkt.version_compatible = GINT32_TO_LE(SAHARA_VERSION_COMPATIBLE);
+	pkt.status = GINT32_TO_LE(0);
+	pkt.mode = GINT32_TO_LE(mode);
 
-	return fu_firehose_device_write (device, data, datalen, error);
+	return fu_firehose_device_write (device, (const guint8 *) &pkt, sizeof(pkt), error);
 }
 
 static gboolean
 fu_sahara_done (FuDevice *device, GError **error)
 {
-	gsize datalen = sizeof(sahara_done);
-	g_autofree guint8 *data = g_malloc0(datalen);
-	sahara_done *pkt = (sahara_done *)data;
+	sahara_done pkt = { 0 };
 
-	pkt->command = GINT32_TO_LE(SAHARA_DONE);
-	pkt->length = GINT32_TO_LE(sizeof(sahara_done));
+	pkt.command = GINT32_TO_LE(SAHARA_DONE);
+	pkt.length = GINT32_TO_LE(sizeof(sahara_done));
 
-	return fu_firehose_device_write (device, data, datalen, error);
+	return fu_firehose_device_write (device, (const guint8 *) &pkt, sizeof(pkt), error);
 }
 
+/* large requests are split into transfers that are a multiple of the
+ * packet size and kept in flight together, all pointing into @data */
 static gboolean
-fu_sahara_raw_data (FuDevice *device, GBytes *data, gsize offset, gsize datalen, GError **error)
+fu_sahara_raw_data (FuDevice *device, GBytes *data, guint64 offset, guint64 datalen, GError **error)
 {
-	gsize size;
-	const guint8 *raw_data = g_bytes_get_data(data, &size);
-	
-	raw_data += offset;
-	return fu_firehose_device_write(device, raw_data, datalen, error);
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	g_autoptr(GPtrArray) chunks = NULL;
+	gsize bufsz = 0;
+	const guint8 *buf = g_bytes_get_data (data, &bufsz);
+	gsize chunksz;
+
+	if (offset > bufsz || datalen > bufsz - offset) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "range 0x%" G_GINT64_MODIFIER "x+0x%" G_GINT64_MODIFIER "x "
+			     "outside image of 0x%" G_GSIZE_FORMAT "x bytes",
+			     offset, datalen, bufsz);
+		return FALSE;
+	}
+	if (datalen <= SAHARA_CHUNK_SIZE)
+		return fu_firehose_device_write_bytes (device, data, offset, datalen, error);
+
+	chunksz = SAHARA_CHUNK_SIZE - SAHARA_CHUNK_SIZE % self->ep_out_packet_size;
+	chunks = g_ptr_array_new_with_free_func (g_free);
+	for (guint64 off = 0; off < datalen; off += chunksz) {
+		g_ptr_array_add (chunks, fu_chunk_new (chunks->len, 0, 0, buf + offset + off,
+						       MIN (chunksz, datalen - off)));
+	}
+	return fu_firehose_device_write_chunks (device, chunks, error);
+}
+
+/* the target length is trusted for nothing but this check */
+static gboolean
+fu_sahara_check_length (const guint8 *resp, gsize resp_len, gsize pktsz, GError **error)
+{
+	const sahara_common_header *hdr = (const sahara_common_header *) resp;
+	if (resp_len < pktsz || GUINT32_FROM_LE (hdr->length) < pktsz) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "sahara command 0x%x too short: %" G_GSIZE_FORMAT " bytes",
+			     GUINT32_FROM_LE (hdr->command), resp_len);
+		return FALSE;
+	}
+	return TRUE;
 }
 
 static gboolean
@@ -731,29 +2326,225 @@ fu_firehose_device_setup (FuDevice *device, GError **error)
 }
 
 static gboolean
-fu_firehose_device_write_sahara (FuDevice *device, FuArchive* archive, GError **error)
+fu_sahara_reset (FuDevice *device, GError **error)
+{
+	sahara_reset pkt = { 0 };
+
+	pkt.command = GINT32_TO_LE(SAHARA_RESET);
+	pkt.length = GINT32_TO_LE(sizeof(sahara_reset));
+
+	return fu_firehose_device_write (device, (const guint8 *) &pkt, sizeof(pkt), error);
+}
+
+/* reads @len bytes of target memory at @addr into @buf, keeping several
+ * bulk-in transfers in flight for each request */
+static gboolean
+fu_sahara_mem_read (FuDevice *device,
+		    gboolean is_64,
+		    guint64 addr,
+		    guint8 *buf,
+		    guint64 len,
+		    GError **error)
+{
+	for (guint64 off = 0; off < len; off += SAHARA_MEM_READ_SIZE) {
+		guint64 sz = MIN (SAHARA_MEM_READ_SIZE, len - off);
+		g_autoptr(GPtrArray) chunks = g_ptr_array_new_with_free_func (g_free);
+
+		if (is_64) {
+			sahara_mem_read_64 pkt = { 0 };
+			pkt.command = GINT32_TO_LE(SAHARA_64_MEM_RD);
+			pkt.length = GINT32_TO_LE(sizeof(pkt));
+			pkt.mem_addr = GUINT64_TO_LE(addr + off);
+			pkt.len = GUINT64_TO_LE(sz);
+			if (!fu_firehose_device_write (device, (const guint8 *) &pkt, sizeof(pkt), error))
+				return FALSE;
+		} else {
+			sahara_mem_read pkt = { 0 };
+			if (addr + off + sz > G_MAXUINT32 + (guint64) 1) {
+				g_set_error (error,
+					     G_IO_ERROR,
+					     G_IO_ERROR_INVALID_DATA,
+					     "region 0x%" G_GINT64_MODIFIER "x not addressable",
+					     addr + off);
+				return FALSE;
+			}
+			pkt.command = GINT32_TO_LE(SAHARA_MEM_RD);
+			pkt.length = GINT32_TO_LE(sizeof(pkt));
+			pkt.mem_addr = GUINT32_TO_LE(addr + off);
+			pkt.len = GUINT32_TO_LE(sz);
+			if (!fu_firehose_device_write (device, (const guint8 *) &pkt, sizeof(pkt), error))
+				return FALSE;
+		}
+		for (guint64 j = 0; j < sz; j += SAHARA_CHUNK_SIZE) {
+			g_ptr_array_add (chunks, fu_chunk_new (chunks->len, 0, 0, buf + off + j,
+							       MIN (SAHARA_CHUNK_SIZE, sz - j)));
+		}
+		if (!fu_firehose_device_transfer_chunks (device, FIREHOSE_EP_IN, chunks, error))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* the region is read straight into a mapping of the output file */
+static gboolean
+fu_sahara_dump_region (FuDevice *device,
+		       gboolean is_64,
+		       guint64 addr,
+		       guint64 len,
+		       const gchar *fn,
+		       GError **error)
+{
+	gboolean ret;
+	guint8 *buf = fu_firehose_map_output (fn, len, error);
+
+	if (buf == NULL)
+		return FALSE;
+	ret = fu_sahara_mem_read (device, is_64, addr, buf, len, error);
+	munmap (buf, len);
+	return ret;
+}
+
+/* the target crashed into memory debug mode: save every region of its
+ * memory table into a new directory and reset it */
+static gboolean
+fu_firehose_device_dump_memory (FuDevice *device,
+				const guint8 *resp,
+				gsize resp_len,
+				GError **error)
+{
+	const sahara_common_header *hdr = (const sahara_common_header *) resp;
+	gboolean is_64 = GUINT32_FROM_LE (hdr->command) == SAHARA_64_MEM_DBG;
+	gsize entsz = is_64 ? sizeof(sahara_mem_table_entry_64) : sizeof(sahara_mem_table_entry);
+	guint64 tb_addr;
+	guint64 tb_len;
+	guint64 total = 0;
+	g_autofree guint8 *table = NULL;
+	g_autofree gchar *dirname = NULL;
+	g_autoptr(GTimer) timer = g_timer_new ();
+
+	if (is_64) {
+		const sahara_debug_64 *pkt = (const sahara_debug_64 *) resp;
+		if (!fu_sahara_check_length (resp, resp_len, sizeof(*pkt), error))
+			return FALSE;
+		tb_addr = GUINT64_FROM_LE (pkt->mem_tb_addr);
+		tb_len = GUINT64_FROM_LE (pkt->mem_tb_len);
+	} else {
+		const sahara_debug *pkt = (const sahara_debug *) resp;
+		if (!fu_sahara_check_length (resp, resp_len, sizeof(*pkt), error))
+			return FALSE;
+		tb_addr = GUINT32_FROM_LE (pkt->mem_tb_addr);
+		tb_len = GUINT32_FROM_LE (pkt->mem_tb_len);
+	}
+	if (tb_len == 0 || tb_len > SAHARA_MEM_TABLE_MAX || tb_len % entsz != 0) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "invalid memory table size %" G_GUINT64_FORMAT,
+			     tb_len);
+		return FALSE;
+	}
+	table = g_malloc0 (tb_len);
+	if (!fu_sahara_mem_read (device, is_64, tb_addr, table, tb_len, error)) {
+		g_prefix_error (error, "failed to read memory table: ");
+		return FALSE;
+	}
+
+	dirname = fu_firehose_device_create_output_dir ("dump", error);
+	if (dirname == NULL)
+		return FALSE;
+	for (guint i = 0; i < tb_len / entsz; i++) {
+		const guint8 *ent = table + i * entsz;
+		g_autofree gchar *basename = NULL;
+		g_autofree gchar *fn = NULL;
+		guint64 base;
+		guint64 len;
+
+		if (is_64) {
+			const sahara_mem_table_entry_64 *e = (const sahara_mem_table_entry_64 *) ent;
+			base = GUINT64_FROM_LE (e->mem_base);
+			len = GUINT64_FROM_LE (e->length);
+			basename = g_strndup (e->filename, sizeof(e->filename));
+		} else {
+			const sahara_mem_table_entry *e = (const sahara_mem_table_entry *) ent;
+			base = GUINT32_FROM_LE (e->mem_base);
+			len = GUINT32_FROM_LE (e->length);
+			basename = g_strndup (e->filename, sizeof(e->filename));
+		}
+		if (len == 0)
+			continue;
+
+		/* the name comes from the target */
+		fn = fu_firehose_build_output_filename (dirname, basename, "region", i);
+		LOGI ("dumping 0x%" G_GINT64_MODIFIER "x+0x%" G_GINT64_MODIFIER "x to %s",
+		      base, len, fn);
+		if (!fu_sahara_dump_region (device, is_64, base, len, fn, error))
+			return FALSE;
+		total += len;
+	}
+	LOGI ("dumped %" G_GUINT64_FORMAT " bytes to %s in %.1fs",
+	      total, dirname, g_timer_elapsed (timer, NULL));
+
+	/* best effort, it is going to be reset by the user anyway */
+	if (!fu_sahara_reset (device, NULL))
+		g_debug ("failed to reset target after memory dump");
+
+	g_set_error (error,
+		     G_IO_ERROR,
+		     G_IO_ERROR_FAILED,
+		     "target is in memory debug mode, memory saved to %s",
+		     dirname);
+	return FALSE;
+}
+
+static gboolean
+fu_firehose_device_write_sahara (FuDevice *device, FuFirehoseArchive *archive, GError **error)
 {
 	g_autofree guint8 *resp = g_malloc0 (MAX_RX_SIZE);
-	GBytes *data = NULL;
+	const gchar *fn;
+	g_autoptr(GBytes) data = NULL;
 
 	if (resp == NULL)
 		return FALSE;
 
 	/* load the manifest of operations */
-	data = fu_archive_lookup_by_fn_prefix (archive, FIREHOSE_TOOL_PREFIX, error);
+	fn = fu_firehose_archive_find_by_prefix (archive, FIREHOSE_TOOL_PREFIX);
+	if (fn == NULL) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_NOT_FOUND,
+			     "no blob for %s*", FIREHOSE_TOOL_PREFIX);
+		return FALSE;
+	}
+	data = fu_firehose_archive_get_bytes (archive, fn, error);
 	if (data == NULL)
 		return FALSE;
 
 	do {
 		sahara_common_header *hdr = (sahara_common_header*)resp;
+		gsize resp_len = 0;
 		memset(resp, 0, MAX_RX_SIZE);
-		if (!fu_sahara_read (device, resp, FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL, error))
+		if (!fu_sahara_read (device, resp, &resp_len, FU_FIREHOSE_DEVICE_READ_FLAG_STATUS_POLL, error))
 			return FALSE;
 
         switch (GUINT32_FROM_LE(hdr->command)) {
         case SAHARA_HELLO:
 		{
-            if (!fu_sahara_hello_resp(device, SAHARA_MODE_IMAGE_TX_COMPLETE, error)) {
+			/* the target only carries on if its mode is echoed back */
+			sahara_hello *pkt = (sahara_hello *)resp;
+			guint32 mode;
+			if (!fu_sahara_check_length (resp, resp_len, sizeof(*pkt), error))
+				return FALSE;
+			mode = GUINT32_FROM_LE(pkt->mode);
+			if (mode != SAHARA_MODE_IMAGE_TX_PENDING &&
+			    mode != SAHARA_MODE_IMAGE_TX_COMPLETE &&
+			    mode != SAHARA_MODE_MEMORY_DEBUG) {
+				g_set_error (error,
+					     G_IO_ERROR,
+					     G_IO_ERROR_NOT_SUPPORTED,
+					     "sahara mode 0x%x not supported", mode);
+				return FALSE;
+			}
+            if (!fu_sahara_hello_resp(device, mode, error)) {
 				g_prefix_error (error, "write sahara_hello_resp fail");
 				return FALSE;
 			}
@@ -762,9 +2553,23 @@ fu_firehose_device_write_sahara (FuDevice *device, FuArchive* archive, GError **
         case SAHARA_READ_DATA:
         {
             sahara_read_data *pkt = (sahara_read_data *)resp;
+            if (!fu_sahara_check_length (resp, resp_len, sizeof(*pkt), error))
+                return FALSE;
             if (!fu_sahara_raw_data(device, data, GUINT32_FROM_LE(pkt->offset),
 					GUINT32_FROM_LE(pkt->datalen), error)) {
-				g_prefix_error (error, "write sahara_raw_data fail");
+				g_prefix_error (error, "write sahara_raw_data fail: ");
+				return FALSE;
+            }
+            break;
+        }
+        case SAHARA_64_RD_DATA:
+        {
+            sahara_read_data_64 *pkt = (sahara_read_data_64 *)resp;
+            if (!fu_sahara_check_length (resp, resp_len, sizeof(*pkt), error))
+                return FALSE;
+            if (!fu_sahara_raw_data(device, data, GUINT64_FROM_LE(pkt->offset),
+					GUINT64_FROM_LE(pkt->datalen), error)) {
+				g_prefix_error (error, "write sahara_raw_data fail: ");
 				return FALSE;
             }
             break;
@@ -772,8 +2577,14 @@ fu_firehose_device_write_sahara (FuDevice *device, FuArchive* archive, GError **
         case SAHARA_END_IMG_TRANSFER:
         {
 			sahara_end_img_transfer *pkt = (sahara_end_img_transfer *)resp;
+            if (!fu_sahara_check_length (resp, resp_len, sizeof(*pkt), error))
+                return FALSE;
             if (pkt->status) {
-				g_prefix_error (error, "write sahara_end_img_tx fail %u", GUINT32_FROM_LE(pkt->status));
+				g_set_error (error,
+					     G_IO_ERROR,
+					     G_IO_ERROR_FAILED,
+					     "write sahara_end_img_tx fail %u",
+					     GUINT32_FROM_LE(pkt->status));
                 return FALSE;
             }
 
@@ -783,56 +2594,121 @@ fu_firehose_device_write_sahara (FuDevice *device, FuArchive* archive, GError **
             }
             break;
         }
+        case SAHARA_MEM_DBG:
+        case SAHARA_64_MEM_DBG:
+			return fu_firehose_device_dump_memory (device, resp, resp_len, error);
         case SAHARA_DONE_RESP:
 			/* success */
 			g_debug ("sahara transfer finished");
 			LOGI ("sahara transfer success");
 			return TRUE;
         default:
-			g_prefix_error (error, "read unknow sahara header");
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_NOT_SUPPORTED,
+				     "read unknow sahara header 0x%x",
+				     GUINT32_FROM_LE(hdr->command));
 			return FALSE;
         }
     } while (1);
 }
 
+static void
+fu_firehose_device_update_peak_rss (FuDevice *device)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	struct rusage usage = { 0 };
+
+	if (getrusage (RUSAGE_SELF, &usage) != 0)
+		return;
+	self->peak_rss = usage.ru_maxrss;
+	g_debug ("peak RSS %" G_GUINT64_FORMAT "kB", self->peak_rss);
+}
+
+static gboolean
+fu_firehose_device_write_archive (FuDevice *device,
+				  FuFirehoseArchive *archive,
+				  GError **error)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	g_autoptr(GPtrArray) manifests = NULL;
+
+	// /* load the prog_nand*.mbn of operations */
+	if (fu_firehose_archive_find_by_prefix (archive, FIREHOSE_TOOL_PREFIX) != NULL) {
+		fu_firehose_trace_phase_begin (&self->trace, "sahara");
+		if (!fu_firehose_device_write_sahara (device, archive, error))
+			return FALSE;
+	}
+
+	/* load the manifest of operations */
+	manifests = fu_firehose_device_find_manifests (archive, NULL);
+	if (manifests->len > 0)
+		return fu_firehose_device_write_quectel (device, archive, error);
+
+	/* not supported */
+	g_set_error_literal (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_NOT_SUPPORTED,
+			     "manifest not supported");
+	return FALSE;
+}
+
+/* failures do not matter, it is only for debugging */
+static void
+fu_firehose_device_save_trace (FuFirehoseDevice *self)
+{
+	g_autoptr(GError) error_local = NULL;
+
+	fu_firehose_trace_phase_end (&self->trace);
+	if (fu_firehose_trace_fn == NULL)
+		return;
+	if (!fu_firehose_trace_save (&self->trace, fu_firehose_trace_fn, &error_local))
+		g_warning ("failed to save trace: %s", error_local->message);
+}
+
+/* each device only uses its own USB handle and transfer context, so
+ * several devices can be flashed from separate threads at the same time */
 static gboolean
 fu_firehose_device_write_firmware (FuDevice *device,
 				   FuFirmware *firmware,
 				   FwupdInstallFlags flags,
 				   GError **error)
 {
-	g_autoptr(FuArchive) archive = NULL;
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	g_autoptr(FuFirehoseArchive) archive = NULL;
 	g_autoptr(GBytes) fw = NULL;
+	gboolean ret;
 
 	/* get default image */
 	fw = fu_firmware_get_image_default_bytes (firmware, error);
 	if (fw == NULL)
 		return FALSE;
 
-	/* decompress entire archive ahead of time */
-	archive = fu_archive_new (fw, FU_ARCHIVE_FLAG_IGNORE_PATH, error);
+	/* only read the directory, entries are decompressed when used and
+	 * shared with other devices flashing the same firmware */
+	archive = fu_firehose_archive_new_shared (fw, error);
 	if (archive == NULL)
 		return FALSE;
 
-	// /* load the prog_nand*.mbn of operations */
-	if (fu_archive_lookup_by_fn_prefix (archive, FIREHOSE_TOOL_PREFIX, NULL) != NULL) {
-		if (!fu_firehose_device_write_sahara (device, archive, error))
-			return FALSE;
-	}
-
-	sleep(3);	
-	/* load the manifest of operations */
-	if (fu_archive_lookup_by_fn_prefix (archive, FIREHOSE_XML_PREFIX, NULL) != NULL) {
-		if (!fu_firehose_device_write_quectel (device, archive, error))
-			return FALSE;
+	/* devices flashed later with the same firmware reuse the payloads */
+	if (archive->cachedir == NULL) {
+		g_autofree gchar *cachedir = fu_common_get_path (FU_PATH_KIND_CACHEDIR_PKG);
+		g_autofree gchar *basedir = g_build_filename (cachedir, "firehose", NULL);
+		g_autoptr(GError) error_local = NULL;
+		if (fu_firehose_archive_set_cache_dir (archive, basedir, &error_local))
+			fu_firehose_prune_dir (basedir, NULL, archive->checksum,
+					       FIREHOSE_CACHE_MAX_AGE);
+		else
+			g_debug ("not caching firmware: %s", error_local->message);
 	}
 
-	/* not supported */
-	g_set_error_literal (error,
-			     G_IO_ERROR,
-			     G_IO_ERROR_NOT_SUPPORTED,
-			     "manifest not supported");
-	return FALSE;
+	fu_firehose_trace_reset (&self->trace);
+	fu_firehose_device_bus_enter (self);
+	ret = fu_firehose_device_write_archive (device, archive, error);
+	fu_firehose_device_bus_leave (self);
+	fu_firehose_device_update_peak_rss (device);
+	fu_firehose_device_save_trace (self);
+	return ret;
 }
 
 static gboolean
@@ -842,6 +2718,8 @@ fu_firehose_device_close (FuUsbDevice *device, GError **error)
 	GUsbDevice *usb_device = fu_usb_device_get_dev (device);
 
 	/* we're done here */
+	if (!self->transport_external)
+		g_clear_pointer (&self->transport, fu_firehose_transport_free);
 	if (!g_usb_device_release_interface (usb_device, self->intf_nr,
 					     G_USB_DEVICE_CLAIM_INTERFACE_BIND_KERNEL_DRIVER,
 					     error)) {
@@ -859,7 +2737,89 @@ fu_firehose_device_set_quirk_kv (FuDevice *device,
 				 const gchar *value,
 				 GError **error)
 {
-	// FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
+
+	if (g_strcmp0 (key, "FirehoseQueueDepth") == 0) {
+		guint64 tmp = fu_common_strtoull (value);
+		if (tmp == 0 || tmp > FIREHOSE_QUEUE_DEPTH_MAX) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "invalid queue depth %s", value);
+			return FALSE;
+		}
+		self->queue_depth = tmp;
+		return TRUE;
+	}
+	if (g_strcmp0 (key, "FirehoseMaxPayloadSize") == 0) {
+		guint64 tmp = fu_common_strtoull (value);
+		if (tmp < FIREHOSE_PAYLOAD_ALIGN || tmp > G_MAXUINT32 ||
+		    tmp % FIREHOSE_PAYLOAD_ALIGN != 0) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "invalid payload size %s", value);
+			return FALSE;
+		}
+		self->payload_size_request = tmp;
+		return TRUE;
+	}
+	if (g_strcmp0 (key, "FirehoseSkipErased") == 0) {
+		FuFirehoseSkipMode mode = fu_firehose_skip_mode_from_string (value);
+		if (mode == FU_FIREHOSE_SKIP_MODE_NONE && g_strcmp0 (value, "none") != 0) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "invalid erased state %s", value);
+			return FALSE;
+		}
+		self->skip_mode = mode;
+		return TRUE;
+	}
+	if (g_strcmp0 (key, "FirehoseDeltaBlockSize") == 0) {
+		gchar *endptr = NULL;
+		guint64 tmp = g_ascii_strtoull (value, &endptr, 0);
+		if (endptr == value || *endptr != '\0' ||
+		    tmp > FIREHOSE_DELTA_BLOCK_SIZE_MAX ||
+		    tmp % FIREHOSE_PAYLOAD_ALIGN != 0) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "invalid delta block size %s", value);
+			return FALSE;
+		}
+		self->delta_block_size = tmp;
+		return TRUE;
+	}
+	if (g_strcmp0 (key, "FirehoseMemoryName") == 0) {
+		if (g_strcmp0 (value, "nand") != 0 &&
+		    g_strcmp0 (value, "emmc") != 0 &&
+		    g_strcmp0 (value, "ufs") != 0) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "invalid memory name %s", value);
+			return FALSE;
+		}
+		g_free (self->memory_name);
+		self->memory_name = g_strdup (value);
+		return TRUE;
+	}
+	if (g_strcmp0 (key, "FirehoseVerify") == 0) {
+		if (g_strcmp0 (value, "true") == 0) {
+			self->verify = TRUE;
+			return TRUE;
+		}
+		if (g_strcmp0 (value, "false") == 0) {
+			self->verify = FALSE;
+			return TRUE;
+		}
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "invalid verify value %s", value);
+		return FALSE;
+	}
 
 	/* failed */
 	g_set_error_literal (error,
@@ -873,9 +2833,11 @@ fu_firehose_device_set_quirk_kv (FuDevice *device,
 static gboolean
 fu_firehose_device_attach (FuDevice *device, GError **error)
 {
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (device);
 	g_autofree gchar *cmd = NULL;
 	fu_device_set_status (device, FWUPD_STATUS_DEVICE_RESTART);
-	fu_firehose_command_power (device, &cmd, error))
+	fu_firehose_trace_phase_begin (&self->trace, "reset");
+	fu_firehose_command_power (device, &cmd, error);
 	if (!fu_firehose_device_cmd (device, cmd,
 				       FU_FIREHOSE_DEVICE_READ_FLAG_NONE,
 				       error)) {
@@ -884,6 +2846,7 @@ fu_firehose_device_attach (FuDevice *device, GError **error)
 	else {
 		fu_device_add_flag (device, FWUPD_DEVICE_FLAG_WAIT_FOR_REPLUG);
 	}
+	fu_firehose_device_save_trace (self);
 	return TRUE;
 }
 
@@ -894,17 +2857,54 @@ fu_firehose_device_init (FuFirehoseDevice *self)
 	self->max_tx_size = MAX_TX_SIZE;
 	self->max_rx_size = MAX_RX_SIZE;
 	self->intf_nr = 0;
+	self->queue_depth = FIREHOSE_QUEUE_DEPTH_DEFAULT;
+	self->ep_out_packet_size = FIREHOSE_PAYLOAD_ALIGN;
+	self->ep_in_packet_size = FIREHOSE_PAYLOAD_ALIGN;
+	self->payload_size_request = FIREHOSE_PAYLOAD_SIZE_REQUEST;
+	fu_firehose_parser_reset (&self->parser);
+	fu_firehose_trace_init (&self->trace);
 	fu_device_set_protocol (FU_DEVICE (self), "com.qualcomm.firehose");
 	fu_device_add_flag (FU_DEVICE (self), FWUPD_DEVICE_FLAG_UPDATABLE);
 	fu_device_add_flag (FU_DEVICE (self), FWUPD_DEVICE_FLAG_IS_BOOTLOADER);
 	fu_device_set_remove_delay (FU_DEVICE (self), FIREHOSE_REMOVE_DELAY_RE_ENUMERATE);
 }
 
+/* used instead of the USB device, which is then never opened; @transport
+ * is owned by the device from now on */
+void
+fu_firehose_device_set_transport (FuFirehoseDevice *self, FuFirehoseTransport *transport)
+{
+	g_return_if_fail (FU_IS_FIREHOSE_DEVICE (self));
+	if (self->transport != NULL)
+		fu_firehose_transport_free (self->transport);
+	self->transport = transport;
+	self->transport_external = transport != NULL;
+}
+
+static void
+fu_firehose_device_finalize (GObject *object)
+{
+	FuFirehoseDevice *self = FU_FIREHOSE_DEVICE (object);
+	fu_firehose_trace_clear (&self->trace);
+	g_free (self->memory_name);
+	if (self->transport != NULL)
+		fu_firehose_transport_free (self->transport);
+	G_OBJECT_CLASS (fu_firehose_device_parent_class)->finalize (object);
+}
+
 static void
 fu_firehose_device_class_init (FuFirehoseDeviceClass *klass)
 {
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
 	FuDeviceClass *klass_device = FU_DEVICE_CLASS (klass);
 	FuUsbDeviceClass *klass_usb_device = FU_USB_DEVICE_CLASS (klass);
+
+	/* debugging aids */
+	fu_firehose_verbose = g_getenv ("FWUPD_FIREHOSE_VERBOSE") != NULL;
+	fu_firehose_trace_fn = g_getenv ("FWUPD_FIREHOSE_TRACE");
+	fu_firehose_record_fn = g_getenv ("FWUPD_FIREHOSE_RECORD");
+
+	object_class->finalize = fu_firehose_device_finalize;
 	klass_device->probe = fu_firehose_device_probe;
 	klass_device->setup = fu_firehose_device_setup;
 	klass_device->write_firmware = fu_firehose_device_write_firmware;
@@ -8,8 +8,13 @@
 
 #include "fu-plugin.h"
 
+#include "fu-firehose-transport.h"
+
 #define FU_TYPE_FIREHOSE_DEVICE (fu_firehose_device_get_type ())
 G_DECLARE_FINAL_TYPE (FuFirehoseDevice, fu_firehose_device, FU, FIREHOSE_DEVICE, FuUsbDevice)
 
+void		 fu_firehose_device_set_transport	(FuFirehoseDevice	*self,
+							 FuFirehoseTransport	*transport);
+
 #include <syslog.h>
 #define LOGI(fmt, args...) syslog(LOG_USER | LOG_INFO,    "===============quectel %s_%d " fmt, __func__, __LINE__, ##args)
\ No newline at end of file
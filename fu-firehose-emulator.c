@@ -0,0 +1,744 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "fu-common.h"
+#include "fu-firehose-emulator.h"
+#include "fu-firehose-parser.h"
+#include "fu-sahara-protocol.h"
+
+#define FU_FIREHOSE_EMULATOR_EP_IN		0x81
+#define FU_FIREHOSE_EMULATOR_EP_OUT		0x01
+#define FU_FIREHOSE_EMULATOR_IDLE		10 /* ms, when there is nothing to read */
+#define FU_FIREHOSE_EMULATOR_IMAGE_ID		13
+#define FU_FIREHOSE_EMULATOR_MEM_TABLE_ADDR	0x1000
+#define FU_FIREHOSE_EMULATOR_MEM_REGIONS	2
+#define FU_FIREHOSE_EMULATOR_MEM_REGION_ADDR	0x80000000
+#define FU_FIREHOSE_EMULATOR_MEM_REGION_SIZE	(64 * 1024)
+#define FU_FIREHOSE_EMULATOR_PPN_SHIFT		56	/* of the storage key */
+
+typedef enum {
+	FU_FIREHOSE_EMULATOR_STATE_SAHARA,
+	FU_FIREHOSE_EMULATOR_STATE_BOOT,
+	FU_FIREHOSE_EMULATOR_STATE_FIREHOSE,
+	FU_FIREHOSE_EMULATOR_STATE_RESET,	/* back to Sahara once idle */
+} FuFirehoseEmulatorState;
+
+/* a software target that speaks enough Sahara and Firehose to flash a
+ * synthetic firmware; programmed sectors are kept in memory, so reads and
+ * <getsha256digest> see them, and everything else reads as zeros; after
+ * <power> it starts again in Sahara with the storage intact; in memory
+ * debug mode it offers a small memory table of zeroed regions instead */
+typedef struct {
+	FuFirehoseTransport	 parent;
+	FuFirehoseEmulatorConfig config;
+	FuFirehoseEmulatorStats	 stats;
+	FuFirehoseEmulatorState	 state;
+	GByteArray		*pending;	/* for the next bulk-in transfers */
+	guint64			 sahara_offset;
+	guint64			 raw_out;	/* still expected from the host */
+	guint64			 raw_in;	/* still to be sent to the host */
+	guint			 raw_ppn;
+	guint			 raw_sector_size;
+	guint64			 raw_out_sector;	/* next to be stored */
+	guint64			 raw_in_offset;		/* bytes into the partition */
+	GByteArray		*raw_partial;	/* of a sector split over transfers */
+	GHashTable		*storage;	/* of ppn << 56 | sector : GBytes */
+	guint			 payload_size;
+	gint64			 cmd_received;	/* monotonic, us */
+	FuFirehoseParser	 parser;
+} FuFirehoseEmulator;
+
+void
+fu_firehose_emulator_config_init (FuFirehoseEmulatorConfig *config)
+{
+	config->latency = 0;
+	config->max_payload = 1024 * 1024;
+	config->nak_every = 0;
+	config->sahara_size = 512 * 1024;
+	config->sahara_read_size = 64 * 1024;
+	config->sahara_64bit = FALSE;
+	config->memory_debug = FALSE;
+	config->ufs = FALSE;
+}
+
+/* latency=100,max-payload=16384,nak-every=20,sahara-size=1048576,... */
+gboolean
+fu_firehose_emulator_config_parse (FuFirehoseEmulatorConfig *config,
+				   const gchar *str,
+				   GError **error)
+{
+	g_auto(GStrv) split = g_strsplit (str, ",", -1);
+
+	for (guint i = 0; split[i] != NULL; i++) {
+		g_auto(GStrv) kv = g_strsplit (split[i], "=", 2);
+		guint64 tmp;
+
+		if (kv[0] == NULL || kv[0][0] == '\0')
+			continue;
+		if (kv[1] == NULL) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_ARGUMENT,
+				     "no value for %s", kv[0]);
+			return FALSE;
+		}
+		tmp = fu_common_strtoull (kv[1]);
+		if (g_strcmp0 (kv[0], "latency") == 0) {
+			config->latency = MIN (tmp, G_MAXUINT);
+		} else if (g_strcmp0 (kv[0], "max-payload") == 0) {
+			config->max_payload = MIN (tmp, G_MAXUINT);
+		} else if (g_strcmp0 (kv[0], "nak-every") == 0) {
+			config->nak_every = MIN (tmp, G_MAXUINT);
+		} else if (g_strcmp0 (kv[0], "sahara-size") == 0) {
+			config->sahara_size = tmp;
+		} else if (g_strcmp0 (kv[0], "sahara-read-size") == 0) {
+			config->sahara_read_size = MIN (tmp, G_MAXUINT32);
+		} else if (g_strcmp0 (kv[0], "sahara-64bit") == 0) {
+			config->sahara_64bit = tmp != 0;
+		} else if (g_strcmp0 (kv[0], "memory-debug") == 0) {
+			config->memory_debug = tmp != 0;
+		} else if (g_strcmp0 (kv[0], "ufs") == 0) {
+			config->ufs = tmp != 0;
+		} else {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_ARGUMENT,
+				     "unknown emulator option %s", kv[0]);
+			return FALSE;
+		}
+	}
+	if (config->max_payload == 0 || config->sahara_read_size == 0) {
+		g_set_error_literal (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_ARGUMENT,
+				     "sizes cannot be zero");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+fu_firehose_emulator_sahara_next (FuFirehoseEmulator *self)
+{
+	guint64 remaining = self->config.sahara_size - self->sahara_offset;
+	guint64 len = MIN (remaining, self->config.sahara_read_size);
+
+	if (len == 0) {
+		sahara_end_img_transfer pkt = { 0 };
+		pkt.command = GUINT32_TO_LE (SAHARA_END_IMG_TRANSFER);
+		pkt.length = GUINT32_TO_LE (sizeof(pkt));
+		pkt.image_id = GUINT32_TO_LE (FU_FIREHOSE_EMULATOR_IMAGE_ID);
+		g_byte_array_append (self->pending, (const guint8 *) &pkt, sizeof(pkt));
+		return;
+	}
+	if (self->config.sahara_64bit) {
+		sahara_read_data_64 pkt = { 0 };
+		pkt.command = GUINT32_TO_LE (SAHARA_64_RD_DATA);
+		pkt.length = GUINT32_TO_LE (sizeof(pkt));
+		pkt.image_id = GUINT64_TO_LE (FU_FIREHOSE_EMULATOR_IMAGE_ID);
+		pkt.offset = GUINT64_TO_LE (self->sahara_offset);
+		pkt.datalen = GUINT64_TO_LE (len);
+		g_byte_array_append (self->pending, (const guint8 *) &pkt, sizeof(pkt));
+	} else {
+		sahara_read_data pkt = { 0 };
+		pkt.command = GUINT32_TO_LE (SAHARA_READ_DATA);
+		pkt.length = GUINT32_TO_LE (sizeof(pkt));
+		pkt.image_id = GUINT32_TO_LE (FU_FIREHOSE_EMULATOR_IMAGE_ID);
+		pkt.offset = GUINT32_TO_LE (self->sahara_offset);
+		pkt.datalen = GUINT32_TO_LE (len);
+		g_byte_array_append (self->pending, (const guint8 *) &pkt, sizeof(pkt));
+	}
+	self->sahara_offset += len;
+	self->raw_out = len;
+}
+
+static guint32
+fu_firehose_emulator_get_mode (FuFirehoseEmulator *self)
+{
+	return self->config.memory_debug ? SAHARA_MODE_MEMORY_DEBUG : SAHARA_MODE_IMAGE_TX_PENDING;
+}
+
+/* the target speaks first */
+static void
+fu_firehose_emulator_hello (FuFirehoseEmulator *self)
+{
+	sahara_hello pkt = { 0 };
+	pkt.command = GUINT32_TO_LE (SAHARA_HELLO);
+	pkt.length = GUINT32_TO_LE (sizeof(pkt));
+	pkt.version = GUINT32_TO_LE (2);
+	pkt.version_compatible = GUINT32_TO_LE (1);
+	pkt.mode = GUINT32_TO_LE (fu_firehose_emulator_get_mode (self));
+	g_byte_array_append (self->pending, (const guint8 *) &pkt, sizeof(pkt));
+}
+
+static void
+fu_firehose_emulator_mem_debug (FuFirehoseEmulator *self)
+{
+	if (self->config.sahara_64bit) {
+		sahara_debug_64 pkt = { 0 };
+		pkt.command = GUINT32_TO_LE (SAHARA_64_MEM_DBG);
+		pkt.length = GUINT32_TO_LE (sizeof(pkt));
+		pkt.mem_tb_addr = GUINT64_TO_LE (FU_FIREHOSE_EMULATOR_MEM_TABLE_ADDR);
+		pkt.mem_tb_len = GUINT64_TO_LE (FU_FIREHOSE_EMULATOR_MEM_REGIONS *
+						sizeof(sahara_mem_table_entry_64));
+		g_byte_array_append (self->pending, (const guint8 *) &pkt, sizeof(pkt));
+	} else {
+		sahara_debug pkt = { 0 };
+		pkt.command = GUINT32_TO_LE (SAHARA_MEM_DBG);
+		pkt.length = GUINT32_TO_LE (sizeof(pkt));
+		pkt.mem_tb_addr = GUINT32_TO_LE (FU_FIREHOSE_EMULATOR_MEM_TABLE_ADDR);
+		pkt.mem_tb_len = GUINT32_TO_LE (FU_FIREHOSE_EMULATOR_MEM_REGIONS *
+						sizeof(sahara_mem_table_entry));
+		g_byte_array_append (self->pending, (const guint8 *) &pkt, sizeof(pkt));
+	}
+}
+
+static void
+fu_firehose_emulator_mem_table (FuFirehoseEmulator *self)
+{
+	for (guint i = 0; i < FU_FIREHOSE_EMULATOR_MEM_REGIONS; i++) {
+		guint64 base = FU_FIREHOSE_EMULATOR_MEM_REGION_ADDR +
+			       (guint64) i * FU_FIREHOSE_EMULATOR_MEM_REGION_SIZE;
+		if (self->config.sahara_64bit) {
+			sahara_mem_table_entry_64 ent = { 0 };
+			ent.mem_base = GUINT64_TO_LE (base);
+			ent.length = GUINT64_TO_LE (FU_FIREHOSE_EMULATOR_MEM_REGION_SIZE);
+			g_snprintf (ent.filename, sizeof(ent.filename), "region%u.bin", i);
+			g_byte_array_append (self->pending, (const guint8 *) &ent, sizeof(ent));
+		} else {
+			sahara_mem_table_entry ent = { 0 };
+			ent.mem_base = GUINT32_TO_LE (base);
+			ent.length = GUINT32_TO_LE (FU_FIREHOSE_EMULATOR_MEM_REGION_SIZE);
+			g_snprintf (ent.filename, sizeof(ent.filename), "region%u.bin", i);
+			g_byte_array_append (self->pending, (const guint8 *) &ent, sizeof(ent));
+		}
+	}
+}
+
+/* the memory table itself, or zeros for any other address */
+static void
+fu_firehose_emulator_mem_read (FuFirehoseEmulator *self, guint64 addr, guint64 len)
+{
+	if (addr == FU_FIREHOSE_EMULATOR_MEM_TABLE_ADDR) {
+		fu_firehose_emulator_mem_table (self);
+		return;
+	}
+	self->raw_in = len;
+}
+
+static gboolean
+fu_firehose_emulator_sahara_write (FuFirehoseEmulator *self,
+				   const guint8 *buf,
+				   gsize length,
+				   GError **error)
+{
+	const sahara_common_header *hdr = (const sahara_common_header *) buf;
+
+	/* the programmer itself */
+	if (self->raw_out > 0) {
+		gsize sz = MIN (length, self->raw_out);
+		self->raw_out -= sz;
+		self->stats.sahara_bytes += sz;
+		if (self->raw_out == 0)
+			fu_firehose_emulator_sahara_next (self);
+		return TRUE;
+	}
+
+	if (length < sizeof(*hdr)) {
+		g_set_error (error,
+			     G_USB_DEVICE_ERROR,
+			     G_USB_DEVICE_ERROR_IO,
+			     "sahara packet of %" G_GSIZE_FORMAT " bytes", length);
+		return FALSE;
+	}
+	g_usleep (self->config.latency);
+	switch (GUINT32_FROM_LE (hdr->command)) {
+	case SAHARA_HELLO_RESP:
+	{
+		const sahara_hello_resp *pkt = (const sahara_hello_resp *) buf;
+		if (length < sizeof(*pkt) ||
+		    GUINT32_FROM_LE (pkt->mode) != fu_firehose_emulator_get_mode (self)) {
+			g_set_error (error,
+				     G_USB_DEVICE_ERROR,
+				     G_USB_DEVICE_ERROR_IO,
+				     "hello response not for mode 0x%x",
+				     fu_firehose_emulator_get_mode (self));
+			return FALSE;
+		}
+		if (self->config.memory_debug) {
+			fu_firehose_emulator_mem_debug (self);
+			return TRUE;
+		}
+		fu_firehose_emulator_sahara_next (self);
+		return TRUE;
+	}
+	case SAHARA_MEM_RD:
+	{
+		const sahara_mem_read *pkt = (const sahara_mem_read *) buf;
+		if (length < sizeof(*pkt))
+			break;
+		fu_firehose_emulator_mem_read (self, GUINT32_FROM_LE (pkt->mem_addr),
+					       GUINT32_FROM_LE (pkt->len));
+		return TRUE;
+	}
+	case SAHARA_64_MEM_RD:
+	{
+		const sahara_mem_read_64 *pkt = (const sahara_mem_read_64 *) buf;
+		if (length < sizeof(*pkt))
+			break;
+		fu_firehose_emulator_mem_read (self, GUINT64_FROM_LE (pkt->mem_addr),
+					       GUINT64_FROM_LE (pkt->len));
+		return TRUE;
+	}
+	case SAHARA_DONE:
+	{
+		sahara_done_resp pkt = { 0 };
+		pkt.command = GUINT32_TO_LE (SAHARA_DONE_RESP);
+		pkt.length = GUINT32_TO_LE (sizeof(pkt));
+		pkt.image_transfer_status = GUINT32_TO_LE (SAHARA_MODE_IMAGE_TX_COMPLETE);
+		g_byte_array_append (self->pending, (const guint8 *) &pkt, sizeof(pkt));
+		self->state = FU_FIREHOSE_EMULATOR_STATE_BOOT;
+		return TRUE;
+	}
+	case SAHARA_RESET:
+	{
+		sahara_reset_resp pkt = { 0 };
+		pkt.command = GUINT32_TO_LE (SAHARA_RESET_RESP);
+		pkt.length = GUINT32_TO_LE (sizeof(pkt));
+		g_byte_array_append (self->pending, (const guint8 *) &pkt, sizeof(pkt));
+		return TRUE;
+	}
+	default:
+		break;
+	}
+	g_set_error (error,
+		     G_USB_DEVICE_ERROR,
+		     G_USB_DEVICE_ERROR_IO,
+		     "unexpected sahara command 0x%x",
+		     GUINT32_FROM_LE (hdr->command));
+	return FALSE;
+}
+
+static void
+fu_firehose_emulator_queue (FuFirehoseEmulator *self, const gchar *format, ...) G_GNUC_PRINTF (2, 3);
+
+static void
+fu_firehose_emulator_queue (FuFirehoseEmulator *self, const gchar *format, ...)
+{
+	va_list args;
+	g_autofree gchar *body = NULL;
+	g_autofree gchar *doc = NULL;
+
+	va_start (args, format);
+	body = g_strdup_vprintf (format, args);
+	va_end (args);
+	doc = g_strdup_printf ("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>"
+			       "<data>%s</data>", body);
+	g_byte_array_append (self->pending, (const guint8 *) doc, strlen (doc));
+}
+
+static void
+fu_firehose_emulator_ack (FuFirehoseEmulator *self, gboolean rawmode)
+{
+	fu_firehose_emulator_queue (self, "<response value=\"ACK\" rawmode=\"%s\" />",
+				    rawmode ? "true" : "false");
+}
+
+static void
+fu_firehose_emulator_nak (FuFirehoseEmulator *self, const gchar *reason)
+{
+	self->stats.naks++;
+	fu_firehose_emulator_queue (self, "<log value=\"ERROR: %s\" />"
+				    "<response value=\"NAK\" rawmode=\"false\" />",
+				    reason);
+}
+
+static void
+fu_firehose_emulator_store (FuFirehoseEmulator *self, const guint8 *buf)
+{
+	guint64 *key = g_new (guint64, 1);
+	*key = ((guint64) self->raw_ppn << FU_FIREHOSE_EMULATOR_PPN_SHIFT) | self->raw_out_sector++;
+	g_hash_table_replace (self->storage, key, g_bytes_new (buf, self->raw_sector_size));
+}
+
+/* copies what is stored for @ppn starting @offset bytes into it */
+static void
+fu_firehose_emulator_load (FuFirehoseEmulator *self,
+			   guint ppn,
+			   guint sector_size,
+			   guint64 offset,
+			   guint8 *buf,
+			   gsize bufsz)
+{
+	while (bufsz > 0) {
+		guint64 key = ((guint64) ppn << FU_FIREHOSE_EMULATOR_PPN_SHIFT) | (offset / sector_size);
+		gsize rel = offset % sector_size;
+		gsize sz = MIN (bufsz, sector_size - rel);
+		GBytes *sector = g_hash_table_lookup (self->storage, &key);
+		gsize datasz = 0;
+		const guint8 *data = sector != NULL ? g_bytes_get_data (sector, &datasz) : NULL;
+
+		memset (buf, 0x0, sz);
+		if (rel < datasz)
+			memcpy (buf, data + rel, MIN (sz, datasz - rel));
+		buf += sz;
+		bufsz -= sz;
+		offset += sz;
+	}
+}
+
+typedef struct {
+	guint64			 first;
+	guint64			 last;
+} FuFirehoseEmulatorRange;
+
+static gboolean
+fu_firehose_emulator_erase_cb (gpointer key, gpointer value, gpointer user_data)
+{
+	FuFirehoseEmulatorRange *range = (FuFirehoseEmulatorRange *) user_data;
+	guint64 tmp = *((guint64 *) key);
+	return tmp >= range->first && tmp <= range->last;
+}
+
+static void
+fu_firehose_emulator_erase (FuFirehoseEmulator *self, guint ppn, guint64 start, guint64 num)
+{
+	FuFirehoseEmulatorRange range;
+
+	if (num == 0)
+		return;
+	range.first = ((guint64) ppn << FU_FIREHOSE_EMULATOR_PPN_SHIFT) | start;
+	range.last = range.first + num - 1;
+	g_hash_table_foreach_remove (self->storage, fu_firehose_emulator_erase_cb, &range);
+}
+
+static void
+fu_firehose_emulator_digest (FuFirehoseEmulator *self,
+			     guint ppn,
+			     guint sector_size,
+			     guint64 start,
+			     guint64 num)
+{
+	g_autoptr(GChecksum) csum = g_checksum_new (G_CHECKSUM_SHA256);
+	g_autofree guint8 *buf = g_malloc (sector_size);
+
+	for (guint64 i = 0; i < num; i++) {
+		fu_firehose_emulator_load (self, ppn, sector_size,
+					   (start + i) * sector_size, buf, sector_size);
+		g_checksum_update (csum, buf, sector_size);
+	}
+	fu_firehose_emulator_queue (self, "<log value=\"Digest 0x%s\" />",
+				    g_checksum_get_string (csum));
+	fu_firehose_emulator_ack (self, FALSE);
+}
+
+static guint64
+fu_firehose_emulator_get_size (const FuFirehoseEvent *event)
+{
+	guint64 sector_size = fu_common_strtoull (fu_firehose_event_get_attr (event, "SECTOR_SIZE_IN_BYTES"));
+	guint64 num_sectors = fu_common_strtoull (fu_firehose_event_get_attr (event, "num_partition_sectors"));
+	if (sector_size == 0 || num_sectors > G_MAXUINT64 / sector_size)
+		return 0;
+	return sector_size * num_sectors;
+}
+
+static void
+fu_firehose_emulator_command (FuFirehoseEmulator *self, const FuFirehoseEvent *event)
+{
+	const gchar *element = event->element;
+	guint64 start_sector;
+	guint64 num_sectors;
+
+	self->stats.commands++;
+	self->cmd_received = g_get_monotonic_time ();
+	g_usleep (self->config.latency);
+
+	if (self->config.nak_every > 0 &&
+	    self->stats.commands % self->config.nak_every == 0) {
+		fu_firehose_emulator_nak (self, "injected failure");
+		return;
+	}
+	if (g_strcmp0 (element, "configure") == 0) {
+		const gchar *memory_name = fu_firehose_event_get_attr (event, "MemoryName");
+		guint64 to_target = fu_common_strtoull (fu_firehose_event_get_attr (event, "MaxPayloadSizeToTargetInBytes"));
+		guint64 from_target = fu_common_strtoull (fu_firehose_event_get_attr (event, "MaxPayloadSizeFromTargetInBytes"));
+		if (g_strcmp0 (memory_name, self->config.ufs ? "ufs" : "nand") != 0) {
+			fu_firehose_emulator_nak (self, "wrong MemoryName");
+			return;
+		}
+		if (to_target == 0 || to_target > self->config.max_payload) {
+			self->stats.naks++;
+			fu_firehose_emulator_queue (self,
+						    "<response value=\"NAK\" "
+						    "MaxPayloadSizeToTargetInBytes=\"%u\" "
+						    "MaxPayloadSizeToTargetInBytesSupported=\"%u\" />",
+						    self->payload_size, self->config.max_payload);
+			return;
+		}
+		self->payload_size = to_target;
+		fu_firehose_emulator_queue (self,
+					    "<response value=\"ACK\" "
+					    "MaxPayloadSizeToTargetInBytes=\"%u\" "
+					    "MaxPayloadSizeFromTargetInBytes=\"%u\" />",
+					    self->payload_size,
+					    (guint) CLAMP (from_target, 512, self->config.max_payload));
+		return;
+	}
+
+	/* the range of a <program>, <read>, <erase> or <getsha256digest> */
+	self->raw_ppn = fu_common_strtoull (fu_firehose_event_get_attr (event, "physical_partition_number"));
+	self->raw_sector_size = fu_common_strtoull (fu_firehose_event_get_attr (event, "SECTOR_SIZE_IN_BYTES"));
+	start_sector = fu_common_strtoull (fu_firehose_event_get_attr (event, "start_sector"));
+	num_sectors = fu_common_strtoull (fu_firehose_event_get_attr (event, "num_partition_sectors"));
+	if (g_strcmp0 (element, "program") == 0) {
+		self->raw_out = fu_firehose_emulator_get_size (event);
+		self->raw_out_sector = start_sector;
+		g_byte_array_set_size (self->raw_partial, 0);
+		fu_firehose_emulator_ack (self, self->raw_out > 0);
+		return;
+	}
+	if (g_strcmp0 (element, "read") == 0) {
+		self->raw_in = fu_firehose_emulator_get_size (event);
+		self->raw_in_offset = start_sector * self->raw_sector_size;
+		fu_firehose_emulator_ack (self, self->raw_in > 0);
+		return;
+	}
+	if (g_strcmp0 (element, "getsha256digest") == 0) {
+		if (fu_firehose_emulator_get_size (event) == 0) {
+			fu_firehose_emulator_nak (self, "invalid range");
+			return;
+		}
+		fu_firehose_emulator_digest (self, self->raw_ppn, self->raw_sector_size,
+					     start_sector, num_sectors);
+		return;
+	}
+	if (g_strcmp0 (element, "erase") == 0) {
+		fu_firehose_emulator_erase (self, self->raw_ppn, start_sector, num_sectors);
+		fu_firehose_emulator_ack (self, FALSE);
+		return;
+	}
+	if (g_strcmp0 (element, "power") == 0) {
+		self->state = FU_FIREHOSE_EMULATOR_STATE_RESET;
+		fu_firehose_emulator_ack (self, FALSE);
+		return;
+	}
+	if (g_strcmp0 (element, "nop") == 0 ||
+	    g_strcmp0 (element, "patch") == 0) {
+		fu_firehose_emulator_ack (self, FALSE);
+		return;
+	}
+	fu_firehose_emulator_nak (self, "not supported");
+}
+
+static gboolean
+fu_firehose_emulator_firehose_write (FuFirehoseEmulator *self,
+				     const guint8 *buf,
+				     gsize length,
+				     GError **error)
+{
+	/* the data for a <program> */
+	if (self->raw_out > 0) {
+		gsize sz = MIN (length, self->raw_out);
+		if (length > self->payload_size) {
+			g_set_error (error,
+				     G_USB_DEVICE_ERROR,
+				     G_USB_DEVICE_ERROR_IO,
+				     "%" G_GSIZE_FORMAT " byte transfer larger than payload size %u",
+				     length, self->payload_size);
+			return FALSE;
+		}
+		self->raw_out -= sz;
+		self->stats.bytes_programmed += sz;
+
+		/* finish a sector started by the last transfer first */
+		if (self->raw_partial->len > 0) {
+			gsize fill = MIN (sz, self->raw_sector_size - self->raw_partial->len);
+			g_byte_array_append (self->raw_partial, buf, fill);
+			buf += fill;
+			sz -= fill;
+			if (self->raw_partial->len == self->raw_sector_size) {
+				fu_firehose_emulator_store (self, self->raw_partial->data);
+				g_byte_array_set_size (self->raw_partial, 0);
+			}
+		}
+		for (; sz >= self->raw_sector_size; sz -= self->raw_sector_size) {
+			fu_firehose_emulator_store (self, buf);
+			buf += self->raw_sector_size;
+		}
+		if (sz > 0)
+			g_byte_array_append (self->raw_partial, buf, sz);
+		if (self->raw_out == 0)
+			fu_firehose_emulator_ack (self, FALSE);
+		return TRUE;
+	}
+
+	/* any number of documents */
+	while (length > 0) {
+		gsize space = 0;
+		gsize sz;
+		guint8 *dst = fu_firehose_parser_get_space (&self->parser, &space, error);
+		if (dst == NULL)
+			return FALSE;
+		sz = MIN (space, length);
+		memcpy (dst, buf, sz);
+		fu_firehose_parser_commit (&self->parser, sz);
+		buf += sz;
+		length -= sz;
+		while (TRUE) {
+			FuFirehoseEvent event;
+			if (!fu_firehose_parser_next (&self->parser, &event, error))
+				return FALSE;
+			if (event.kind == FU_FIREHOSE_EVENT_KIND_NONE)
+				break;
+			fu_firehose_emulator_command (self, &event);
+		}
+	}
+	return TRUE;
+}
+
+static gboolean
+fu_firehose_emulator_read (FuFirehoseEmulator *self,
+			   guint8 *buf,
+			   gsize length,
+			   gsize *actual_length,
+			   guint timeout,
+			   GError **error)
+{
+	gsize sz;
+
+	/* restarted after the <power> ACK was collected */
+	if (self->state == FU_FIREHOSE_EMULATOR_STATE_RESET && self->pending->len == 0) {
+		self->state = FU_FIREHOSE_EMULATOR_STATE_SAHARA;
+		self->sahara_offset = 0;
+		fu_firehose_parser_reset (&self->parser);
+		fu_firehose_emulator_hello (self);
+	}
+
+	/* the programmer has started */
+	if (self->state == FU_FIREHOSE_EMULATOR_STATE_BOOT && self->pending->len == 0) {
+		fu_firehose_emulator_queue (self, "<log value=\"INFO: Binary build date: emulated\" />");
+		fu_firehose_emulator_queue (self, "<log value=\"INFO: End of supported functions 6\" />");
+		self->state = FU_FIREHOSE_EMULATOR_STATE_FIREHOSE;
+	}
+
+	/* the data for a <read> follows the ACK */
+	if (self->pending->len == 0 && self->raw_in > 0) {
+		sz = MIN (length, self->raw_in);
+		if (self->state == FU_FIREHOSE_EMULATOR_STATE_FIREHOSE) {
+			fu_firehose_emulator_load (self, self->raw_ppn, self->raw_sector_size,
+						   self->raw_in_offset, buf, sz);
+			self->raw_in_offset += sz;
+		} else {
+			memset (buf, 0x0, sz);
+		}
+		self->raw_in -= sz;
+		self->stats.bytes_read += sz;
+		if (self->raw_in == 0 && self->state == FU_FIREHOSE_EMULATOR_STATE_FIREHOSE)
+			fu_firehose_emulator_ack (self, FALSE);
+		*actual_length = sz;
+		return TRUE;
+	}
+
+	if (self->pending->len == 0) {
+		g_usleep (MIN (timeout, FU_FIREHOSE_EMULATOR_IDLE) * 1000);
+		g_set_error_literal (error,
+				     G_USB_DEVICE_ERROR,
+				     G_USB_DEVICE_ERROR_TIMED_OUT,
+				     "no data from emulator");
+		return FALSE;
+	}
+	sz = MIN (length, self->pending->len);
+	memcpy (buf, self->pending->data, sz);
+	g_byte_array_remove_range (self->pending, 0, sz);
+	*actual_length = sz;
+
+	/* the whole response has been collected */
+	if (self->pending->len == 0 && self->raw_in == 0 && self->raw_out == 0 &&
+	    self->cmd_received != 0) {
+		self->stats.round_trips++;
+		self->stats.round_trip_total += g_get_monotonic_time () - self->cmd_received;
+		self->cmd_received = 0;
+	}
+	return TRUE;
+}
+
+static gboolean
+fu_firehose_emulator_bulk_transfer (FuFirehoseTransport *transport,
+				    guint8 endpoint,
+				    guint8 *buf,
+				    gsize length,
+				    gsize *actual_length,
+				    guint timeout,
+				    GError **error)
+{
+	FuFirehoseEmulator *self = (FuFirehoseEmulator *) transport;
+	gsize actual_length_tmp = 0;
+
+	if (actual_length == NULL)
+		actual_length = &actual_length_tmp;
+	if (endpoint == FU_FIREHOSE_EMULATOR_EP_IN)
+		return fu_firehose_emulator_read (self, buf, length, actual_length, timeout, error);
+	if (endpoint != FU_FIREHOSE_EMULATOR_EP_OUT) {
+		g_set_error (error,
+			     G_USB_DEVICE_ERROR,
+			     G_USB_DEVICE_ERROR_NOT_SUPPORTED,
+			     "no endpoint 0x%02x", endpoint);
+		return FALSE;
+	}
+	if (self->state == FU_FIREHOSE_EMULATOR_STATE_SAHARA) {
+		if (!fu_firehose_emulator_sahara_write (self, buf, length, error))
+			return FALSE;
+	} else {
+		if (!fu_firehose_emulator_firehose_write (self, buf, length, error))
+			return FALSE;
+	}
+	*actual_length = length;
+	return TRUE;
+}
+
+static void
+fu_firehose_emulator_finalize (FuFirehoseTransport *transport)
+{
+	FuFirehoseEmulator *self = (FuFirehoseEmulator *) transport;
+	g_byte_array_unref (self->pending);
+	g_byte_array_unref (self->raw_partial);
+	g_hash_table_unref (self->storage);
+}
+
+static const FuFirehoseTransportVTable fu_firehose_emulator_vtable = {
+	.bulk_transfer		= fu_firehose_emulator_bulk_transfer,
+	.finalize		= fu_firehose_emulator_finalize,
+};
+
+FuFirehoseTransport *
+fu_firehose_emulator_new (const FuFirehoseEmulatorConfig *config)
+{
+	FuFirehoseEmulator *self = g_new0 (FuFirehoseEmulator, 1);
+
+	self->parent.vtable = &fu_firehose_emulator_vtable;
+	self->config = *config;
+	self->state = FU_FIREHOSE_EMULATOR_STATE_SAHARA;
+	self->payload_size = MIN (config->max_payload, 4096);
+	self->pending = g_byte_array_new ();
+	self->raw_partial = g_byte_array_new ();
+	self->storage = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+					       g_free, (GDestroyNotify) g_bytes_unref);
+	fu_firehose_parser_reset (&self->parser);
+	fu_firehose_emulator_hello (self);
+	return (FuFirehoseTransport *) self;
+}
+
+const FuFirehoseEmulatorStats *
+fu_firehose_emulator_get_stats (FuFirehoseTransport *transport)
+{
+	FuFirehoseEmulator *self = (FuFirehoseEmulator *) transport;
+	g_return_val_if_fail (transport->vtable == &fu_firehose_emulator_vtable, NULL);
+	return &self->stats;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include "fu-firehose-transport.h"
+
+typedef struct {
+	guint			 latency;		/* us, before each response */
+	guint			 max_payload;		/* largest payload accepted */
+	guint			 nak_every;		/* NAK every nth command, or 0 */
+	guint64			 sahara_size;		/* programmer bytes requested */
+	guint			 sahara_read_size;	/* per SAHARA_READ_DATA */
+	gboolean		 sahara_64bit;
+	gboolean		 memory_debug;		/* crashed, only dumps memory */
+	gboolean		 ufs;			/* MemoryName expected */
+} FuFirehoseEmulatorConfig;
+
+typedef struct {
+	guint64			 commands;
+	guint64			 naks;
+	guint64			 round_trips;
+	guint64			 round_trip_total;	/* us */
+	guint64			 sahara_bytes;
+	guint64			 bytes_programmed;
+	guint64			 bytes_read;
+} FuFirehoseEmulatorStats;
+
+void		 fu_firehose_emulator_config_init (FuFirehoseEmulatorConfig *config);
+gboolean	 fu_firehose_emulator_config_parse (FuFirehoseEmulatorConfig *config,
+						 const gchar		*str,
+						 GError			**error);
+FuFirehoseTransport *fu_firehose_emulator_new	(const FuFirehoseEmulatorConfig *config);
+const FuFirehoseEmulatorStats *fu_firehose_emulator_get_stats (FuFirehoseTransport *transport);
@@ -0,0 +1,487 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <gio/gio.h>
+
+#include "fu-firehose-image.h"
+
+/* Android sparse image format, as written by img2simg */
+#define SPARSE_HEADER_MAGIC		0xed26ff3a
+#define SPARSE_HEADER_MAJOR_VERSION	1
+#define SPARSE_CHUNK_TYPE_RAW		0xcac1
+#define SPARSE_CHUNK_TYPE_FILL		0xcac2
+#define SPARSE_CHUNK_TYPE_DONT_CARE	0xcac3
+#define SPARSE_CHUNK_TYPE_CRC32		0xcac4
+
+typedef struct __attribute__((packed)) {
+	guint32			 magic;
+	guint16			 major_version;
+	guint16			 minor_version;
+	guint16			 file_hdr_sz;
+	guint16			 chunk_hdr_sz;
+	guint32			 blk_sz;
+	guint32			 total_blks;
+	guint32			 total_chunks;
+	guint32			 image_checksum;
+} FuSparseHeader;
+
+typedef struct __attribute__((packed)) {
+	guint16			 chunk_type;
+	guint16			 reserved1;
+	guint32			 chunk_sz;	/* in blocks */
+	guint32			 total_sz;	/* in bytes, including this header */
+} FuSparseChunkHeader;
+
+static FuFirehoseExtent *
+fu_firehose_extent_new (guint64 offset, guint64 size, GBytes *data)
+{
+	FuFirehoseExtent *ext = g_new0 (FuFirehoseExtent, 1);
+	ext->offset = offset;
+	ext->size = size;
+	ext->data = g_bytes_ref (data);
+	return ext;
+}
+
+static FuFirehoseExtent *
+fu_firehose_extent_new_fill (guint64 offset, guint64 size, guint32 fill)
+{
+	FuFirehoseExtent *ext = g_new0 (FuFirehoseExtent, 1);
+	ext->offset = offset;
+	ext->size = size;
+	ext->fill = fill;
+	return ext;
+}
+
+static void
+fu_firehose_extent_free (FuFirehoseExtent *ext)
+{
+	if (ext->data != NULL)
+		g_bytes_unref (ext->data);
+	g_free (ext);
+}
+
+/* @size is the number of bytes to program, or 0 to use the blob size
+ * rounded up to a whole sector */
+FuFirehoseImage *
+fu_firehose_image_new (GBytes *blob, guint sector_size, guint64 size)
+{
+	FuFirehoseImage *self = g_new0 (FuFirehoseImage, 1);
+	guint64 blobsz = g_bytes_get_size (blob);
+	guint64 datasz;
+
+	g_return_val_if_fail (sector_size > 0, NULL);
+
+	if (size == 0)
+		size = blobsz;
+	if (size % sector_size != 0)
+		size += sector_size - (size % sector_size);
+	self->sector_size = sector_size;
+	self->size = size;
+	self->extents = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_firehose_extent_free);
+
+	/* anything past the last sector of data is zeros, which can be skipped
+	 * like any other fill if the target is already erased to zero */
+	datasz = MIN (size, ((blobsz + sector_size - 1) / sector_size) * sector_size);
+	if (datasz > 0)
+		g_ptr_array_add (self->extents, fu_firehose_extent_new (0, datasz, blob));
+	if (size > datasz)
+		g_ptr_array_add (self->extents, fu_firehose_extent_new_fill (datasz, size - datasz, 0x0));
+	return self;
+}
+
+gboolean
+fu_firehose_image_is_sparse (GBytes *blob)
+{
+	gsize bufsz = 0;
+	const guint8 *buf = g_bytes_get_data (blob, &bufsz);
+	guint32 magic;
+
+	if (bufsz < sizeof(FuSparseHeader))
+		return FALSE;
+	memcpy (&magic, buf, sizeof(magic));
+	return GUINT32_FROM_LE (magic) == SPARSE_HEADER_MAGIC;
+}
+
+/* the size the sparse image in @blob expands to, which only needs the
+ * header, or 0 if it is not a sparse image */
+guint64
+fu_firehose_image_get_sparse_size (GBytes *blob)
+{
+	FuSparseHeader hdr;
+
+	if (!fu_firehose_image_is_sparse (blob))
+		return 0;
+	memcpy (&hdr, g_bytes_get_data (blob, NULL), sizeof(hdr));
+	return (guint64) GUINT32_FROM_LE (hdr.total_blks) * GUINT32_FROM_LE (hdr.blk_sz);
+}
+
+/* RAW chunks reference the blob directly, FILL chunks become fill extents
+ * and DONT_CARE chunks are left out so they are never sent */
+FuFirehoseImage *
+fu_firehose_image_new_from_sparse (GBytes *blob, guint sector_size, GError **error)
+{
+	g_autoptr(FuFirehoseImage) self = g_new0 (FuFirehoseImage, 1);
+	FuSparseHeader hdr;
+	gsize bufsz = 0;
+	const guint8 *buf = g_bytes_get_data (blob, &bufsz);
+	guint16 file_hdr_sz;
+	guint16 chunk_hdr_sz;
+	guint32 blk_sz;
+	guint32 total_chunks;
+	guint64 blk = 0;
+	gsize offset;
+
+	g_return_val_if_fail (sector_size > 0, NULL);
+
+	self->sector_size = sector_size;
+	self->extents = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_firehose_extent_free);
+
+	/* header */
+	if (bufsz < sizeof(hdr)) {
+		g_set_error_literal (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "sparse header truncated");
+		return NULL;
+	}
+	memcpy (&hdr, buf, sizeof(hdr));
+	if (GUINT32_FROM_LE (hdr.magic) != SPARSE_HEADER_MAGIC ||
+	    GUINT16_FROM_LE (hdr.major_version) != SPARSE_HEADER_MAJOR_VERSION) {
+		g_set_error_literal (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_NOT_SUPPORTED,
+				     "not a version 1 sparse image");
+		return NULL;
+	}
+	file_hdr_sz = GUINT16_FROM_LE (hdr.file_hdr_sz);
+	chunk_hdr_sz = GUINT16_FROM_LE (hdr.chunk_hdr_sz);
+	blk_sz = GUINT32_FROM_LE (hdr.blk_sz);
+	total_chunks = GUINT32_FROM_LE (hdr.total_chunks);
+	if (file_hdr_sz < sizeof(FuSparseHeader) ||
+	    chunk_hdr_sz < sizeof(FuSparseChunkHeader)) {
+		g_set_error_literal (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "sparse header sizes invalid");
+		return NULL;
+	}
+	if (blk_sz == 0 || blk_sz % 4 != 0 || blk_sz % sector_size != 0) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_NOT_SUPPORTED,
+			     "sparse block size %u is not a multiple of the %u byte sector",
+			     blk_sz, sector_size);
+		return NULL;
+	}
+
+	/* chunks */
+	offset = file_hdr_sz;
+	for (guint32 i = 0; i < total_chunks; i++) {
+		FuSparseChunkHeader chunk;
+		guint64 size;
+		guint32 total_sz;
+
+		if (offset > bufsz || bufsz - offset < chunk_hdr_sz) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "sparse chunk %u truncated", i);
+			return NULL;
+		}
+		memcpy (&chunk, buf + offset, sizeof(chunk));
+		size = (guint64) GUINT32_FROM_LE (chunk.chunk_sz) * blk_sz;
+		total_sz = GUINT32_FROM_LE (chunk.total_sz);
+		if (total_sz < chunk_hdr_sz || bufsz - offset < total_sz) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "sparse chunk %u size invalid", i);
+			return NULL;
+		}
+
+		switch (GUINT16_FROM_LE (chunk.chunk_type)) {
+		case SPARSE_CHUNK_TYPE_RAW:
+		{
+			g_autoptr(GBytes) data = NULL;
+			if (total_sz - chunk_hdr_sz != size) {
+				g_set_error (error,
+					     G_IO_ERROR,
+					     G_IO_ERROR_INVALID_DATA,
+					     "sparse raw chunk %u size invalid", i);
+				return NULL;
+			}
+			data = g_bytes_new_from_bytes (blob, offset + chunk_hdr_sz, size);
+			g_ptr_array_add (self->extents,
+					 fu_firehose_extent_new (blk * blk_sz, size, data));
+			break;
+		}
+		case SPARSE_CHUNK_TYPE_FILL:
+		{
+			guint32 fill;
+			if (total_sz - chunk_hdr_sz < sizeof(fill)) {
+				g_set_error (error,
+					     G_IO_ERROR,
+					     G_IO_ERROR_INVALID_DATA,
+					     "sparse fill chunk %u truncated", i);
+				return NULL;
+			}
+
+			/* kept in file byte order as it is only ever replicated */
+			memcpy (&fill, buf + offset + chunk_hdr_sz, sizeof(fill));
+			g_ptr_array_add (self->extents,
+					 fu_firehose_extent_new_fill (blk * blk_sz, size, fill));
+			break;
+		}
+		case SPARSE_CHUNK_TYPE_DONT_CARE:
+		case SPARSE_CHUNK_TYPE_CRC32:
+			break;
+		default:
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_NOT_SUPPORTED,
+				     "sparse chunk type 0x%04x not supported",
+				     GUINT16_FROM_LE (chunk.chunk_type));
+			return NULL;
+		}
+		blk += GUINT32_FROM_LE (chunk.chunk_sz);
+		offset += total_sz;
+	}
+	if (blk != GUINT32_FROM_LE (hdr.total_blks)) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "sparse chunks cover %" G_GUINT64_FORMAT " blocks, expected %u",
+			     blk, GUINT32_FROM_LE (hdr.total_blks));
+		return NULL;
+	}
+	self->size = blk * blk_sz;
+	return g_steal_pointer (&self);
+}
+
+void
+fu_firehose_image_free (FuFirehoseImage *self)
+{
+	g_ptr_array_unref (self->extents);
+	g_free (self);
+}
+
+/* whole words are XORed against the pattern and ORed together so the
+ * compiler can vectorize the inner loop; it only exits per 64 bytes */
+static gboolean
+fu_firehose_image_is_blank (const guint8 *buf, gsize bufsz, guint8 value)
+{
+	const guint64 pattern = value * G_GUINT64_CONSTANT (0x0101010101010101);
+	gsize i = 0;
+
+	for (; i + 64 <= bufsz; i += 64) {
+		guint64 acc = 0;
+		for (guint j = 0; j < 64; j += sizeof(guint64)) {
+			guint64 tmp;
+			memcpy (&tmp, buf + i + j, sizeof(tmp));
+			acc |= tmp ^ pattern;
+		}
+		if (acc != 0)
+			return FALSE;
+	}
+	for (; i < bufsz; i++) {
+		if (buf[i] != value)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+fu_firehose_image_add_slice (GPtrArray *extents,
+			     FuFirehoseExtent *ext,
+			     guint64 start,
+			     guint64 end)
+{
+	gsize datasz;
+	guint64 rel = start - ext->offset;
+	guint64 len = 0;
+	g_autoptr(GBytes) data = NULL;
+
+	if (ext->data == NULL) {
+		g_ptr_array_add (extents, fu_firehose_extent_new_fill (start, end - start, ext->fill));
+		return;
+	}
+	datasz = g_bytes_get_size (ext->data);
+	if (rel < datasz)
+		len = MIN (end - start, datasz - rel);
+	data = g_bytes_new_from_bytes (ext->data, MIN (rel, datasz), len);
+	g_ptr_array_add (extents, fu_firehose_extent_new (start, end - start, data));
+}
+
+/* drops every @block_size-aligned block that is already in the erased
+ * state, splitting the extents around them */
+void
+fu_firehose_image_skip_erased (FuFirehoseImage *self,
+			       FuFirehoseSkipMode mode,
+			       guint64 block_size)
+{
+	g_autoptr(GPtrArray) extents = NULL;
+	guint32 value32;
+	guint8 value;
+
+	g_return_if_fail (block_size > 0);
+	g_return_if_fail (block_size % self->sector_size == 0);
+
+	if (mode == FU_FIREHOSE_SKIP_MODE_ERASED_FF)
+		value = 0xff;
+	else if (mode == FU_FIREHOSE_SKIP_MODE_ERASED_00)
+		value = 0x00;
+	else
+		return;
+	memset (&value32, value, sizeof(value32));
+
+	extents = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_firehose_extent_free);
+	for (guint i = 0; i < self->extents->len; i++) {
+		FuFirehoseExtent *ext = g_ptr_array_index (self->extents, i);
+		gsize datasz = 0;
+		const guint8 *data = NULL;
+		guint64 end = ext->offset + ext->size;
+		guint64 keep = ext->offset;
+
+		/* a fill pattern is either blank everywhere or nowhere */
+		if (ext->data != NULL)
+			data = g_bytes_get_data (ext->data, &datasz);
+		else if (ext->fill != value32)
+			datasz = 0;
+		else
+			datasz = ext->size;
+
+		for (guint64 pos = ext->offset; pos < end; ) {
+			guint64 next = MIN ((pos / block_size + 1) * block_size, end);
+			guint64 rel = pos - ext->offset;
+
+			/* only whole blocks backed by image data */
+			if (next - pos == block_size &&
+			    rel + block_size <= datasz &&
+			    (data == NULL ||
+			     fu_firehose_image_is_blank (data + rel, block_size, value))) {
+				if (pos > keep)
+					fu_firehose_image_add_slice (extents, ext, keep, pos);
+				self->bytes_skipped += block_size;
+				keep = next;
+			}
+			pos = next;
+		}
+		if (end > keep)
+			fu_firehose_image_add_slice (extents, ext, keep, end);
+	}
+	g_ptr_array_unref (self->extents);
+	self->extents = g_steal_pointer (&extents);
+}
+
+/* drops [@offset, @offset + @size) from the extents, splitting them */
+void
+fu_firehose_image_remove_range (FuFirehoseImage *self, guint64 offset, guint64 size)
+{
+	g_autoptr(GPtrArray) extents = NULL;
+	guint64 end = offset + size;
+
+	extents = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_firehose_extent_free);
+	for (guint i = 0; i < self->extents->len; i++) {
+		FuFirehoseExtent *ext = g_ptr_array_index (self->extents, i);
+		guint64 ext_end = ext->offset + ext->size;
+
+		if (ext_end <= offset || ext->offset >= end) {
+			fu_firehose_image_add_slice (extents, ext, ext->offset, ext_end);
+			continue;
+		}
+		if (ext->offset < offset)
+			fu_firehose_image_add_slice (extents, ext, ext->offset, offset);
+		if (ext_end > end)
+			fu_firehose_image_add_slice (extents, ext, end, ext_end);
+	}
+	g_ptr_array_unref (self->extents);
+	self->extents = g_steal_pointer (&extents);
+}
+
+static void
+fu_firehose_image_checksum_fill (GChecksum *csum, guint32 fill, guint64 size)
+{
+	guint8 buf[4096];
+
+	for (gsize i = 0; i < sizeof(buf); i += sizeof(fill))
+		memcpy (buf + i, &fill, sizeof(fill));
+	while (size > 0) {
+		gsize sz = MIN (size, sizeof(buf));
+		g_checksum_update (csum, buf, sz);
+		size -= sz;
+	}
+}
+
+/* SHA-256 of [@offset, @offset + @size) as it will be on the target, which
+ * is what <getsha256digest> returns for the same sectors; ranges that are
+ * not covered by an extent are hashed as zeros */
+void
+fu_firehose_image_checksum (FuFirehoseImage *self,
+			    guint64 offset,
+			    guint64 size,
+			    guint8 *digest)
+{
+	g_autoptr(GChecksum) csum = g_checksum_new (G_CHECKSUM_SHA256);
+	gsize digestsz = FU_FIREHOSE_IMAGE_DIGEST_SIZE;
+	guint64 pos = offset;
+	guint64 end = offset + size;
+
+	for (guint i = 0; i < self->extents->len && pos < end; i++) {
+		FuFirehoseExtent *ext = g_ptr_array_index (self->extents, i);
+		guint64 ext_end = MIN (ext->offset + ext->size, end);
+
+		if (ext_end <= pos)
+			continue;
+		if (ext->offset >= end)
+			break;
+		if (ext->offset > pos) {
+			fu_firehose_image_checksum_fill (csum, 0x0, ext->offset - pos);
+			pos = ext->offset;
+		}
+		if (ext->data != NULL) {
+			gsize datasz = 0;
+			const guint8 *data = g_bytes_get_data (ext->data, &datasz);
+			guint64 rel = pos - ext->offset;
+			if (rel < datasz) {
+				gsize sz = MIN (ext_end - pos, datasz - rel);
+				g_checksum_update (csum, data + rel, sz);
+				pos += sz;
+			}
+			fu_firehose_image_checksum_fill (csum, 0x0, ext_end - pos);
+		} else {
+			fu_firehose_image_checksum_fill (csum, ext->fill, ext_end - pos);
+		}
+		pos = ext_end;
+	}
+	if (pos < end)
+		fu_firehose_image_checksum_fill (csum, 0x0, end - pos);
+	g_checksum_get_digest (csum, digest, &digestsz);
+}
+
+FuFirehoseSkipMode
+fu_firehose_skip_mode_from_string (const gchar *str)
+{
+	if (g_strcmp0 (str, "0xff") == 0)
+		return FU_FIREHOSE_SKIP_MODE_ERASED_FF;
+	if (g_strcmp0 (str, "0x00") == 0)
+		return FU_FIREHOSE_SKIP_MODE_ERASED_00;
+	return FU_FIREHOSE_SKIP_MODE_NONE;
+}
+
+const gchar *
+fu_firehose_skip_mode_to_string (FuFirehoseSkipMode mode)
+{
+	if (mode == FU_FIREHOSE_SKIP_MODE_NONE)
+		return "none";
+	if (mode == FU_FIREHOSE_SKIP_MODE_ERASED_FF)
+		return "0xff";
+	if (mode == FU_FIREHOSE_SKIP_MODE_ERASED_00)
+		return "0x00";
+	return NULL;
+}
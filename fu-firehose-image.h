@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#define FU_FIREHOSE_IMAGE_DIGEST_SIZE		32	/* SHA-256 */
+
+typedef enum {
+	FU_FIREHOSE_SKIP_MODE_NONE,
+	FU_FIREHOSE_SKIP_MODE_ERASED_FF,
+	FU_FIREHOSE_SKIP_MODE_ERASED_00,
+} FuFirehoseSkipMode;
+
+/* a sector-aligned range of the partition that has to be programmed; @data
+ * may be shorter than @size, in which case the remainder is zero padding,
+ * and if it is %NULL the range is filled with the 32 bit @fill pattern */
+typedef struct {
+	guint64			 offset;
+	guint64			 size;
+	GBytes			*data;
+	guint32			 fill;
+} FuFirehoseExtent;
+
+/* the contents of one partition; anything not covered by an extent is
+ * left as it is on the target */
+typedef struct {
+	guint			 sector_size;
+	guint64			 size;
+	GPtrArray		*extents;	/* of FuFirehoseExtent, sorted */
+	guint64			 bytes_skipped;
+} FuFirehoseImage;
+
+FuFirehoseImage	*fu_firehose_image_new		(GBytes			*blob,
+						 guint			 sector_size,
+						 guint64		 size);
+FuFirehoseImage	*fu_firehose_image_new_from_sparse (GBytes		*blob,
+						 guint			 sector_size,
+						 GError			**error);
+gboolean	 fu_firehose_image_is_sparse	(GBytes			*blob);
+guint64		 fu_firehose_image_get_sparse_size (GBytes		*blob);
+void		 fu_firehose_image_free		(FuFirehoseImage	*self);
+void		 fu_firehose_image_skip_erased	(FuFirehoseImage	*self,
+						 FuFirehoseSkipMode	 mode,
+						 guint64		 block_size);
+void		 fu_firehose_image_remove_range	(FuFirehoseImage	*self,
+						 guint64		 offset,
+						 guint64		 size);
+void		 fu_firehose_image_checksum	(FuFirehoseImage	*self,
+						 guint64		 offset,
+						 guint64		 size,
+						 guint8			*digest);
+FuFirehoseSkipMode fu_firehose_skip_mode_from_string (const gchar	*str);
+const gchar	*fu_firehose_skip_mode_to_string (FuFirehoseSkipMode	 mode);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(FuFirehoseImage, fu_firehose_image_free)
@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <gio/gio.h>
+
+#include "fu-firehose-parser.h"
+
+/* bulk-in requests have to be a multiple of the packet size */
+#define FU_FIREHOSE_PARSER_READ_ALIGN		512
+
+void
+fu_firehose_parser_reset (FuFirehoseParser *self)
+{
+	self->len = 0;
+	self->pos = 0;
+	self->buf[0] = '\0';
+}
+
+/* returns where the next bulk-in transfer should be read to */
+guint8 *
+fu_firehose_parser_get_space (FuFirehoseParser *self, gsize *space, GError **error)
+{
+	gsize tmp;
+
+	/* move any partial document to the start of the buffer */
+	if (self->pos > 0) {
+		memmove (self->buf, self->buf + self->pos, self->len - self->pos);
+		self->len -= self->pos;
+		self->pos = 0;
+		self->buf[self->len] = '\0';
+	}
+
+	tmp = FU_FIREHOSE_PARSER_BUFSZ - self->len;
+	tmp -= tmp % FU_FIREHOSE_PARSER_READ_ALIGN;
+	if (tmp == 0) {
+		fu_firehose_parser_reset (self);
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "response larger than %u bytes",
+			     (guint) FU_FIREHOSE_PARSER_BUFSZ);
+		return NULL;
+	}
+	*space = tmp;
+	return (guint8 *) self->buf + self->len;
+}
+
+void
+fu_firehose_parser_commit (FuFirehoseParser *self, gsize len)
+{
+	g_return_if_fail (self->len + len <= FU_FIREHOSE_PARSER_BUFSZ);
+	self->len += len;
+	self->buf[self->len] = '\0';
+}
+
+const gchar *
+fu_firehose_event_get_attr (const FuFirehoseEvent *event, const gchar *name)
+{
+	for (guint i = 0; i < event->attrs_len; i++) {
+		if (g_strcmp0 (event->attrs[i].name, name) == 0)
+			return event->attrs[i].value;
+	}
+	return NULL;
+}
+
+static gchar *
+fu_firehose_parser_find (gchar *p, gchar *end, const gchar *needle)
+{
+	gsize needle_len = strlen (needle);
+	while ((gsize) (end - p) >= needle_len) {
+		p = memchr (p, needle[0], (end - p) - needle_len + 1);
+		if (p == NULL)
+			return NULL;
+		if (memcmp (p, needle, needle_len) == 0)
+			return p;
+		p++;
+	}
+	return NULL;
+}
+
+/* a '>' inside an attribute value does not end the tag */
+static gchar *
+fu_firehose_parser_find_tag_end (gchar *p, gchar *end)
+{
+	gchar quote = '\0';
+	for (; p < end; p++) {
+		if (quote != '\0') {
+			if (*p == quote)
+				quote = '\0';
+			continue;
+		}
+		if (*p == '"' || *p == '\'') {
+			quote = *p;
+			continue;
+		}
+		if (*p == '>')
+			return p;
+	}
+	return NULL;
+}
+
+/* decoding only ever shrinks the string so can be done in place */
+static void
+fu_firehose_parser_unescape (gchar *str)
+{
+	const struct {
+		const gchar	*str;
+		gsize		 len;
+		gchar		 chr;
+	} entities[] = {
+		{ "&lt;",	4,	'<' },
+		{ "&gt;",	4,	'>' },
+		{ "&amp;",	5,	'&' },
+		{ "&quot;",	6,	'"' },
+		{ "&apos;",	6,	'\'' },
+	};
+	gchar *dst;
+	gchar *src = strchr (str, '&');
+
+	if (src == NULL)
+		return;
+	dst = src;
+	while (*src != '\0') {
+		gboolean found = FALSE;
+		if (*src == '&') {
+			for (guint i = 0; i < G_N_ELEMENTS (entities); i++) {
+				if (strncmp (src, entities[i].str, entities[i].len) == 0) {
+					*dst++ = entities[i].chr;
+					src += entities[i].len;
+					found = TRUE;
+					break;
+				}
+			}
+		}
+		if (!found)
+			*dst++ = *src++;
+	}
+	*dst = '\0';
+}
+
+/* @p points after the '<' and @end at the closing '>'; the element name
+ * and attributes are NUL-terminated in place */
+static gboolean
+fu_firehose_parser_parse_element (gchar *p,
+				  gchar *end,
+				  FuFirehoseEvent *event,
+				  GError **error)
+{
+	const gchar *name = p;
+
+	while (p < end && !g_ascii_isspace (*p) && *p != '/')
+		p++;
+	if (p == name) {
+		g_set_error_literal (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "element has no name");
+		return FALSE;
+	}
+	if (p < end)
+		*p++ = '\0';
+	else
+		*end = '\0';
+	event->element = name;
+
+	/* attributes */
+	while (p < end) {
+		const gchar *attr_value;
+		gchar *attr_name;
+		gchar *attr_name_end;
+		gchar quote;
+
+		while (p < end && (g_ascii_isspace (*p) || *p == '/'))
+			p++;
+		if (p >= end)
+			break;
+		attr_name = p;
+		while (p < end && *p != '=' && !g_ascii_isspace (*p))
+			p++;
+		attr_name_end = p;
+		while (p < end && g_ascii_isspace (*p))
+			p++;
+		if (p >= end || *p != '=') {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "malformed attribute in <%s>", name);
+			return FALSE;
+		}
+		p++;
+		while (p < end && g_ascii_isspace (*p))
+			p++;
+		if (p >= end || (*p != '"' && *p != '\'')) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "unquoted attribute in <%s>", name);
+			return FALSE;
+		}
+		quote = *p++;
+		attr_value = p;
+		p = memchr (p, quote, end - p);
+		if (p == NULL) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "unterminated attribute in <%s>", name);
+			return FALSE;
+		}
+		*attr_name_end = '\0';
+		*p++ = '\0';
+		fu_firehose_parser_unescape ((gchar *) attr_value);
+		if (event->attrs_len < FU_FIREHOSE_EVENT_ATTRS_MAX) {
+			event->attrs[event->attrs_len].name = attr_name;
+			event->attrs[event->attrs_len].value = attr_value;
+			event->attrs_len++;
+		}
+	}
+
+	/* <response value="ACK" rawmode="true" /> */
+	if (g_strcmp0 (name, "response") == 0) {
+		event->value = fu_firehose_event_get_attr (event, "value");
+		event->rawmode = g_strcmp0 (fu_firehose_event_get_attr (event, "rawmode"), "true") == 0;
+		if (g_strcmp0 (event->value, "ACK") == 0) {
+			event->kind = FU_FIREHOSE_EVENT_KIND_ACK;
+			return TRUE;
+		}
+		if (g_strcmp0 (event->value, "NAK") == 0) {
+			event->kind = FU_FIREHOSE_EVENT_KIND_NAK;
+			return TRUE;
+		}
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "unknown response value %s",
+			     event->value != NULL ? event->value : "(null)");
+		return FALSE;
+	}
+
+	/* <log value="INFO: ..." /> */
+	if (g_strcmp0 (name, "log") == 0) {
+		event->value = fu_firehose_event_get_attr (event, "value");
+		if (event->value == NULL)
+			event->value = "";
+		event->kind = FU_FIREHOSE_EVENT_KIND_LOG;
+		return TRUE;
+	}
+
+	event->kind = FU_FIREHOSE_EVENT_KIND_UNKNOWN;
+	return TRUE;
+}
+
+static void
+fu_firehose_event_clear (FuFirehoseEvent *event)
+{
+	event->kind = FU_FIREHOSE_EVENT_KIND_NONE;
+	event->element = NULL;
+	event->value = NULL;
+	event->rawmode = FALSE;
+	event->attrs_len = 0;
+}
+
+/* returns the next event, or FU_FIREHOSE_EVENT_KIND_NONE if more data is needed */
+gboolean
+fu_firehose_parser_next (FuFirehoseParser *self, FuFirehoseEvent *event, GError **error)
+{
+	gchar *end = self->buf + self->len;
+
+	fu_firehose_event_clear (event);
+	while (self->pos < self->len) {
+		gchar *p = self->buf + self->pos;
+		gchar *tmp;
+		gchar *data_end;
+
+		/* skip whitespace and text content */
+		p = memchr (p, '<', end - p);
+		if (p == NULL) {
+			self->pos = self->len;
+			return TRUE;
+		}
+		self->pos = p - self->buf;
+		if (end - p < 4)
+			return TRUE;
+
+		/* <?xml ... ?> */
+		if (p[1] == '?') {
+			tmp = fu_firehose_parser_find (p + 2, end, "?>");
+			if (tmp == NULL)
+				return TRUE;
+			self->pos = (tmp + 2) - self->buf;
+			continue;
+		}
+
+		/* <!-- ... --> */
+		if (memcmp (p, "<!--", 4) == 0) {
+			tmp = fu_firehose_parser_find (p + 4, end, "-->");
+			if (tmp == NULL)
+				return TRUE;
+			self->pos = (tmp + 3) - self->buf;
+			continue;
+		}
+
+		/* wait for the rest of the tag */
+		tmp = fu_firehose_parser_find_tag_end (p + 1, end);
+		if (tmp == NULL)
+			return TRUE;
+
+		/* raw data may follow the document of a response, so wait
+		 * for its </data> to know exactly where that data starts */
+		data_end = NULL;
+		if (tmp - p > 9 && memcmp (p + 1, "response", 8) == 0 &&
+		    (g_ascii_isspace (p[9]) || p[9] == '/')) {
+			data_end = fu_firehose_parser_find (tmp + 1, end, "</data>");
+			if (data_end == NULL)
+				return TRUE;
+		}
+		self->pos = (tmp + 1) - self->buf;
+
+		/* </data> and other closing tags */
+		if (p[1] == '/' || p[1] == '!')
+			continue;
+		if (!fu_firehose_parser_parse_element (p + 1, tmp, event, error)) {
+			fu_firehose_event_clear (event);
+			return FALSE;
+		}
+
+		/* the <data> wrapper itself carries nothing */
+		if (g_strcmp0 (event->element, "data") == 0) {
+			fu_firehose_event_clear (event);
+			continue;
+		}
+		if (event->rawmode && data_end != NULL)
+			self->pos = (data_end + strlen ("</data>")) - self->buf;
+		return TRUE;
+	}
+	return TRUE;
+}
+
+/* after an ACK with rawmode="true" the target sends raw data, and the start
+ * of it may already have been read into the buffer behind the document;
+ * fu_firehose_parser_next() has already consumed the </data> so everything
+ * left is data, whatever it looks like */
+gsize
+fu_firehose_parser_take_raw (FuFirehoseParser *self, guint8 *buf, gsize bufsz)
+{
+	gsize len;
+
+	len = MIN (self->len - self->pos, bufsz);
+	memcpy (buf, self->buf + self->pos, len);
+	self->pos += len;
+	return len;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#define FU_FIREHOSE_PARSER_BUFSZ		(16 * 1024)
+#define FU_FIREHOSE_EVENT_ATTRS_MAX		24
+
+typedef enum {
+	FU_FIREHOSE_EVENT_KIND_NONE,		/* more data needed */
+	FU_FIREHOSE_EVENT_KIND_ACK,
+	FU_FIREHOSE_EVENT_KIND_NAK,
+	FU_FIREHOSE_EVENT_KIND_LOG,
+	FU_FIREHOSE_EVENT_KIND_UNKNOWN,
+} FuFirehoseEventKind;
+
+typedef struct {
+	const gchar		*name;
+	const gchar		*value;
+} FuFirehoseAttr;
+
+/* all strings point into the parser buffer and are only valid until
+ * fu_firehose_parser_get_space() is next called */
+typedef struct {
+	FuFirehoseEventKind	 kind;
+	const gchar		*element;
+	const gchar		*value;
+	gboolean		 rawmode;
+	guint			 attrs_len;
+	FuFirehoseAttr		 attrs[FU_FIREHOSE_EVENT_ATTRS_MAX];
+} FuFirehoseEvent;
+
+/* incremental tokenizer for the <data> documents sent by the target; any
+ * number of documents may be packed into one bulk-in transfer and a single
+ * document may be split across several */
+typedef struct {
+	gchar			 buf[FU_FIREHOSE_PARSER_BUFSZ + 1];
+	gsize			 len;
+	gsize			 pos;
+} FuFirehoseParser;
+
+void		 fu_firehose_parser_reset	(FuFirehoseParser	*self);
+guint8		*fu_firehose_parser_get_space	(FuFirehoseParser	*self,
+						 gsize			*space,
+						 GError			**error);
+void		 fu_firehose_parser_commit	(FuFirehoseParser	*self,
+						 gsize			 len);
+gboolean	 fu_firehose_parser_next	(FuFirehoseParser	*self,
+						 FuFirehoseEvent	*event,
+						 GError			**error);
+gsize		 fu_firehose_parser_take_raw	(FuFirehoseParser	*self,
+						 guint8			*buf,
+						 gsize			 bufsz);
+const gchar	*fu_firehose_event_get_attr	(const FuFirehoseEvent	*event,
+						 const gchar		*name);
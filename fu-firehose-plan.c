@@ -0,0 +1,495 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "fu-firehose-image.h"
+#include "fu-firehose-plan.h"
+
+#define FU_FIREHOSE_PLAN_STR_MAX		64	/* for start_sector and value expressions */
+
+static const gchar *
+fu_firehose_plan_kind_to_string (FuFirehosePlanKind kind)
+{
+	if (kind == FU_FIREHOSE_PLAN_KIND_READ)
+		return "read";
+	if (kind == FU_FIREHOSE_PLAN_KIND_ERASE)
+		return "erase";
+	if (kind == FU_FIREHOSE_PLAN_KIND_PROGRAM)
+		return "program";
+	if (kind == FU_FIREHOSE_PLAN_KIND_PATCH)
+		return "patch";
+	return NULL;
+}
+
+/* strings copied into a command must not end the attribute early */
+static gboolean
+fu_firehose_plan_check_str (const gchar *key, const gchar *str, GError **error)
+{
+	if (str == NULL || str[0] == '\0' || strlen (str) > FU_FIREHOSE_PLAN_STR_MAX ||
+	    strpbrk (str, "\"<>&") != NULL) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "invalid %s", key);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* @value is left alone if the attribute is not set and not @required */
+static gboolean
+fu_firehose_plan_parse_uint (XbNode *n,
+			     const gchar *key,
+			     gboolean required,
+			     guint64 max,
+			     guint64 *value,
+			     GError **error)
+{
+	const gchar *str = xb_node_get_attr (n, key);
+	gchar *endptr = NULL;
+	guint64 tmp;
+
+	if (str == NULL || str[0] == '\0') {
+		if (!required)
+			return TRUE;
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "no %s", key);
+		return FALSE;
+	}
+	tmp = g_ascii_strtoull (str, &endptr, 0);
+	if (endptr == str || *endptr != '\0' || tmp > max) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "invalid %s %s", key, str);
+		return FALSE;
+	}
+	*value = tmp;
+	return TRUE;
+}
+
+/* the image is checked here so that a missing file is found before
+ * anything has been erased */
+static gboolean
+fu_firehose_plan_add_image (FuFirehosePlan *self,
+			    FuFirehoseArchive *archive,
+			    FuFirehosePlanOp *op,
+			    GError **error)
+{
+	g_autoptr(GBytes) header = NULL;
+
+	header = fu_firehose_archive_get_header (archive, op->filename, error);
+	if (header == NULL)
+		return FALSE;
+	op->image_compressed = fu_firehose_archive_is_compressed (header);
+	op->image_sparse = fu_firehose_image_is_sparse (header);
+	if (!fu_firehose_archive_get_size (archive, op->filename, &op->image_size, NULL))
+		op->image_size = 0;
+
+	/* one file split over several partitions, only possible when the
+	 * image is stored as it is programmed */
+	if (op->image_slice) {
+		guint64 size = op->image_size;
+		if (op->image_sparse || op->image_compressed) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_NOT_SUPPORTED,
+				     "%s is sparse or compressed and cannot be used "
+				     "with file_sector_offset or partofsingleimage",
+				     op->filename);
+			return FALSE;
+		}
+		if (op->image_offset >= size) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "file_sector_offset is past the end of %s",
+				     op->filename);
+			return FALSE;
+		}
+		size -= op->image_offset;
+		if (op->num_sectors > 0)
+			size = MIN (size, op->num_sectors * op->sector_size);
+		op->image_size = size;
+	}
+
+	/* the expanded size of a compressed image is usually only known
+	 * when sending, but a sparse header has it */
+	if (op->image_compressed)
+		op->image_expanded_size = fu_firehose_archive_get_uncompressed_size (header);
+	else if (op->image_sparse)
+		op->image_expanded_size = fu_firehose_image_get_sparse_size (header);
+	else
+		op->image_expanded_size = op->image_size;
+	if (op->num_sectors > 0 && op->image_expanded_size > 0) {
+		guint64 size = op->image_expanded_size;
+		if (size > op->num_sectors * op->sector_size) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "%s is %" G_GUINT64_FORMAT " bytes, larger than the partition",
+				     op->filename, size);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* the attribute is left out entirely for storage without blocks */
+static const gchar *
+fu_firehose_plan_op_pages_per_block_attr (const FuFirehosePlanOp *op,
+					  gchar *buf, gsize bufsz)
+{
+	if (op->pages_per_block == 0)
+		return "";
+	g_snprintf (buf, bufsz, "PAGES_PER_BLOCK=\"%u\" ", op->pages_per_block);
+	return buf;
+}
+
+static gboolean
+fu_firehose_plan_add_node (FuFirehosePlan *self,
+			   FuFirehoseArchive *archive,
+			   FuFirehosePlanKind kind,
+			   XbNode *n,
+			   GError **error)
+{
+	FuFirehosePlanOp op = { 0 };
+	const gchar *tmp;
+	guint64 value = 0;
+	gchar *endptr = NULL;
+	gchar buf[FU_FIREHOSE_PLAN_CMD_MAX];
+	gchar ppb[FU_FIREHOSE_PLAN_STR_MAX];
+	gsize len;
+
+	op.kind = kind;
+	op.last_sector = G_MAXUINT64;
+
+	/* geometry */
+	if (!fu_firehose_plan_parse_uint (n, "SECTOR_SIZE_IN_BYTES", TRUE, G_MAXUINT32, &value, error))
+		return FALSE;
+	if (value == 0) {
+		g_set_error_literal (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "invalid SECTOR_SIZE_IN_BYTES 0");
+		return FALSE;
+	}
+	op.sector_size = value;
+
+	/* only NAND has blocks, UFS and eMMC manifests omit this */
+	if (kind == FU_FIREHOSE_PLAN_KIND_ERASE || kind == FU_FIREHOSE_PLAN_KIND_PROGRAM) {
+		value = 0;
+		if (!fu_firehose_plan_parse_uint (n, "PAGES_PER_BLOCK", FALSE, G_MAXUINT32, &value, error))
+			return FALSE;
+		op.pages_per_block = value;
+	}
+	if (!fu_firehose_plan_parse_uint (n, "physical_partition_number", TRUE, G_MAXUINT32, &value, error))
+		return FALSE;
+	op.physical_partition_number = value;
+
+	/* the range */
+	if (!fu_firehose_plan_parse_uint (n, "num_partition_sectors",
+					  kind == FU_FIREHOSE_PLAN_KIND_READ ||
+					  kind == FU_FIREHOSE_PLAN_KIND_ERASE,
+					  G_MAXUINT64 / op.sector_size,
+					  &op.num_sectors, error))
+		return FALSE;
+	if (kind == FU_FIREHOSE_PLAN_KIND_READ &&
+	    (op.num_sectors == 0 || op.num_sectors > G_MAXSIZE / op.sector_size)) {
+		g_set_error_literal (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "invalid <read> size");
+		return FALSE;
+	}
+	if (!fu_firehose_plan_parse_uint (n, "last_sector", FALSE, G_MAXUINT64 - 1,
+					  &op.last_sector, error))
+		return FALSE;
+	tmp = xb_node_get_attr (n, "start_sector");
+	if (!fu_firehose_plan_check_str ("start_sector", tmp, error))
+		return FALSE;
+	op.start_sector_str = g_string_chunk_insert_const (self->arena, tmp);
+	op.start_sector = g_ascii_strtoull (tmp, &endptr, 0);
+	if (*endptr != '\0') {
+		op.start_sector = FU_FIREHOSE_PLAN_SECTOR_UNKNOWN;
+	} else if (op.start_sector > G_MAXUINT64 - 1 - op.num_sectors) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_DATA,
+			     "start_sector %s out of range", tmp);
+		return FALSE;
+	}
+
+	/* only the basename of a Windows path is used */
+	tmp = xb_node_get_attr (n, "filename");
+	if (kind == FU_FIREHOSE_PLAN_KIND_PATCH) {
+		if (g_strcmp0 (tmp, "DISK") != 0)
+			return TRUE;
+	} else if (tmp != NULL) {
+		g_autofree gchar *fn = g_strdup (strrchr (tmp, '\\') != NULL ?
+						 strrchr (tmp, '\\') + 1 : tmp);
+		g_strstrip (fn);
+		if (fn[0] != '\0')
+			op.filename = g_string_chunk_insert_const (self->arena, fn);
+	}
+	if (kind == FU_FIREHOSE_PLAN_KIND_PROGRAM && op.filename != NULL) {
+		value = 0;
+		if (!fu_firehose_plan_parse_uint (n, "file_sector_offset", FALSE,
+						  G_MAXUINT64 / op.sector_size, &value, error))
+			return FALSE;
+		op.image_offset = value * op.sector_size;
+		op.image_slice = op.image_offset > 0 ||
+				 g_strcmp0 (xb_node_get_attr (n, "partofsingleimage"), "true") == 0;
+		if (!fu_firehose_plan_add_image (self, archive, &op, error))
+			return FALSE;
+	}
+
+	/* for debugging */
+	tmp = xb_node_get_attr (n, kind == FU_FIREHOSE_PLAN_KIND_PATCH ? "what" : "label");
+	if (tmp != NULL && tmp[0] != '\0')
+		op.name = g_string_chunk_insert_const (self->arena, tmp);
+	else if (op.filename != NULL)
+		op.name = op.filename;
+	else
+		op.name = op.start_sector_str;
+	g_snprintf (buf, sizeof(buf), "%s %s", fu_firehose_plan_kind_to_string (kind), op.name);
+	op.phase = g_string_chunk_insert_const (self->arena, buf);
+
+	/* the command for the whole range */
+	if (kind == FU_FIREHOSE_PLAN_KIND_ERASE) {
+		guint64 last_sector = op.last_sector;
+		if (last_sector == G_MAXUINT64) {
+			last_sector = op.start_sector != FU_FIREHOSE_PLAN_SECTOR_UNKNOWN ? op.start_sector : 0;
+			last_sector += op.num_sectors - 1;
+		}
+		len = g_snprintf (buf, sizeof(buf),
+				  "<?xml version=\"1.0\" ?><data>"
+				  "<erase %sSECTOR_SIZE_IN_BYTES=\"%u\" "
+				  "last_sector=\"%" G_GUINT64_FORMAT "\" "
+				  "num_partition_sectors=\"%" G_GUINT64_FORMAT "\" "
+				  "physical_partition_number=\"%u\" start_sector=\"%s\"/>"
+				  "</data>",
+				  fu_firehose_plan_op_pages_per_block_attr (&op, ppb, sizeof(ppb)),
+				  op.sector_size, last_sector,
+				  op.num_sectors, op.physical_partition_number,
+				  op.start_sector_str);
+		op.cmd = g_string_chunk_insert_len (self->arena, buf, len);
+		op.cmd_len = len;
+	} else if (kind == FU_FIREHOSE_PLAN_KIND_READ) {
+		len = g_snprintf (buf, sizeof(buf),
+				  "<?xml version=\"1.0\" ?><data>"
+				  "<read SECTOR_SIZE_IN_BYTES=\"%u\" "
+				  "num_partition_sectors=\"%" G_GUINT64_FORMAT "\" "
+				  "physical_partition_number=\"%u\" start_sector=\"%s\"/>"
+				  "</data>",
+				  op.sector_size, op.num_sectors,
+				  op.physical_partition_number, op.start_sector_str);
+		op.cmd = g_string_chunk_insert_len (self->arena, buf, len);
+		op.cmd_len = len;
+	} else if (kind == FU_FIREHOSE_PLAN_KIND_PATCH) {
+		guint64 byte_offset = 0;
+		guint64 size_in_bytes = 0;
+		const gchar *value = xb_node_get_attr (n, "value");
+		if (!fu_firehose_plan_parse_uint (n, "byte_offset", TRUE,
+						  op.sector_size - 1, &byte_offset, error))
+			return FALSE;
+		if (!fu_firehose_plan_parse_uint (n, "size_in_bytes", TRUE,
+						  op.sector_size - byte_offset,
+						  &size_in_bytes, error))
+			return FALSE;
+		if (!fu_firehose_plan_check_str ("value", value, error))
+			return FALSE;
+		len = g_snprintf (buf, sizeof(buf),
+				  "<?xml version=\"1.0\" ?><data>"
+				  "<patch SECTOR_SIZE_IN_BYTES=\"%u\" "
+				  "byte_offset=\"%" G_GUINT64_FORMAT "\" filename=\"DISK\" "
+				  "physical_partition_number=\"%u\" "
+				  "size_in_bytes=\"%" G_GUINT64_FORMAT "\" "
+				  "start_sector=\"%s\" value=\"%s\"/>"
+				  "</data>",
+				  op.sector_size, byte_offset,
+				  op.physical_partition_number, size_in_bytes,
+				  op.start_sector_str, value);
+		op.cmd = g_string_chunk_insert_len (self->arena, buf, len);
+		op.cmd_len = len;
+	}
+
+	g_array_append_val (self->ops, op);
+	self->n_ops[kind]++;
+	return TRUE;
+}
+
+static gboolean
+fu_firehose_plan_add_kind (FuFirehosePlan *self,
+			   XbSilo *silo,
+			   FuFirehoseArchive *archive,
+			   FuFirehosePlanKind kind,
+			   GError **error)
+{
+	const gchar *element = fu_firehose_plan_kind_to_string (kind);
+	g_autofree gchar *xpath = NULL;
+	g_autoptr(GError) error_local = NULL;
+	g_autoptr(GPtrArray) nodes = NULL;
+
+	/* the GPT fix-ups are in separate patch*.xml files */
+	if (kind == FU_FIREHOSE_PLAN_KIND_PATCH)
+		xpath = g_strdup_printf ("patches/%s", element);
+	else
+		xpath = g_strdup_printf ("data/%s", element);
+	nodes = xb_silo_query (silo, xpath, 0, &error_local);
+	if (nodes == NULL) {
+		if (g_error_matches (error_local, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+			return TRUE;
+		g_propagate_error (error, g_steal_pointer (&error_local));
+		return FALSE;
+	}
+	for (guint i = 0; i < nodes->len; i++) {
+		XbNode *n = g_ptr_array_index (nodes, i);
+		if (!fu_firehose_plan_add_node (self, archive, kind, n, error)) {
+			g_prefix_error (error, "<%s> %u: ", element, i);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* compiles the manifests in @silo, checking every entry and the images
+ * they refer to before anything is sent to the target; @silo may hold
+ * several rawprogram and patch documents, which are merged in order */
+FuFirehosePlan *
+fu_firehose_plan_new (XbSilo *silo, FuFirehoseArchive *archive, GError **error)
+{
+	g_autoptr(FuFirehosePlan) self = g_new0 (FuFirehosePlan, 1);
+
+	self->ops = g_array_new (FALSE, TRUE, sizeof(FuFirehosePlanOp));
+	self->arena = g_string_chunk_new (4096);
+	for (guint i = 0; i < FU_FIREHOSE_PLAN_KIND_LAST; i++) {
+		if (!fu_firehose_plan_add_kind (self, silo, archive, i, error))
+			return NULL;
+	}
+	if (self->n_ops[FU_FIREHOSE_PLAN_KIND_ERASE] == 0 &&
+	    self->n_ops[FU_FIREHOSE_PLAN_KIND_PROGRAM] == 0) {
+		g_set_error_literal (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "manifest has nothing to erase or program");
+		return NULL;
+	}
+	return g_steal_pointer (&self);
+}
+
+void
+fu_firehose_plan_free (FuFirehosePlan *self)
+{
+	g_array_unref (self->ops);
+	g_string_chunk_free (self->arena);
+	g_free (self);
+}
+
+FuFirehosePlanOp *
+fu_firehose_plan_index (FuFirehosePlan *self, guint idx)
+{
+	return &g_array_index (self->ops, FuFirehosePlanOp, idx);
+}
+
+/* the size in bytes of the sectors covered by @op, or 0 if not known */
+guint64
+fu_firehose_plan_op_get_size (const FuFirehosePlanOp *op)
+{
+	return op->num_sectors * op->sector_size;
+}
+
+/* NAND is erased and programmed in blocks of PAGES_PER_BLOCK sectors,
+ * everything else a sector at a time */
+guint64
+fu_firehose_plan_op_get_block_size (const FuFirehosePlanOp *op)
+{
+	return (guint64) op->sector_size * MAX (op->pages_per_block, 1);
+}
+
+/* all of these write at most FU_FIREHOSE_PLAN_CMD_MAX bytes to @buf and
+ * return the length of the command */
+gsize
+fu_firehose_plan_op_render_erase (const FuFirehosePlanOp *op,
+				  guint64 start_sector,
+				  guint64 num_sectors,
+				  gchar *buf)
+{
+	gchar ppb[FU_FIREHOSE_PLAN_STR_MAX];
+	return g_snprintf (buf, FU_FIREHOSE_PLAN_CMD_MAX,
+			   "<?xml version=\"1.0\" ?><data>"
+			   "<erase %sSECTOR_SIZE_IN_BYTES=\"%u\" "
+			   "last_sector=\"%" G_GUINT64_FORMAT "\" "
+			   "num_partition_sectors=\"%" G_GUINT64_FORMAT "\" "
+			   "physical_partition_number=\"%u\" "
+			   "start_sector=\"%" G_GUINT64_FORMAT "\"/>"
+			   "</data>",
+			   fu_firehose_plan_op_pages_per_block_attr (op, ppb, sizeof(ppb)),
+			   op->sector_size,
+			   start_sector + num_sectors - 1, num_sectors,
+			   op->physical_partition_number, start_sector);
+}
+
+/* @offset is in sectors from the start of @op; returns 0 if that cannot
+ * be expressed because the start_sector is relative to the end of the disk */
+gsize
+fu_firehose_plan_op_render_program (const FuFirehosePlanOp *op,
+				    guint64 offset,
+				    guint64 num_sectors,
+				    gchar *buf)
+{
+	gchar start_sector_str[FU_FIREHOSE_PLAN_STR_MAX + 1];
+	gchar ppb[FU_FIREHOSE_PLAN_STR_MAX];
+	guint64 start_sector = op->start_sector;
+	guint64 last_sector = op->last_sector;
+
+	if (start_sector == FU_FIREHOSE_PLAN_SECTOR_UNKNOWN) {
+		if (offset != 0)
+			return 0;
+		g_strlcpy (start_sector_str, op->start_sector_str, sizeof(start_sector_str));
+		start_sector = 0;
+	} else {
+		start_sector += offset;
+		g_snprintf (start_sector_str, sizeof(start_sector_str),
+			    "%" G_GUINT64_FORMAT, start_sector);
+	}
+	/* the manifest value only describes the whole range */
+	if (last_sector == G_MAXUINT64 || offset != 0 || num_sectors != op->num_sectors)
+		last_sector = start_sector + num_sectors - 1;
+	return g_snprintf (buf, FU_FIREHOSE_PLAN_CMD_MAX,
+			   "<?xml version=\"1.0\" ?><data>"
+			   "<program %sSECTOR_SIZE_IN_BYTES=\"%u\" "
+			   "last_sector=\"%" G_GUINT64_FORMAT "\" "
+			   "num_partition_sectors=\"%" G_GUINT64_FORMAT "\" "
+			   "physical_partition_number=\"%u\" start_sector=\"%s\"/>"
+			   "</data>",
+			   fu_firehose_plan_op_pages_per_block_attr (op, ppb, sizeof(ppb)),
+			   op->sector_size, last_sector,
+			   num_sectors, op->physical_partition_number,
+			   start_sector_str);
+}
+
+gsize
+fu_firehose_plan_op_render_digest (const FuFirehosePlanOp *op,
+				   guint64 start_sector,
+				   guint64 num_sectors,
+				   gchar *buf)
+{
+	return g_snprintf (buf, FU_FIREHOSE_PLAN_CMD_MAX,
+			   "<?xml version=\"1.0\" ?><data>"
+			   "<getsha256digest SECTOR_SIZE_IN_BYTES=\"%u\" "
+			   "num_partition_sectors=\"%" G_GUINT64_FORMAT "\" "
+			   "physical_partition_number=\"%u\" "
+			   "start_sector=\"%" G_GUINT64_FORMAT "\"/>"
+			   "</data>",
+			   op->sector_size, num_sectors,
+			   op->physical_partition_number, start_sector);
+}
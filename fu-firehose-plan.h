@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <xmlb.h>
+
+#include "fu-firehose-archive.h"
+
+#define FU_FIREHOSE_PLAN_SECTOR_UNKNOWN		G_MAXUINT64	/* an expression such as NUM_DISK_SECTORS-5. */
+#define FU_FIREHOSE_PLAN_CMD_MAX		512		/* bytes, for any rendered command */
+
+typedef enum {
+	FU_FIREHOSE_PLAN_KIND_READ,
+	FU_FIREHOSE_PLAN_KIND_ERASE,
+	FU_FIREHOSE_PLAN_KIND_PROGRAM,
+	FU_FIREHOSE_PLAN_KIND_PATCH,
+	FU_FIREHOSE_PLAN_KIND_LAST
+} FuFirehosePlanKind;
+
+typedef struct _FuFirehosePlanOp FuFirehosePlanOp;
+
+/* one entry of the manifest with every attribute parsed and checked; the
+ * strings all point into the arena of the plan */
+struct _FuFirehosePlanOp {
+	FuFirehosePlanKind	 kind;
+	guint32			 sector_size;
+	guint32			 pages_per_block;	/* as in the manifest, may be 0 */
+	guint32			 physical_partition_number;
+	guint64			 start_sector;		/* or FU_FIREHOSE_PLAN_SECTOR_UNKNOWN */
+	guint64			 num_sectors;		/* 0 if not set for a <program> */
+	guint64			 last_sector;		/* or G_MAXUINT64 if not set */
+	const gchar		*start_sector_str;	/* as written */
+	const gchar		*name;			/* label, filename or start_sector */
+	const gchar		*phase;			/* for the trace */
+	const gchar		*filename;		/* in the archive, or %NULL */
+	const gchar		*cmd;			/* the whole <read>, <erase> or <patch> */
+	gsize			 cmd_len;
+	guint64			 image_offset;		/* bytes, from file_sector_offset */
+	guint64			 image_size;		/* as stored, 0 if not known */
+	gboolean		 image_slice;		/* only part of the file is used */
+	guint64			 image_expanded_size;	/* as programmed, 0 if not known */
+	gboolean		 image_compressed;
+	gboolean		 image_sparse;
+	FuFirehosePlanOp	*delta_erase;		/* deferred <erase>, or %NULL */
+	gboolean		 deferred;		/* erased by a <program> instead */
+};
+
+/* everything the update will do, in the order it is done: all the
+ * <read> entries, then the <erase> entries, then the <program> entries
+ * and finally the <patch> entries, each in the order of the manifests */
+typedef struct {
+	GArray			*ops;			/* of FuFirehosePlanOp */
+	GStringChunk		*arena;
+	guint			 n_ops[FU_FIREHOSE_PLAN_KIND_LAST];
+} FuFirehosePlan;
+
+FuFirehosePlan	*fu_firehose_plan_new		(XbSilo			*silo,
+						 FuFirehoseArchive	*archive,
+						 GError			**error);
+void		 fu_firehose_plan_free		(FuFirehosePlan		*self);
+FuFirehosePlanOp *fu_firehose_plan_index	(FuFirehosePlan		*self,
+						 guint			 idx);
+
+guint64		 fu_firehose_plan_op_get_size	(const FuFirehosePlanOp	*op);
+guint64		 fu_firehose_plan_op_get_block_size (const FuFirehosePlanOp *op);
+gsize		 fu_firehose_plan_op_render_erase (const FuFirehosePlanOp *op,
+						 guint64		 start_sector,
+						 guint64		 num_sectors,
+						 gchar			*buf);
+gsize		 fu_firehose_plan_op_render_program (const FuFirehosePlanOp *op,
+						 guint64		 offset,
+						 guint64		 num_sectors,
+						 gchar			*buf);
+gsize		 fu_firehose_plan_op_render_digest (const FuFirehosePlanOp *op,
+						 guint64		 start_sector,
+						 guint64		 num_sectors,
+						 gchar			*buf);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(FuFirehosePlan, fu_firehose_plan_free)
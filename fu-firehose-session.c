@@ -0,0 +1,519 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "fu-firehose-session.h"
+
+/* a session file is the magic followed by one record per bulk transfer in
+ * the order they completed, all little endian:
+ *
+ *   guint8	endpoint
+ *   guint8	flags		FU_FIREHOSE_SESSION_FLAG_*
+ *   guint64	start		us since the first transfer
+ *   guint32	latency		us
+ *   guint32	length		requested
+ *   guint32	actual_length
+ *   guint8	digest[8]	start of the SHA-256 of an OUT payload
+ *   guint32	datasz		followed by the IN payload or error message
+ *
+ * IN payloads larger than FU_FIREHOSE_SESSION_INLINE_MAX are raw partition
+ * data and are not stored; they are replayed as zeros */
+#define FU_FIREHOSE_SESSION_MAGIC		"FHSESS01"
+#define FU_FIREHOSE_SESSION_DIGEST_SIZE		8
+#define FU_FIREHOSE_SESSION_INLINE_MAX		(64 * 1024)
+#define FU_FIREHOSE_SESSION_RECORD_SIZE		(2 + 8 + 4 + 4 + 4 + FU_FIREHOSE_SESSION_DIGEST_SIZE + 4)
+
+#define FU_FIREHOSE_SESSION_FLAG_SUCCESS	(1 << 0)
+#define FU_FIREHOSE_SESSION_FLAG_TIMED_OUT	(1 << 1)
+
+#define FU_FIREHOSE_SESSION_ENDPOINT_IN		0x80
+
+static void
+fu_firehose_session_append_uint32 (GByteArray *buf, guint32 val)
+{
+	guint32 tmp = GUINT32_TO_LE (val);
+	g_byte_array_append (buf, (const guint8 *) &tmp, sizeof(tmp));
+}
+
+static void
+fu_firehose_session_append_uint64 (GByteArray *buf, guint64 val)
+{
+	guint64 tmp = GUINT64_TO_LE (val);
+	g_byte_array_append (buf, (const guint8 *) &tmp, sizeof(tmp));
+}
+
+static guint32
+fu_firehose_session_read_uint32 (const guint8 *buf)
+{
+	guint32 tmp;
+	memcpy (&tmp, buf, sizeof(tmp));
+	return GUINT32_FROM_LE (tmp);
+}
+
+static guint64
+fu_firehose_session_read_uint64 (const guint8 *buf)
+{
+	guint64 tmp;
+	memcpy (&tmp, buf, sizeof(tmp));
+	return GUINT64_FROM_LE (tmp);
+}
+
+static void
+fu_firehose_session_digest (const guint8 *buf, gsize bufsz, guint8 *digest)
+{
+	guint8 tmp[32];
+	gsize tmpsz = sizeof(tmp);
+	g_autoptr(GChecksum) csum = g_checksum_new (G_CHECKSUM_SHA256);
+
+	g_checksum_update (csum, buf, bufsz);
+	g_checksum_get_digest (csum, tmp, &tmpsz);
+	memcpy (digest, tmp, FU_FIREHOSE_SESSION_DIGEST_SIZE);
+}
+
+/* records everything that passes through @inner */
+typedef struct {
+	FuFirehoseTransport	 parent;
+	FuFirehoseTransport	*inner;
+	gchar			*fn;
+	GByteArray		*buf;
+	gint64			 epoch;		/* monotonic, us */
+} FuFirehoseSessionRecord;
+
+static void
+fu_firehose_session_record_add (FuFirehoseSessionRecord *self,
+				guint8 endpoint,
+				const guint8 *data,
+				gsize length,
+				gsize actual_length,
+				gint64 start,
+				const GError *error)
+{
+	guint8 flags = 0;
+	guint8 digest[FU_FIREHOSE_SESSION_DIGEST_SIZE] = { 0x0 };
+	gint64 now = g_get_monotonic_time ();
+
+	if (self->epoch == 0)
+		self->epoch = start;
+	if (error == NULL)
+		flags |= FU_FIREHOSE_SESSION_FLAG_SUCCESS;
+	else if (g_error_matches (error, G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_TIMED_OUT))
+		flags |= FU_FIREHOSE_SESSION_FLAG_TIMED_OUT;
+	if ((endpoint & FU_FIREHOSE_SESSION_ENDPOINT_IN) == 0)
+		fu_firehose_session_digest (data, length, digest);
+
+	g_byte_array_append (self->buf, &endpoint, 1);
+	g_byte_array_append (self->buf, &flags, 1);
+	fu_firehose_session_append_uint64 (self->buf, MAX (start - self->epoch, 0));
+	fu_firehose_session_append_uint32 (self->buf, MIN (now - start, G_MAXUINT32));
+	fu_firehose_session_append_uint32 (self->buf, length);
+	fu_firehose_session_append_uint32 (self->buf, actual_length);
+	g_byte_array_append (self->buf, digest, sizeof(digest));
+	if (error != NULL) {
+		gsize msgsz = strlen (error->message);
+		fu_firehose_session_append_uint32 (self->buf, msgsz);
+		g_byte_array_append (self->buf, (const guint8 *) error->message, msgsz);
+	} else if ((endpoint & FU_FIREHOSE_SESSION_ENDPOINT_IN) != 0 &&
+		   actual_length <= FU_FIREHOSE_SESSION_INLINE_MAX) {
+		fu_firehose_session_append_uint32 (self->buf, actual_length);
+		g_byte_array_append (self->buf, data, actual_length);
+	} else {
+		fu_firehose_session_append_uint32 (self->buf, 0);
+	}
+}
+
+static gboolean
+fu_firehose_session_record_bulk_transfer (FuFirehoseTransport *transport,
+					  guint8 endpoint,
+					  guint8 *buf,
+					  gsize length,
+					  gsize *actual_length,
+					  guint timeout,
+					  GError **error)
+{
+	FuFirehoseSessionRecord *self = (FuFirehoseSessionRecord *) transport;
+	gint64 start = g_get_monotonic_time ();
+	gsize actual_length_tmp = 0;
+	g_autoptr(GError) error_local = NULL;
+
+	if (!fu_firehose_transport_bulk_transfer (self->inner, endpoint, buf, length,
+						  &actual_length_tmp, timeout,
+						  &error_local)) {
+		fu_firehose_session_record_add (self, endpoint, buf, length,
+						actual_length_tmp, start, error_local);
+		g_propagate_error (error, g_steal_pointer (&error_local));
+		return FALSE;
+	}
+	fu_firehose_session_record_add (self, endpoint, buf, length,
+					actual_length_tmp, start, NULL);
+	if (actual_length != NULL)
+		*actual_length = actual_length_tmp;
+	return TRUE;
+}
+
+typedef struct {
+	FuFirehoseSessionRecord	*self;
+	guint8			 endpoint;
+	guint8			*buf;
+	gsize			 length;
+	gint64			 start;
+} FuFirehoseSessionRecordHelper;
+
+static void
+fu_firehose_session_record_async_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	GTask *task = G_TASK (user_data);
+	FuFirehoseSessionRecordHelper *helper = g_task_get_task_data (task);
+	GError *error = NULL;
+	gssize actual_length;
+
+	actual_length = fu_firehose_transport_bulk_transfer_finish (helper->self->inner, res, &error);
+	fu_firehose_session_record_add (helper->self, helper->endpoint,
+					helper->buf, helper->length,
+					MAX (actual_length, 0), helper->start, error);
+	if (actual_length < 0)
+		g_task_return_error (task, error);
+	else
+		g_task_return_int (task, actual_length);
+	g_object_unref (task);
+}
+
+static void
+fu_firehose_session_record_bulk_transfer_async (FuFirehoseTransport *transport,
+						guint8 endpoint,
+						guint8 *buf,
+						gsize length,
+						guint timeout,
+						GCancellable *cancellable,
+						GAsyncReadyCallback callback,
+						gpointer user_data)
+{
+	FuFirehoseSessionRecord *self = (FuFirehoseSessionRecord *) transport;
+	FuFirehoseSessionRecordHelper *helper = g_new0 (FuFirehoseSessionRecordHelper, 1);
+	GTask *task = g_task_new (NULL, cancellable, callback, user_data);
+
+	helper->self = self;
+	helper->endpoint = endpoint;
+	helper->buf = buf;
+	helper->length = length;
+	helper->start = g_get_monotonic_time ();
+	g_task_set_task_data (task, helper, g_free);
+	fu_firehose_transport_bulk_transfer_async (self->inner, endpoint, buf, length,
+						   timeout, cancellable,
+						   fu_firehose_session_record_async_cb,
+						   task);
+}
+
+static gssize
+fu_firehose_session_bulk_transfer_finish (FuFirehoseTransport *transport,
+					  GAsyncResult *res,
+					  GError **error)
+{
+	return g_task_propagate_int (G_TASK (res), error);
+}
+
+/* failures do not matter, it is only for debugging */
+static void
+fu_firehose_session_record_finalize (FuFirehoseTransport *transport)
+{
+	FuFirehoseSessionRecord *self = (FuFirehoseSessionRecord *) transport;
+	g_autoptr(GError) error_local = NULL;
+
+	if (!g_file_set_contents (self->fn, (const gchar *) self->buf->data,
+				  self->buf->len, &error_local))
+		g_warning ("failed to save session: %s", error_local->message);
+	fu_firehose_transport_free (self->inner);
+	g_byte_array_unref (self->buf);
+	g_free (self->fn);
+}
+
+static const FuFirehoseTransportVTable fu_firehose_session_record_vtable = {
+	.bulk_transfer		= fu_firehose_session_record_bulk_transfer,
+	.bulk_transfer_async	= fu_firehose_session_record_bulk_transfer_async,
+	.bulk_transfer_finish	= fu_firehose_session_bulk_transfer_finish,
+	.finalize		= fu_firehose_session_record_finalize,
+};
+
+/* takes ownership of @inner; the session is saved to @fn when freed */
+FuFirehoseTransport *
+fu_firehose_session_record_new (FuFirehoseTransport *inner, const gchar *fn)
+{
+	FuFirehoseSessionRecord *self = g_new0 (FuFirehoseSessionRecord, 1);
+	self->parent.vtable = &fu_firehose_session_record_vtable;
+	self->inner = inner;
+	self->fn = g_strdup (fn);
+	self->buf = g_byte_array_new ();
+	g_byte_array_append (self->buf, (const guint8 *) FU_FIREHOSE_SESSION_MAGIC,
+			     strlen (FU_FIREHOSE_SESSION_MAGIC));
+	return (FuFirehoseTransport *) self;
+}
+
+typedef struct {
+	guint8			 endpoint;
+	guint8			 flags;
+	guint64			 start;
+	guint32			 latency;
+	guint32			 length;
+	guint32			 actual_length;
+	guint8			 digest[FU_FIREHOSE_SESSION_DIGEST_SIZE];
+	const guint8		*data;		/* into the mapped file */
+	guint32			 datasz;
+} FuFirehoseSessionItem;
+
+/* plays a recording back to the protocol code, with the same latencies */
+typedef struct {
+	FuFirehoseTransport	 parent;
+	GMappedFile		*mapped;
+	GArray			*items;		/* of FuFirehoseSessionItem */
+	FuFirehoseReplayStats	 stats;
+} FuFirehoseSessionReplay;
+
+/* the next record, as long as it is for @endpoint */
+static FuFirehoseSessionItem *
+fu_firehose_session_replay_next (FuFirehoseSessionReplay *self,
+				 guint8 endpoint,
+				 const guint8 *buf,
+				 gsize length,
+				 GError **error)
+{
+	FuFirehoseSessionItem *item;
+
+	if (self->stats.transfers >= self->items->len) {
+		g_set_error (error,
+			     G_USB_DEVICE_ERROR,
+			     G_USB_DEVICE_ERROR_NO_DEVICE,
+			     "recording ended after %u transfers",
+			     self->stats.transfers);
+		return NULL;
+	}
+	item = &g_array_index (self->items, FuFirehoseSessionItem, self->stats.transfers);
+	if (item->endpoint != endpoint) {
+		g_set_error (error,
+			     G_USB_DEVICE_ERROR,
+			     G_USB_DEVICE_ERROR_IO,
+			     "transfer %u was to endpoint 0x%02x, not 0x%02x",
+			     self->stats.transfers, item->endpoint, endpoint);
+		return NULL;
+	}
+	self->stats.transfers++;
+
+	/* the protocol code may legitimately send something else */
+	if ((endpoint & FU_FIREHOSE_SESSION_ENDPOINT_IN) == 0) {
+		guint8 digest[FU_FIREHOSE_SESSION_DIGEST_SIZE];
+		fu_firehose_session_digest (buf, length, digest);
+		if (length != item->length ||
+		    memcmp (digest, item->digest, sizeof(digest)) != 0) {
+			g_debug ("transfer %u differs from the recording",
+				 self->stats.transfers - 1);
+			self->stats.diverged++;
+		}
+	}
+	return item;
+}
+
+static gboolean
+fu_firehose_session_replay_complete (FuFirehoseSessionItem *item,
+				     guint8 *buf,
+				     gsize length,
+				     gsize *actual_length,
+				     GError **error)
+{
+	gsize sz = MIN (item->actual_length, length);
+
+	if ((item->flags & FU_FIREHOSE_SESSION_FLAG_SUCCESS) == 0) {
+		g_autofree gchar *msg = g_strndup ((const gchar *) item->data, item->datasz);
+		g_set_error_literal (error,
+				     G_USB_DEVICE_ERROR,
+				     item->flags & FU_FIREHOSE_SESSION_FLAG_TIMED_OUT ?
+					G_USB_DEVICE_ERROR_TIMED_OUT : G_USB_DEVICE_ERROR_IO,
+				     msg);
+		return FALSE;
+	}
+	if ((item->endpoint & FU_FIREHOSE_SESSION_ENDPOINT_IN) != 0) {
+		if (item->datasz > 0)
+			memcpy (buf, item->data, MIN (sz, item->datasz));
+		else
+			memset (buf, 0x0, sz);
+	}
+	if (actual_length != NULL)
+		*actual_length = sz;
+	return TRUE;
+}
+
+static gboolean
+fu_firehose_session_replay_bulk_transfer (FuFirehoseTransport *transport,
+					  guint8 endpoint,
+					  guint8 *buf,
+					  gsize length,
+					  gsize *actual_length,
+					  guint timeout,
+					  GError **error)
+{
+	FuFirehoseSessionReplay *self = (FuFirehoseSessionReplay *) transport;
+	FuFirehoseSessionItem *item;
+
+	item = fu_firehose_session_replay_next (self, endpoint, buf, length, error);
+	if (item == NULL)
+		return FALSE;
+	g_usleep (item->latency);
+	return fu_firehose_session_replay_complete (item, buf, length, actual_length, error);
+}
+
+typedef struct {
+	FuFirehoseSessionItem	*item;
+	guint8			*buf;
+	gsize			 length;
+} FuFirehoseSessionReplayHelper;
+
+static gboolean
+fu_firehose_session_replay_timeout_cb (gpointer user_data)
+{
+	GTask *task = G_TASK (user_data);
+	FuFirehoseSessionReplayHelper *helper = g_task_get_task_data (task);
+	GError *error = NULL;
+	gsize actual_length = 0;
+
+	if (g_task_return_error_if_cancelled (task))
+		return G_SOURCE_REMOVE;
+	if (!fu_firehose_session_replay_complete (helper->item, helper->buf,
+						  helper->length, &actual_length,
+						  &error)) {
+		g_task_return_error (task, error);
+		return G_SOURCE_REMOVE;
+	}
+	g_task_return_int (task, actual_length);
+	return G_SOURCE_REMOVE;
+}
+
+/* transfers that were queued together overlap in the same way as they did
+ * on the real device, as each completes its recorded latency after it was
+ * submitted */
+static void
+fu_firehose_session_replay_bulk_transfer_async (FuFirehoseTransport *transport,
+						guint8 endpoint,
+						guint8 *buf,
+						gsize length,
+						guint timeout,
+						GCancellable *cancellable,
+						GAsyncReadyCallback callback,
+						gpointer user_data)
+{
+	FuFirehoseSessionReplay *self = (FuFirehoseSessionReplay *) transport;
+	FuFirehoseSessionReplayHelper *helper;
+	FuFirehoseSessionItem *item;
+	GError *error = NULL;
+	GTask *task = g_task_new (NULL, cancellable, callback, user_data);
+	g_autoptr(GSource) source = NULL;
+
+	item = fu_firehose_session_replay_next (self, endpoint, buf, length, &error);
+	if (item == NULL) {
+		g_task_return_error (task, error);
+		g_object_unref (task);
+		return;
+	}
+	helper = g_new0 (FuFirehoseSessionReplayHelper, 1);
+	helper->item = item;
+	helper->buf = buf;
+	helper->length = length;
+	g_task_set_task_data (task, helper, g_free);
+	source = g_timeout_source_new (item->latency / 1000);
+	g_source_set_callback (source, fu_firehose_session_replay_timeout_cb, task, g_object_unref);
+	g_source_attach (source, g_main_context_get_thread_default ());
+}
+
+static void
+fu_firehose_session_replay_finalize (FuFirehoseTransport *transport)
+{
+	FuFirehoseSessionReplay *self = (FuFirehoseSessionReplay *) transport;
+	g_array_unref (self->items);
+	g_mapped_file_unref (self->mapped);
+}
+
+static const FuFirehoseTransportVTable fu_firehose_session_replay_vtable = {
+	.bulk_transfer		= fu_firehose_session_replay_bulk_transfer,
+	.bulk_transfer_async	= fu_firehose_session_replay_bulk_transfer_async,
+	.bulk_transfer_finish	= fu_firehose_session_bulk_transfer_finish,
+	.finalize		= fu_firehose_session_replay_finalize,
+};
+
+static gboolean
+fu_firehose_session_replay_parse (FuFirehoseSessionReplay *self, GError **error)
+{
+	const guint8 *buf = (const guint8 *) g_mapped_file_get_contents (self->mapped);
+	gsize bufsz = g_mapped_file_get_length (self->mapped);
+	gsize offset = strlen (FU_FIREHOSE_SESSION_MAGIC);
+
+	if (bufsz < offset || memcmp (buf, FU_FIREHOSE_SESSION_MAGIC, offset) != 0) {
+		g_set_error_literal (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "not a firehose session");
+		return FALSE;
+	}
+	while (offset < bufsz) {
+		FuFirehoseSessionItem item = { 0 };
+		const guint8 *p = buf + offset;
+
+		if (bufsz - offset < FU_FIREHOSE_SESSION_RECORD_SIZE) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "record %u truncated", self->items->len);
+			return FALSE;
+		}
+		item.endpoint = p[0];
+		item.flags = p[1];
+		item.start = fu_firehose_session_read_uint64 (p + 2);
+		item.latency = fu_firehose_session_read_uint32 (p + 10);
+		item.length = fu_firehose_session_read_uint32 (p + 14);
+		item.actual_length = fu_firehose_session_read_uint32 (p + 18);
+		memcpy (item.digest, p + 22, sizeof(item.digest));
+		item.datasz = fu_firehose_session_read_uint32 (p + 22 + sizeof(item.digest));
+		offset += FU_FIREHOSE_SESSION_RECORD_SIZE;
+		if (item.datasz > bufsz - offset) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_INVALID_DATA,
+				     "record %u data truncated", self->items->len);
+			return FALSE;
+		}
+		item.data = buf + offset;
+		offset += item.datasz;
+		self->stats.duration = MAX (self->stats.duration, item.start + item.latency);
+		g_array_append_val (self->items, item);
+	}
+	self->stats.transfers_total = self->items->len;
+	return TRUE;
+}
+
+FuFirehoseTransport *
+fu_firehose_session_replay_new (const gchar *fn, GError **error)
+{
+	FuFirehoseSessionReplay *self;
+	GMappedFile *mapped = g_mapped_file_new (fn, FALSE, error);
+
+	if (mapped == NULL)
+		return NULL;
+	self = g_new0 (FuFirehoseSessionReplay, 1);
+	self->parent.vtable = &fu_firehose_session_replay_vtable;
+	self->mapped = mapped;
+	self->items = g_array_new (FALSE, FALSE, sizeof(FuFirehoseSessionItem));
+	if (!fu_firehose_session_replay_parse (self, error)) {
+		fu_firehose_transport_free ((FuFirehoseTransport *) self);
+		return NULL;
+	}
+	return (FuFirehoseTransport *) self;
+}
+
+const FuFirehoseReplayStats *
+fu_firehose_session_replay_get_stats (FuFirehoseTransport *transport)
+{
+	FuFirehoseSessionReplay *self = (FuFirehoseSessionReplay *) transport;
+	g_return_val_if_fail (transport->vtable == &fu_firehose_session_replay_vtable, NULL);
+	return &self->stats;
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include "fu-firehose-transport.h"
+
+typedef struct {
+	guint			 transfers;	/* replayed so far */
+	guint			 transfers_total; /* in the recording */
+	guint			 diverged;	/* OUT payloads that differ */
+	guint64			 duration;	/* of the recording, us */
+} FuFirehoseReplayStats;
+
+FuFirehoseTransport *fu_firehose_session_record_new (FuFirehoseTransport *inner,
+						 const gchar		*fn);
+FuFirehoseTransport *fu_firehose_session_replay_new (const gchar	*fn,
+						 GError			**error);
+const FuFirehoseReplayStats *fu_firehose_session_replay_get_stats (FuFirehoseTransport *transport);
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include "config.h"
+
+#include <gio/gio.h>
+
+#include "fu-common.h"
+#include "fu-firehose-trace.h"
+
+static void
+fu_firehose_trace_phase_free (FuFirehoseTracePhase *phase)
+{
+	g_free (phase->name);
+	g_free (phase);
+}
+
+void
+fu_firehose_trace_init (FuFirehoseTrace *self)
+{
+	self->phases = g_ptr_array_new_with_free_func ((GDestroyNotify) fu_firehose_trace_phase_free);
+	fu_firehose_trace_reset (self);
+}
+
+void
+fu_firehose_trace_clear (FuFirehoseTrace *self)
+{
+	g_clear_pointer (&self->phases, g_ptr_array_unref);
+	self->phase = NULL;
+}
+
+void
+fu_firehose_trace_reset (FuFirehoseTrace *self)
+{
+	self->started = g_get_monotonic_time ();
+	self->items_total = 0;
+	self->bytes_total = 0;
+	self->phase = NULL;
+	g_ptr_array_set_size (self->phases, 0);
+}
+
+/* @start is the monotonic time the transfer was started at */
+void
+fu_firehose_trace_add (FuFirehoseTrace *self,
+		       guint8 endpoint,
+		       gsize length,
+		       gint64 start,
+		       gboolean success)
+{
+	FuFirehoseTraceItem *item = &self->items[self->items_total % FU_FIREHOSE_TRACE_SIZE];
+
+	item->start = start - self->started;
+	item->latency = MIN (g_get_monotonic_time () - start, G_MAXUINT32);
+	item->length = MIN (length, G_MAXUINT32);
+	item->endpoint = endpoint;
+	item->success = success;
+	self->items_total++;
+	if (success)
+		self->bytes_total += length;
+}
+
+/* phases do not nest, so this ends the current one */
+void
+fu_firehose_trace_phase_begin (FuFirehoseTrace *self, const gchar *name)
+{
+	fu_firehose_trace_phase_end (self);
+	self->phase = g_new0 (FuFirehoseTracePhase, 1);
+	self->phase->name = g_strdup (name);
+	self->phase_start = g_get_monotonic_time ();
+	self->phase_bytes = self->bytes_total;
+	g_ptr_array_add (self->phases, self->phase);
+}
+
+void
+fu_firehose_trace_phase_end (FuFirehoseTrace *self)
+{
+	if (self->phase == NULL)
+		return;
+	self->phase->elapsed = g_get_monotonic_time () - self->phase_start;
+	self->phase->bytes = self->bytes_total - self->phase_bytes;
+	self->phase = NULL;
+}
+
+static gdouble
+fu_firehose_trace_phase_get_rate (FuFirehoseTracePhase *phase)
+{
+	if (phase->elapsed <= 0)
+		return 0.f;
+	return (gdouble) phase->bytes / phase->elapsed;	/* MB/s */
+}
+
+void
+fu_firehose_trace_to_string (FuFirehoseTrace *self, guint idt, GString *str)
+{
+	fu_common_string_append_ku (str, idt, "Transfers", self->items_total);
+	fu_common_string_append_ku (str, idt, "TransferBytes", self->bytes_total);
+	for (guint i = 0; i < self->phases->len; i++) {
+		FuFirehoseTracePhase *phase = g_ptr_array_index (self->phases, i);
+		g_autofree gchar *tmp = NULL;
+		tmp = g_strdup_printf ("%" G_GINT64_FORMAT "ms, %" G_GUINT64_FORMAT " bytes, %.1fMB/s",
+				       phase->elapsed / 1000, phase->bytes,
+				       fu_firehose_trace_phase_get_rate (phase));
+		fu_common_string_append_kv (str, idt, phase->name, tmp);
+	}
+}
+
+static void
+fu_firehose_trace_append_json_string (GString *str, const gchar *value)
+{
+	g_string_append_c (str, '"');
+	for (const gchar *p = value; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\')
+			g_string_append_printf (str, "\\%c", *p);
+		else if ((guchar) *p < 0x20)
+			g_string_append_printf (str, "\\u%04x", (guint) *p);
+		else
+			g_string_append_c (str, *p);
+	}
+	g_string_append_c (str, '"');
+}
+
+/* the phases and the transfers still in the ring buffer, oldest first */
+gboolean
+fu_firehose_trace_save (FuFirehoseTrace *self, const gchar *fn, GError **error)
+{
+	g_autoptr(GString) str = g_string_new ("{\n  \"phases\": [");
+	guint64 first = 0;
+
+	fu_firehose_trace_phase_end (self);
+	for (guint i = 0; i < self->phases->len; i++) {
+		FuFirehoseTracePhase *phase = g_ptr_array_index (self->phases, i);
+		g_string_append (str, i == 0 ? "\n    {\"name\": " : ",\n    {\"name\": ");
+		fu_firehose_trace_append_json_string (str, phase->name);
+		g_string_append_printf (str,
+					", \"elapsed_us\": %" G_GINT64_FORMAT
+					", \"bytes\": %" G_GUINT64_FORMAT
+					", \"mbps\": %.3f}",
+					phase->elapsed, phase->bytes,
+					fu_firehose_trace_phase_get_rate (phase));
+	}
+	g_string_append (str, "\n  ],\n");
+
+	if (self->items_total > FU_FIREHOSE_TRACE_SIZE)
+		first = self->items_total - FU_FIREHOSE_TRACE_SIZE;
+	g_string_append_printf (str, "  \"dropped\": %" G_GUINT64_FORMAT ",\n", first);
+	g_string_append (str, "  \"transfers\": [");
+	for (guint64 i = first; i < self->items_total; i++) {
+		FuFirehoseTraceItem *item = &self->items[i % FU_FIREHOSE_TRACE_SIZE];
+		g_string_append_printf (str,
+					"%s\n    {\"start_us\": %" G_GINT64_FORMAT
+					", \"endpoint\": %u, \"length\": %u"
+					", \"latency_us\": %u, \"success\": %s}",
+					i == first ? "" : ",",
+					item->start, item->endpoint, item->length,
+					item->latency, item->success ? "true" : "false");
+	}
+	g_string_append (str, "\n  ]\n}\n");
+	return g_file_set_contents (fn, str->str, str->len, error);
+}
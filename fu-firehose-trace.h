@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#define FU_FIREHOSE_TRACE_SIZE			4096	/* transfers kept */
+
+typedef struct {
+	gint64			 start;		/* us, since the trace was reset */
+	guint32			 latency;	/* us */
+	guint32			 length;
+	guint8			 endpoint;
+	gboolean		 success;
+} FuFirehoseTraceItem;
+
+typedef struct {
+	gchar			*name;
+	gint64			 elapsed;	/* us */
+	guint64			 bytes;
+} FuFirehoseTracePhase;
+
+/* the last USB transfers in a ring buffer, and the time spent in each
+ * phase of the update; recording a transfer does not allocate */
+typedef struct {
+	gint64			 started;	/* monotonic, us */
+	FuFirehoseTraceItem	 items[FU_FIREHOSE_TRACE_SIZE];
+	guint64			 items_total;
+	guint64			 bytes_total;
+	GPtrArray		*phases;	/* of FuFirehoseTracePhase */
+	FuFirehoseTracePhase	*phase;		/* current, or %NULL */
+	gint64			 phase_start;
+	guint64			 phase_bytes;
+} FuFirehoseTrace;
+
+void		 fu_firehose_trace_init		(FuFirehoseTrace	*self);
+void		 fu_firehose_trace_clear	(FuFirehoseTrace	*self);
+void		 fu_firehose_trace_reset	(FuFirehoseTrace	*self);
+void		 fu_firehose_trace_add		(FuFirehoseTrace	*self,
+						 guint8			 endpoint,
+						 gsize			 length,
+						 gint64			 start,
+						 gboolean		 success);
+void		 fu_firehose_trace_phase_begin	(FuFirehoseTrace	*self,
+						 const gchar		*name);
+void		 fu_firehose_trace_phase_end	(FuFirehoseTrace	*self);
+void		 fu_firehose_trace_to_string	(FuFirehoseTrace	*self,
+						 guint			 idt,
+						 GString		*str);
+gboolean	 fu_firehose_trace_save		(FuFirehoseTrace	*self,
+						 const gchar		*fn,
+						 GError			**error);
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include "config.h"
+
+#include "fu-firehose-transport.h"
+
+void
+fu_firehose_transport_free (FuFirehoseTransport *self)
+{
+	if (self->vtable->finalize != NULL)
+		self->vtable->finalize (self);
+	g_free (self);
+}
+
+gboolean
+fu_firehose_transport_bulk_transfer (FuFirehoseTransport *self,
+				     guint8 endpoint,
+				     guint8 *buf,
+				     gsize length,
+				     gsize *actual_length,
+				     guint timeout,
+				     GError **error)
+{
+	return self->vtable->bulk_transfer (self, endpoint, buf, length,
+					    actual_length, timeout, error);
+}
+
+typedef struct {
+	FuFirehoseTransport	*transport;
+	guint8			 endpoint;
+	guint8			*buf;
+	gsize			 length;
+	guint			 timeout;
+} FuFirehoseTransportHelper;
+
+static gboolean
+fu_firehose_transport_idle_cb (gpointer user_data)
+{
+	GTask *task = G_TASK (user_data);
+	FuFirehoseTransportHelper *helper = g_task_get_task_data (task);
+	GError *error = NULL;
+	gsize actual_length = 0;
+
+	if (g_task_return_error_if_cancelled (task))
+		return G_SOURCE_REMOVE;
+	if (!fu_firehose_transport_bulk_transfer (helper->transport,
+						  helper->endpoint,
+						  helper->buf,
+						  helper->length,
+						  &actual_length,
+						  helper->timeout,
+						  &error)) {
+		g_task_return_error (task, error);
+		return G_SOURCE_REMOVE;
+	}
+	g_task_return_int (task, actual_length);
+	return G_SOURCE_REMOVE;
+}
+
+void
+fu_firehose_transport_bulk_transfer_async (FuFirehoseTransport *self,
+					   guint8 endpoint,
+					   guint8 *buf,
+					   gsize length,
+					   guint timeout,
+					   GCancellable *cancellable,
+					   GAsyncReadyCallback callback,
+					   gpointer user_data)
+{
+	FuFirehoseTransportHelper *helper;
+	GTask *task;
+	g_autoptr(GSource) source = NULL;
+
+	if (self->vtable->bulk_transfer_async != NULL) {
+		self->vtable->bulk_transfer_async (self, endpoint, buf, length, timeout,
+						   cancellable, callback, user_data);
+		return;
+	}
+
+	/* completed on a later iteration, never from inside this call */
+	helper = g_new0 (FuFirehoseTransportHelper, 1);
+	helper->transport = self;
+	helper->endpoint = endpoint;
+	helper->buf = buf;
+	helper->length = length;
+	helper->timeout = timeout;
+	task = g_task_new (NULL, cancellable, callback, user_data);
+	g_task_set_task_data (task, helper, g_free);
+	source = g_idle_source_new ();
+	g_source_set_callback (source, fu_firehose_transport_idle_cb, task, g_object_unref);
+	g_source_attach (source, g_main_context_get_thread_default ());
+}
+
+gssize
+fu_firehose_transport_bulk_transfer_finish (FuFirehoseTransport *self,
+					    GAsyncResult *res,
+					    GError **error)
+{
+	if (self->vtable->bulk_transfer_finish != NULL)
+		return self->vtable->bulk_transfer_finish (self, res, error);
+	return g_task_propagate_int (G_TASK (res), error);
+}
+
+/* the real device */
+typedef struct {
+	FuFirehoseTransport	 parent;
+	GUsbDevice		*usb_device;
+} FuFirehoseTransportUsb;
+
+static gboolean
+fu_firehose_transport_usb_bulk_transfer (FuFirehoseTransport *transport,
+					 guint8 endpoint,
+					 guint8 *buf,
+					 gsize length,
+					 gsize *actual_length,
+					 guint timeout,
+					 GError **error)
+{
+	FuFirehoseTransportUsb *self = (FuFirehoseTransportUsb *) transport;
+	return g_usb_device_bulk_transfer (self->usb_device, endpoint, buf, length,
+					   actual_length, timeout, NULL, error);
+}
+
+static void
+fu_firehose_transport_usb_bulk_transfer_async (FuFirehoseTransport *transport,
+					       guint8 endpoint,
+					       guint8 *buf,
+					       gsize length,
+					       guint timeout,
+					       GCancellable *cancellable,
+					       GAsyncReadyCallback callback,
+					       gpointer user_data)
+{
+	FuFirehoseTransportUsb *self = (FuFirehoseTransportUsb *) transport;
+	g_usb_device_bulk_transfer_async (self->usb_device, endpoint, buf, length,
+					  timeout, cancellable, callback, user_data);
+}
+
+static gssize
+fu_firehose_transport_usb_bulk_transfer_finish (FuFirehoseTransport *transport,
+						GAsyncResult *res,
+						GError **error)
+{
+	FuFirehoseTransportUsb *self = (FuFirehoseTransportUsb *) transport;
+	return g_usb_device_bulk_transfer_finish (self->usb_device, res, error);
+}
+
+static void
+fu_firehose_transport_usb_finalize (FuFirehoseTransport *transport)
+{
+	FuFirehoseTransportUsb *self = (FuFirehoseTransportUsb *) transport;
+	g_object_unref (self->usb_device);
+}
+
+static const FuFirehoseTransportVTable fu_firehose_transport_usb_vtable = {
+	.bulk_transfer		= fu_firehose_transport_usb_bulk_transfer,
+	.bulk_transfer_async	= fu_firehose_transport_usb_bulk_transfer_async,
+	.bulk_transfer_finish	= fu_firehose_transport_usb_bulk_transfer_finish,
+	.finalize		= fu_firehose_transport_usb_finalize,
+};
+
+FuFirehoseTransport *
+fu_firehose_transport_usb_new (GUsbDevice *usb_device)
+{
+	FuFirehoseTransportUsb *self = g_new0 (FuFirehoseTransportUsb, 1);
+	self->parent.vtable = &fu_firehose_transport_usb_vtable;
+	self->usb_device = g_object_ref (usb_device);
+	return (FuFirehoseTransport *) self;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2018 Richard Hughes <richard@hughsie.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <gusb.h>
+
+typedef struct _FuFirehoseTransport FuFirehoseTransport;
+
+/* how bulk transfers reach the target; a transport without the async
+ * vfuncs has its synchronous transfer run from an idle on the
+ * thread-default main context instead */
+typedef struct {
+	gboolean	 (*bulk_transfer)	(FuFirehoseTransport	*self,
+						 guint8			 endpoint,
+						 guint8			*buf,
+						 gsize			 length,
+						 gsize			*actual_length,
+						 guint			 timeout,
+						 GError			**error);
+	void		 (*bulk_transfer_async)	(FuFirehoseTransport	*self,
+						 guint8			 endpoint,
+						 guint8			*buf,
+						 gsize			 length,
+						 guint			 timeout,
+						 GCancellable		*cancellable,
+						 GAsyncReadyCallback	 callback,
+						 gpointer		 user_data);
+	gssize		 (*bulk_transfer_finish) (FuFirehoseTransport	*self,
+						 GAsyncResult		*res,
+						 GError			**error);
+	void		 (*finalize)		(FuFirehoseTransport	*self);
+} FuFirehoseTransportVTable;
+
+/* embedded as the first member of each implementation */
+struct _FuFirehoseTransport {
+	const FuFirehoseTransportVTable	*vtable;
+};
+
+FuFirehoseTransport *fu_firehose_transport_usb_new (GUsbDevice		*usb_device);
+void		 fu_firehose_transport_free	(FuFirehoseTransport	*self);
+gboolean	 fu_firehose_transport_bulk_transfer (FuFirehoseTransport *self,
+						 guint8			 endpoint,
+						 guint8			*buf,
+						 gsize			 length,
+						 gsize			*actual_length,
+						 guint			 timeout,
+						 GError			**error);
+void		 fu_firehose_transport_bulk_transfer_async (FuFirehoseTransport *self,
+						 guint8			 endpoint,
+						 guint8			*buf,
+						 gsize			 length,
+						 guint			 timeout,
+						 GCancellable		*cancellable,
+						 GAsyncReadyCallback	 callback,
+						 gpointer		 user_data);
+gssize		 fu_firehose_transport_bulk_transfer_finish (FuFirehoseTransport *self,
+						 GAsyncResult		*res,
+						 GError			**error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(FuFirehoseTransport, fu_firehose_transport_free)
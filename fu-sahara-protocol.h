@@ -103,6 +103,14 @@ typedef struct
     uint32_t datalen;
 } sahara_read_data;
 
+typedef struct
+{
+    SAHARA_COMMON_HDR;
+    uint64_t image_id;
+    uint64_t offset;
+    uint64_t datalen;
+} sahara_read_data_64;
+
 typedef struct
 {
     SAHARA_COMMON_HDR;
@@ -138,6 +146,46 @@ typedef struct
     uint32_t mem_tb_len;
 } sahara_debug;
 
+typedef struct
+{
+    SAHARA_COMMON_HDR;
+    uint64_t mem_tb_addr;
+    uint64_t mem_tb_len;
+} sahara_debug_64;
+
+typedef struct
+{
+    SAHARA_COMMON_HDR;
+    uint32_t mem_addr;
+    uint32_t len;
+} sahara_mem_read;
+
+typedef struct
+{
+    SAHARA_COMMON_HDR;
+    uint64_t mem_addr;
+    uint64_t len;
+} sahara_mem_read_64;
+
+/* one region in the memory table sent in memory debug mode */
+typedef struct
+{
+    uint32_t save_pref;
+    uint32_t mem_base;
+    uint32_t length;
+    char desc[20];
+    char filename[20];
+} sahara_mem_table_entry;
+
+typedef struct
+{
+    uint64_t save_pref;
+    uint64_t mem_base;
+    uint64_t length;
+    char desc[20];
+    char filename[20];
+} sahara_mem_table_entry_64;
+
 typedef struct
 {
     SAHARA_COMMON_HDR;